@@ -0,0 +1,662 @@
+/*
+ * ropebench.c
+ * This file is part of CRopes: A Ropes data type for CPython
+ *
+ * Copyright (C) 2007 - Travis Athougies
+ *
+ * CRopes: A Ropes data type for CPython is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * CRopes: A Ropes data type for CPython is distributed in the hope
+ * that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CRopes: A Ropes data type for CPython; if not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/* Native driver for the rope core, without the interpreter in the way.
+ *
+ *	cc -O2 -o ropebench bench/ropebench.c -lz
+ *	./ropebench fuzz [iterations [seed [hot_bytes]]]
+ *	./ropebench bench
+ *
+ * "fuzz" applies random operations to a pool of ropes and checks every
+ * result against a flat copy of the same bytes, then checks that all
+ * memory was given back.  Given hot_bytes, it runs with leaf compression
+ * on and that budget, so that leaves keep going cold under it, and with
+ * the flatten cache on with the same budget, and it keeps switching
+ * shape policies.  "bench" times concat, slice, index and balance in
+ * cycles (time stamp counter ticks) per operation, or in nanoseconds
+ * where no counter is available, then an editing and a scanning workload
+ * under a few shape policies (see RopePolicy).
+ */
+
+#define ROPE_STANDALONE 1
+#include "../src/ropecore.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICKS() __rdtsc()
+#define TICK_UNIT "cycles"
+#else
+static unsigned long long
+ticks_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#define TICKS() ticks_ns()
+#define TICK_UNIT "ns"
+#endif
+
+#define POOL_SIZE 32
+#define FUZZ_MAX_LENGTH (1 << 20)
+
+typedef struct FlatRope {
+	RopeObject *rope;
+	char *flat;		/* the same bytes, the slow way */
+	Py_ssize_t length;
+} FlatRope;
+
+static unsigned long long rng_state = 88172645463325252ull;
+static long live_allocations;
+
+static unsigned long long
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/* Seed the generator with one splitmix64 step of seed, so that nearby
+ * seeds give unrelated streams.  xorshift must not start from 0. */
+static void
+rng_seed(unsigned long long seed)
+{
+	seed += 0x9e3779b97f4a7c15ull;
+	seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+	seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+	rng_state = seed ^ (seed >> 31);
+	if (rng_state == 0)
+		rng_state = 88172645463325252ull;
+}
+
+static Py_ssize_t
+rng_below(Py_ssize_t n)
+{
+	return n > 0 ? (Py_ssize_t) (rng() % (unsigned long long) n) : 0;
+}
+
+static void *
+counting_alloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (p)
+		live_allocations++;
+	return p;
+}
+
+static void
+counting_release(void *p)
+{
+	if (p)
+		live_allocations--;
+	free(p);
+}
+
+static void
+fail(const char *what, unsigned long iteration)
+{
+	fprintf(stderr, "ropebench: %s at iteration %lu (%s)\n", what,
+		iteration, rope_error ? rope_error : "no error set");
+	exit(1);
+}
+
+static RopeObject *
+random_leaf(Py_ssize_t length)
+{
+	RopeObject *leaf;
+	Py_ssize_t i;
+
+	leaf = rope_from_string(NULL, length);
+	if (leaf == NULL)
+		return NULL;
+	for (i = 0; i < length; i++)
+		leaf->v.literal[i] = "abcdefgh"[rng() & 7];
+	return leaf;
+}
+
+/* Compare everything a rope hands out against the flat copy. */
+static int
+fuzz_check(FlatRope *f)
+{
+	char *copy, *p;
+	const char *run;
+	Py_ssize_t i, before, after, start, stop, step, count, k;
+	char set[256];
+	RopeSpan spans[16];
+	int ok = 1, c;
+
+	if (f->rope->length != f->length)
+		return 0;
+	if (compress_enabled && (rng() & 7) == 0 &&
+	    rope_compress_leaves(f->rope) < 0)
+		return 0;
+	if (flat_max_bytes > 0 && (rng() & 7) == 0 && f->rope->flat == NULL) {
+		/* the cache frees it, so it comes from the allocator */
+		copy = ROPE_MALLOC(f->length + 1);
+		p = copy;
+		if (copy == NULL || _rope_str(f->rope, &p) < 0 ||
+		    rope_flat_attach(f->rope, NULL, copy, 0) != 1)
+			ROPE_FREE(copy);
+	}
+	if ((rng() & 15) == 0) {
+		/* as a buffer export would */
+		if (f->rope->type == LITERAL_NODE &&
+		    rope_literal_pin(f->rope) == NULL)
+			return 0;
+		if (f->rope->flat)
+			rope_flat_pin(f->rope);
+	}
+	copy = malloc(f->length + 1);
+	p = copy;
+	if (_rope_str(f->rope, &p) < 0)
+		p = NULL;
+	if (p != copy + f->length || memcmp(copy, f->flat, f->length) != 0)
+		ok = 0;
+	for (k = 0; ok && k < 16 && f->length > 0; k++) {
+		i = rng_below(f->length);
+		if (rope_index(f->rope, i) != (unsigned char) f->flat[i])
+			ok = 0;
+		run = rope_chunk(f->rope, i, &before, &after);
+		if (run == NULL || before > i || after < 1 ||
+		    after > f->length - i ||
+		    memcmp(run - before, f->flat + i - before,
+			   before + after) != 0)
+			ok = 0;
+	}
+	if (ok && f->length > 0) {
+		start = rng_below(f->length);
+		stop = start + rng_below(f->length - start + 1);
+		c = "abcdefgh"[rng() & 7] ^ (int) (rng() & 3);
+		for (count = 0, k = start; k < stop; k++)
+			count += ((unsigned char) f->flat[k] == c);
+		if (rope_count_byte(f->rope, start, stop, c) != count ||
+		    rope_match(f->rope, start, f->flat + start,
+			       stop - start) != 1)
+			ok = 0;
+		memset(set, 0, sizeof(set));
+		set[(unsigned char) f->flat[0]] = 1;
+		set[(unsigned char) f->flat[f->length - 1]] = 1;
+		for (k = 0; k < f->length && set[(unsigned char) f->flat[k]]; k++)
+			;
+		if (rope_span(f->rope, set, 0) != k)
+			ok = 0;
+		for (k = 0; k < f->length &&
+			     set[(unsigned char) f->flat[f->length - 1 - k]]; k++)
+			;
+		if (rope_span(f->rope, set, 1) != k)
+			ok = 0;
+	}
+	if (ok && f->length > 0) {
+		start = rng_below(f->length);
+		step = rng_below(7) + 1;
+		if (rng() & 1) {
+			count = start / step + 1;
+			step = -step;
+		}
+		else
+			count = (f->length - 1 - start) / step + 1;
+		if (_rope_str_strided(f->rope, start, step, count, copy) != 0)
+			ok = 0;
+		for (k = 0; ok && k < count; k++)
+			if (copy[k] != f->flat[start + k * step])
+				ok = 0;
+	}
+	if (ok && f->length > 0) {
+		/* sorted spans, some overlapping, into one buffer */
+		count = rng_below(16) + 1;
+		for (k = 0, p = copy, start = 0; k < count; k++) {
+			start += rng_below(f->length / count + 1);
+			if (start >= f->length)
+				start = f->length - 1;
+			spans[k].start = start;
+			spans[k].length = rng_below(f->length - start + 1);
+			if (p + spans[k].length > copy + f->length)
+				spans[k].length = copy + f->length - p;
+			spans[k].dst = p;
+			p += spans[k].length;
+		}
+		if (rope_gather(f->rope, spans, count) != 0)
+			ok = 0;
+		for (k = 0; ok && k < count; k++)
+			if (memcmp(spans[k].dst, f->flat + spans[k].start,
+				   spans[k].length) != 0)
+				ok = 0;
+	}
+	free(copy);
+	return ok;
+}
+
+static void
+fuzz_set(FlatRope *f, RopeObject *rope, char *flat, Py_ssize_t length)
+{
+	ROPE_XDECREF(f->rope);
+	free(f->flat);
+	f->rope = rope;
+	f->flat = flat;
+	f->length = length;
+}
+
+/* Now and then, shape ropes by another policy. */
+static void
+fuzz_policy(void)
+{
+	static const Py_ssize_t leaf_lengths[] = { 1, 64, 1024, 65536 };
+	static const int depths[] = { 16, 32, 64 };
+
+	rope_policy.leaf_length = leaf_lengths[rng_below(4)];
+	rope_policy.balance_depth = depths[rng_below(3)];
+	rope_policy.adaptive = rng_below(4) == 0;
+}
+
+static int
+fuzz(unsigned long iterations)
+{
+	FlatRope pool[POOL_SIZE];
+	FlatRope *a, *b;
+	RopeObject *result;
+	RopeBalanceState state;
+	unsigned char table[256];
+	char *flat;
+	Py_ssize_t start, stop, length, i;
+	unsigned long n;
+	int count, op, c;
+
+	memset(pool, 0, sizeof(pool));
+	for (i = 0; i < POOL_SIZE; i++) {
+		length = rng_below(2 * MIN_LITERAL_LENGTH);
+		result = random_leaf(length);
+		if (result == NULL)
+			fail("allocation failed", 0);
+		flat = malloc(length + 1);
+		memcpy(flat, result->v.literal, length);
+		fuzz_set(&pool[i], result, flat, length);
+	}
+
+	for (n = 0; n < iterations; n++) {
+		if (n % 512 == 511)
+			fuzz_policy();
+		a = &pool[rng_below(POOL_SIZE)];
+		b = &pool[rng_below(POOL_SIZE)];
+		op = (int) rng_below(7);
+		switch (op) {
+		case 0:
+			if (a->length + b->length > FUZZ_MAX_LENGTH)
+				continue;
+			result = rope_concat(a->rope, b->rope);
+			length = a->length + b->length;
+			flat = malloc(length + 1);
+			memcpy(flat, a->flat, a->length);
+			memcpy(flat + a->length, b->flat, b->length);
+			break;
+		case 1:
+			start = rng_below(a->length + 2) - 1;
+			stop = rng_below(a->length + 2) - 1;
+			result = rope_slice(a->rope, start, stop);
+			if (start < 0)
+				start = 0;
+			if (stop > a->length)
+				stop = a->length;
+			length = stop > start ? stop - start : 0;
+			flat = malloc(length + 1);
+			memcpy(flat, a->flat + start, length);
+			break;
+		case 2:
+			count = (int) rng_below(6);
+			if (a->length * count > FUZZ_MAX_LENGTH)
+				continue;
+			result = rope_repeat(a->rope, count);
+			length = a->length * count;
+			flat = malloc(length + 1);
+			for (i = 0; i < count; i++)
+				memcpy(flat + i * a->length, a->flat,
+				       a->length);
+			break;
+		case 3:
+			c = (int) rng_below(256);
+			for (i = 0; i < 256; i++)
+				table[i] = (unsigned char) (i ^ c);
+			result = rope_transform(a->rope, table);
+			length = a->length;
+			flat = malloc(length + 1);
+			for (i = 0; i < length; i++)
+				flat[i] = (char) table[(unsigned char) a->flat[i]];
+			break;
+		case 4:
+			result = rope_balance(a->rope);
+			length = a->length;
+			flat = malloc(length + 1);
+			memcpy(flat, a->flat, length);
+			break;
+		case 5:
+			/* replace a[start:stop] by b, as an edit does */
+			if (a->length + b->length > FUZZ_MAX_LENGTH)
+				continue;
+			start = rng_below(a->length + 1);
+			stop = start + rng_below(a->length - start + 1);
+			rope_balance_init(&state);
+			if (rope_balance_range(&state, a->rope, 0, start) != 0 ||
+			    rope_balance_range(&state, b->rope, 0,
+					       b->length) != 0 ||
+			    rope_balance_range(&state, a->rope, stop,
+					       a->length) != 0) {
+				rope_balance_clear(&state);
+				fail("operation failed", n);
+			}
+			result = rope_balance_finish(&state);
+			length = a->length - (stop - start) + b->length;
+			flat = malloc(length + 1);
+			memcpy(flat, a->flat, start);
+			memcpy(flat + start, b->flat, b->length);
+			memcpy(flat + start + b->length, a->flat + stop,
+			       a->length - stop);
+			break;
+		default:
+			length = rng_below(3 * MIN_LITERAL_LENGTH);
+			result = random_leaf(length);
+			flat = malloc(length + 1);
+			if (result)
+				memcpy(flat, result->v.literal, length);
+			break;
+		}
+		if (result == NULL)
+			fail("operation failed", n);
+		/* the result replaces any member of the pool, perhaps one
+		 * of its own operands */
+		i = rng_below(POOL_SIZE);
+		fuzz_set(&pool[i], result, flat, length);
+		if (!fuzz_check(&pool[i]))
+			fail("mismatch", n);
+	}
+
+	for (i = 0; i < POOL_SIZE; i++)
+		fuzz_set(&pool[i], NULL, NULL, 0);
+	rope_policy.leaf_length = MIN_LITERAL_LENGTH;
+	rope_policy.balance_depth = ROPE_BALANCE_DEPTH;
+	rope_policy.adaptive = 0;
+	if (compress_stats.hot_leaves != 0 || compress_stats.cold_leaves != 0 ||
+	    compress_stats.packed_bytes != 0)
+		fail("compression counters not back to zero", n);
+	if (flat_count != 0 || flat_bytes != 0 || flat_pinned_bytes != 0)
+		fail("flatten cache not back to empty", n);
+	if (live_allocations != 0) {
+		fprintf(stderr, "ropebench: %ld allocations leaked\n",
+			live_allocations);
+		return 1;
+	}
+	printf("fuzz: %lu operations ok", iterations);
+	if (compress_enabled)
+		printf(", %ld compressions, %ld decompressions, "
+		       "%ld flat copies evicted",
+		       (long) compress_stats.compressions,
+		       (long) compress_stats.decompressions,
+		       (long) flat_evictions);
+	printf("\n");
+	return 0;
+}
+
+/* A rope of nleaves leaves of leaf_length bytes each, built by appending. */
+static RopeObject *
+bench_rope(Py_ssize_t nleaves, Py_ssize_t leaf_length)
+{
+	RopeObject *rope, *leaf, *next;
+	Py_ssize_t i;
+
+	rope = rope_from_string("", 0);
+	for (i = 0; rope && i < nleaves; i++) {
+		leaf = random_leaf(leaf_length);
+		if (leaf == NULL)
+			break;
+		next = rope_concat(rope, leaf);
+		ROPE_DECREF(leaf);
+		ROPE_DECREF(rope);
+		rope = next;
+	}
+	return rope;
+}
+
+static void
+report(const char *name, unsigned long long ticks, unsigned long ops)
+{
+	printf("%-28s %12.1f %s/op\n", name, (double) ticks / ops, TICK_UNIT);
+}
+
+/* Editing: insert 16 bytes at random places in a 1MB rope, the way
+ * RopeEditor.commit() does. */
+static unsigned long long
+bench_edits(unsigned long ops)
+{
+	RopeObject *rope, *leaf;
+	RopeBalanceState state;
+	unsigned long long t;
+	Py_ssize_t pos;
+	unsigned long i;
+
+	rope = bench_rope(1 << 14, 64);
+	leaf = random_leaf(16);
+	if (rope == NULL || leaf == NULL)
+		fail("allocation failed", 0);
+	t = TICKS();
+	for (i = 0; i < ops; i++) {
+		pos = rng_below(rope->length + 1);
+		rope_balance_init(&state);
+		if (rope_balance_range(&state, rope, 0, pos) != 0 ||
+		    rope_balance_range(&state, leaf, 0, leaf->length) != 0 ||
+		    rope_balance_range(&state, rope, pos, rope->length) != 0)
+			fail("operation failed", i);
+		ROPE_DECREF(rope);
+		rope = rope_balance_finish(&state);
+		if (rope == NULL)
+			fail("operation failed", i);
+		rope_policy_note(1, 0);
+	}
+	t = TICKS() - t;
+	ROPE_DECREF(leaf);
+	ROPE_DECREF(rope);
+	return t;
+}
+
+/* Scanning: build 16MB from 80 byte lines, as a builder would, then read
+ * it through a run at a time; rounds times over. */
+static unsigned long long
+bench_scans(int rounds, long *sum)
+{
+	RopeObject *rope, *line;
+	RopeBalanceState state;
+	unsigned long long t = 0;
+	Py_ssize_t pos, before, after;
+	const char *run;
+	int round;
+
+	line = random_leaf(80);
+	if (line == NULL)
+		fail("allocation failed", 0);
+	for (round = 0; round < rounds; round++) {
+		rope_balance_init(&state);
+		for (pos = 0; pos < (16 << 20); pos += line->length)
+			if (rope_balance_range(&state, line, 0,
+					       line->length) != 0)
+				fail("operation failed", 0);
+		rope = rope_balance_finish(&state);
+		if (rope == NULL)
+			fail("operation failed", 0);
+		t -= TICKS();
+		for (pos = 0; pos < rope->length; pos += after) {
+			run = rope_chunk(rope, pos, &before, &after);
+			*sum += run[after - 1];
+		}
+		t += TICKS();
+		ROPE_DECREF(rope);
+	}
+	ROPE_DECREF(line);
+	return t;
+}
+
+/* The same two workloads under a few shape policies. */
+static long
+bench_policy(void)
+{
+	static const struct {
+		const char *name;
+		Py_ssize_t leaf_length;
+		int balance_depth, adaptive;
+	} policies[] = {
+		{ "leaf 128, depth 48", 128, 48, 0 },
+		{ "leaf 1024, depth 32", MIN_LITERAL_LENGTH, 32, 0 },
+		{ "leaf 64KB, depth 24", 65536, 24, 0 },
+		{ "adaptive", MIN_LITERAL_LENGTH, 32, 1 },
+	};
+	unsigned long edits = 1 << 14;
+	unsigned long long t;
+	long sum = 0;
+	size_t i;
+
+	printf("\n%-28s %12s %12s\n", "policy", "edit", "scan (16MB x4)");
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		rope_policy.leaf_length = policies[i].leaf_length;
+		rope_policy.balance_depth = policies[i].balance_depth;
+		rope_policy.adaptive = policies[i].adaptive;
+		t = bench_edits(edits);
+		printf("%-28s %12.1f", policies[i].name, (double) t / edits);
+		t = bench_scans(4, &sum);
+		printf(" %12.1f %s/KB", (double) t / (4 * (16 << 10)),
+		       TICK_UNIT);
+		if (policies[i].adaptive)
+			printf(" (leaf %ld)", (long) rope_policy.leaf_length);
+		printf("\n");
+	}
+	rope_policy.leaf_length = MIN_LITERAL_LENGTH;
+	rope_policy.balance_depth = ROPE_BALANCE_DEPTH;
+	rope_policy.adaptive = 0;
+	return sum;
+}
+
+static int
+bench(void)
+{
+	RopeObject *rope, *leaf, *next, *result;
+	unsigned long long t, best;
+	Py_ssize_t start;
+	unsigned long i, ops;
+	long sum = 0;
+	int round;
+
+	/* concat: append short leaves to a growing rope */
+	ops = 1 << 16;
+	leaf = random_leaf(64);
+	rope = rope_from_string("", 0);
+	t = TICKS();
+	for (i = 0; i < ops; i++) {
+		next = rope_concat(rope, leaf);
+		ROPE_DECREF(rope);
+		rope = next;
+	}
+	t = TICKS() - t;
+	report("concat (append 64 bytes)", t, ops);
+	ROPE_DECREF(rope);
+	ROPE_DECREF(leaf);
+
+	rope = bench_rope(1 << 14, MIN_LITERAL_LENGTH);
+	if (rope == NULL)
+		fail("allocation failed", 0);
+
+	/* slice: random 4KB views of a 16MB rope */
+	ops = 1 << 18;
+	t = TICKS();
+	for (i = 0; i < ops; i++) {
+		start = rng_below(rope->length - 4096);
+		result = rope_slice(rope, start, start + 4096);
+		ROPE_DECREF(result);
+	}
+	t = TICKS() - t;
+	report("slice (4KB of 16MB)", t, ops);
+
+	/* index: random bytes of the same rope */
+	ops = 1 << 20;
+	t = TICKS();
+	for (i = 0; i < ops; i++)
+		sum += rope_index(rope, rng_below(rope->length));
+	t = TICKS() - t;
+	report("index (16MB)", t, ops);
+	ROPE_DECREF(rope);
+
+	/* balance: a left-deep chain of leaves, best of a few rounds */
+	ops = 1 << 14;
+	best = 0;
+	for (round = 0; round < 5; round++) {
+		rope = rope_from_string("", 0);
+		for (i = 0; i < ops; i++) {
+			leaf = random_leaf(MIN_LITERAL_LENGTH);
+			next = rope_concat_unchecked(rope, leaf);
+			ROPE_DECREF(leaf);
+			ROPE_DECREF(rope);
+			rope = next;
+		}
+		t = TICKS();
+		result = rope_balance(rope);
+		t = TICKS() - t;
+		if (round == 0 || t < best)
+			best = t;
+		ROPE_DECREF(result);
+		ROPE_DECREF(rope);
+	}
+	report("balance (per leaf)", best, ops);
+
+	sum += bench_policy();
+
+	/* keep the index loop from being optimized away */
+	return sum < 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long iterations = 20000;
+
+	rope_allocator.alloc = counting_alloc;
+	rope_allocator.release = counting_release;
+	if (argc >= 2 && strcmp(argv[1], "fuzz") == 0) {
+		if (argc >= 3)
+			iterations = strtoul(argv[2], NULL, 10);
+		if (argc >= 4)
+			rng_seed(strtoull(argv[3], NULL, 10));
+		if (argc >= 5) {
+			compress_enabled = 1;
+			compress_hot_bytes = strtol(argv[4], NULL, 10);
+			compress_min_leaf = 64;
+			flat_max_bytes = compress_hot_bytes;
+		}
+		return fuzz(iterations);
+	}
+	if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+		return bench();
+	fprintf(stderr,
+		"usage: %s fuzz [iterations [seed [hot_bytes]]] | bench\n",
+		argv[0]);
+	return 2;
+}
@@ -2,11 +2,14 @@
 from distutils.core import setup, Extension
 
 ropes_module=Extension('ropes',
-                       sources=['src/ropes.c'])
+                       sources=['src/ropes.c'],
+                       libraries=['z', 'rt'],
+                       depends=['src/ropes.h', 'src/ropecore.h', 'src/ropecore.c'])
 
 setup(name='Ropes',
       version='1.0',
       description='A Ropes datatype for Python.',
+      headers=['src/ropes.h'],
       ext_modules=[ropes_module])
 
       
@@ -0,0 +1,1766 @@
+/*
+ * ropecore.c
+ * This file is part of CRopes: A Ropes data type for CPython
+ *
+ * Copyright (C) 2007 - Travis Athougies
+ *
+ * CRopes: A Ropes data type for CPython is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * CRopes: A Ropes data type for CPython is distributed in the hope
+ * that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CRopes: A Ropes data type for CPython; if not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/* Included by ropes.c and bench/ropebench.c; see ropecore.h. */
+
+#include "ropecore.h"
+
+#ifdef ROPE_STANDALONE
+static RopeObject *
+rope_node_new(void)
+{
+	RopeObject *new;
+
+	new = ROPE_MALLOC(sizeof(RopeObject));
+	if (new == NULL) {
+		ROPE_NOMEM();
+		return NULL;
+	}
+	new->ob_refcnt = 1;
+	return new;
+}
+
+static void
+rope_release(RopeObject *self)
+{
+	rope_node_clear(self);
+	ROPE_FREE(self);
+}
+#endif
+
+/* Moves on whenever bytes that a run found by rope_chunk may point into
+ * are freed while their rope lives on: a leaf compressed, or a flat copy
+ * evicted.  Code that keeps a run between calls checks it. */
+static size_t rope_run_epoch = 0;
+
+/* Map n bytes through a 256 entry table.  src and dst may be the same. */
+static void
+rope_translate(char *dst, const char *src, Py_ssize_t n,
+	       const unsigned char *table)
+{
+	const unsigned char *s = (const unsigned char *)src;
+	unsigned char *d = (unsigned char *)dst;
+
+	for (; n >= 8; n -= 8, s += 8, d += 8) {
+		unsigned char c0 = table[s[0]], c1 = table[s[1]];
+		unsigned char c2 = table[s[2]], c3 = table[s[3]];
+		unsigned char c4 = table[s[4]], c5 = table[s[5]];
+		unsigned char c6 = table[s[6]], c7 = table[s[7]];
+		d[0] = c0; d[1] = c1; d[2] = c2; d[3] = c3;
+		d[4] = c4; d[5] = c5; d[6] = c6; d[7] = c7;
+	}
+	while (n-- > 0)
+		*d++ = table[*s++];
+}
+
+static void
+transform_memo_free(transform_memo *memo)
+{
+	Py_ssize_t i;
+
+	if (!memo)
+		return;
+	for (i = 0; i < memo->size; i++)
+		ROPE_FREE(memo->entries[i].data);
+	ROPE_FREE(memo);
+}
+
+static transform_memo *
+transform_memo_new(Py_ssize_t size)
+{
+	transform_memo *memo;
+
+	memo = ROPE_MALLOC(sizeof(transform_memo) +
+			    (size - 1) * sizeof(struct transform_memo_entry));
+	if (memo == NULL)
+		return NULL;
+	memo->used = 0;
+	memo->size = size;
+	memset(memo->entries, 0, size * sizeof(struct transform_memo_entry));
+	return memo;
+}
+
+static struct transform_memo_entry *
+transform_memo_slot(transform_memo *memo, const void *key,
+		    Py_ssize_t offset, Py_ssize_t length)
+{
+	size_t i = (((size_t)key >> 4) ^ offset ^ length) * 2654435761u;
+
+	for (i &= memo->size - 1; memo->entries[i].key != NULL &&
+		     (memo->entries[i].key != key ||
+		      memo->entries[i].offset != offset ||
+		      memo->entries[i].length != length);
+	     i = (i + 1) & (memo->size - 1))
+		;
+	return &memo->entries[i];
+}
+
+/* Return the translated copy of the len bytes at src, which lie at offset
+ * in the block known by key, translating and remembering it on first
+ * use. */
+static const char *
+rope_transform_block(RopeObject *self, const void *key, Py_ssize_t offset,
+		     const char *src, Py_ssize_t len)
+{
+	transform_memo *memo = self->v.transform.memo, *bigger;
+	struct transform_memo_entry *entry;
+	Py_ssize_t i;
+
+	if (memo && (entry = transform_memo_slot(memo, key, offset, len))->key)
+		return entry->data;
+	if (!memo || 2 * (memo->used + 1) > memo->size) {
+		bigger = transform_memo_new(memo ? 2 * memo->size : 8);
+		if (bigger == NULL) {
+			ROPE_NOMEM();
+			return NULL;
+		}
+		if (memo) {
+			for (i = 0; i < memo->size; i++)
+				if (memo->entries[i].key)
+					*transform_memo_slot(bigger,
+						memo->entries[i].key,
+						memo->entries[i].offset,
+						memo->entries[i].length) =
+						memo->entries[i];
+			bigger->used = memo->used;
+			ROPE_FREE(memo);
+		}
+		self->v.transform.memo = memo = bigger;
+	}
+	entry = transform_memo_slot(memo, key, offset, len);
+	entry->data = ROPE_MALLOC(len);
+	if (entry->data == NULL) {
+		ROPE_NOMEM();
+		return NULL;
+	}
+	rope_translate(entry->data, src, len, self->v.transform.table);
+	entry->key = key;
+	entry->offset = offset;
+	entry->length = len;
+	memo->used++;
+	return entry->data;
+}
+
+/* Shape policy
+ *
+ * In adaptive mode the edits made (concatenations and slices) and the
+ * bytes scanned (runs handed out by rope_chunk, flattened ropes) are
+ * counted, and every ROPE_ADAPT_WINDOW or so operations leaf_length is
+ * set to the power of two that minimizes
+ *
+ *	edits * leaf_length + scanned / leaf_length * ROPE_LEAF_VISIT_COST
+ *
+ * that is, the bytes an edit may copy against the leaves a scan visits.
+ * Edit-heavy work gets small leaves and may run deeper before being
+ * rebalanced, scan-heavy work gets large leaves and flatter trees.  The
+ * counts are halved at each retune, so the policy follows a change of
+ * workload within a few windows.
+ */
+
+static RopePolicy rope_policy = {
+	MIN_LITERAL_LENGTH, ROPE_BALANCE_DEPTH, 0
+};
+static double policy_edits, policy_scanned;
+static Py_ssize_t policy_retunes;
+
+static void
+rope_policy_adapt(void)
+{
+	Py_ssize_t length = ROPE_ADAPT_MIN_LEAF;
+	double next;
+
+	for (;;) {
+		next = 2.0 * length;
+		if (next > ROPE_MAX_LEAF_LENGTH ||
+		    next * next * (policy_edits + 1) >
+		    policy_scanned * ROPE_LEAF_VISIT_COST)
+			break;
+		length *= 2;
+	}
+	rope_policy.leaf_length = length;
+	if (length <= 4 * ROPE_ADAPT_MIN_LEAF)
+		rope_policy.balance_depth = 3 * ROPE_BALANCE_DEPTH / 2;
+	else if (length >= 16 * MIN_LITERAL_LENGTH)
+		rope_policy.balance_depth = 3 * ROPE_BALANCE_DEPTH / 4;
+	else
+		rope_policy.balance_depth = ROPE_BALANCE_DEPTH;
+	policy_edits /= 2;
+	policy_scanned /= 2;
+	policy_retunes++;
+}
+
+static void
+rope_policy_note(Py_ssize_t edits, Py_ssize_t scanned)
+{
+	if (!rope_policy.adaptive)
+		return;
+	policy_edits += edits;
+	policy_scanned += scanned;
+	if (policy_edits + policy_scanned / rope_policy.leaf_length >=
+	    ROPE_ADAPT_WINDOW)
+		rope_policy_adapt();
+}
+
+/* Cold leaf compression
+ *
+ * While compression is on, literals that own their bytes and are at least
+ * compress_min_leaf long are tracked from the first time they are read.
+ * Tracked leaves with their bytes present are kept in the hot list, most
+ * recently read first; once their bytes add up to more than
+ * compress_hot_bytes, leaves are taken from the end of the list, their
+ * bytes compressed with zlib and freed.  rope_literal() brings them back
+ * on the next read.  The compressed copy is kept, so a leaf that goes
+ * cold again is only freed.  Leaves that zlib cannot shrink by an eighth
+ * keep their bytes and leave the list for good.
+ *
+ * So a pointer into a leaf is good only until the next leaf is read.  The
+ * ROPE_HOT_MIN_LEAVES most recently read leaves are never evicted, which
+ * lets a caller hold runs of two leaves at once; anything that keeps a
+ * run between calls checks rope_run_epoch.
+ */
+
+static int compress_enabled = 0;
+static Py_ssize_t compress_hot_bytes = 64 * 1024 * 1024;
+static Py_ssize_t compress_min_leaf = MIN_LITERAL_LENGTH;
+static rope_packing *compress_head = NULL, *compress_tail = NULL;
+static RopeCompressStats compress_stats;
+
+static double
+rope_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+rope_packable(RopeObject *leaf)
+{
+	return (leaf->type == LITERAL_NODE && leaf->base == NULL &&
+		!leaf->interned && leaf->length > 0 &&
+		leaf->length >= compress_min_leaf);
+}
+
+static void
+compress_unlink(rope_packing *pk)
+{
+	if (pk->prev)
+		pk->prev->next = pk->next;
+	else
+		compress_head = pk->next;
+	if (pk->next)
+		pk->next->prev = pk->prev;
+	else
+		compress_tail = pk->prev;
+	pk->prev = pk->next = NULL;
+	pk->hot = 0;
+	compress_stats.hot_leaves--;
+	compress_stats.hot_bytes -= pk->leaf->length;
+}
+
+static void
+compress_push(rope_packing *pk)
+{
+	pk->prev = NULL;
+	pk->next = compress_head;
+	if (compress_head)
+		compress_head->prev = pk;
+	else
+		compress_tail = pk;
+	compress_head = pk;
+	pk->hot = 1;
+	compress_stats.hot_leaves++;
+	compress_stats.hot_bytes += pk->leaf->length;
+}
+
+/* Take a hot leaf out of the list and free its bytes, compressing them
+ * first if this is the first time. */
+static void
+compress_evict(rope_packing *pk)
+{
+	RopeObject *leaf = pk->leaf;
+	uLongf n;
+	Bytef *scratch;
+	double t;
+
+	compress_unlink(pk);
+	if (pk->packed == NULL) {
+		t = rope_clock();
+		n = compressBound(leaf->length);
+		scratch = ROPE_MALLOC(n);
+		if (scratch != NULL &&
+		    compress2(scratch, &n, (Bytef *) leaf->v.literal,
+			      leaf->length, 1) == Z_OK &&
+		    (Py_ssize_t) n < leaf->length - leaf->length / 8 &&
+		    (pk->packed = ROPE_MALLOC(n)) != NULL) {
+			memcpy(pk->packed, scratch, n);
+			pk->packed_length = n;
+			compress_stats.packed_bytes += n;
+			compress_stats.compressions++;
+		}
+		if (scratch != NULL)
+			ROPE_FREE(scratch);
+		compress_stats.compress_seconds += rope_clock() - t;
+		if (pk->packed == NULL) {
+			pk->incompressible = 1;
+			return;
+		}
+	}
+	ROPE_FREE(leaf->v.literal);
+	leaf->v.literal = NULL;
+	compress_stats.cold_leaves++;
+	compress_stats.cold_bytes += leaf->length;
+	rope_run_epoch++;
+}
+
+static void
+compress_trim(void)
+{
+	while (compress_enabled &&
+	       compress_stats.hot_bytes > compress_hot_bytes &&
+	       compress_stats.hot_leaves > ROPE_HOT_MIN_LEAVES)
+		compress_evict(compress_tail);
+}
+
+/* Start tracking a leaf, or return NULL with an error set. */
+static rope_packing *
+compress_track(RopeObject *leaf)
+{
+	rope_packing *pk;
+
+	pk = ROPE_MALLOC(sizeof(rope_packing));
+	if (pk == NULL) {
+		ROPE_NOMEM();
+		return NULL;
+	}
+	memset(pk, 0, sizeof(rope_packing));
+	pk->leaf = leaf;
+	leaf->packing = pk;
+	return pk;
+}
+
+/* Called when a tracked leaf goes away. */
+static void
+compress_forget(rope_packing *pk)
+{
+	if (pk->hot)
+		compress_unlink(pk);
+	else if (pk->leaf->v.literal == NULL) {
+		compress_stats.cold_leaves--;
+		compress_stats.cold_bytes -= pk->leaf->length;
+	}
+	if (pk->packed) {
+		compress_stats.packed_bytes -= pk->packed_length;
+		ROPE_FREE(pk->packed);
+	}
+	ROPE_FREE(pk);
+}
+
+static int
+compress_inflate(rope_packing *pk)
+{
+	RopeObject *leaf = pk->leaf;
+	uLongf n = leaf->length;
+	char *bytes;
+	double t;
+
+	bytes = ROPE_MALLOC(leaf->length);
+	if (bytes == NULL) {
+		ROPE_NOMEM();
+		return -1;
+	}
+	t = rope_clock();
+	if (uncompress((Bytef *) bytes, &n, (Bytef *) pk->packed,
+		       pk->packed_length) != Z_OK ||
+	    (Py_ssize_t) n != leaf->length) {
+		ROPE_FREE(bytes);
+		ROPE_FAIL("compressed rope leaf is damaged");
+		return -1;
+	}
+	compress_stats.decompress_seconds += rope_clock() - t;
+	compress_stats.decompressions++;
+	compress_stats.cold_leaves--;
+	compress_stats.cold_bytes -= leaf->length;
+	leaf->v.literal = bytes;
+	return 0;
+}
+
+/* Return the bytes of a literal, decompressing them if need be, or NULL
+ * with an error set. */
+static const char *
+rope_literal(RopeObject *leaf)
+{
+	rope_packing *pk = leaf->packing;
+
+	if (pk == NULL) {
+		if (!compress_enabled || !rope_packable(leaf))
+			return leaf->v.literal;
+		pk = compress_track(leaf);
+		if (pk == NULL)
+			return NULL;
+	}
+	else if (pk->hot) {
+		if (pk != compress_head) {
+			compress_unlink(pk);
+			compress_push(pk);
+		}
+		return leaf->v.literal;
+	}
+	else if (leaf->v.literal != NULL)
+		return leaf->v.literal;		/* incompressible */
+	else if (compress_inflate(pk) < 0)
+		return NULL;
+	compress_push(pk);
+	compress_trim();
+	return leaf->v.literal;
+}
+
+/* Return the bytes of a literal, which from now on are never compressed
+ * (their address is being handed out), or NULL with an error set. */
+static const char *
+rope_literal_pin(RopeObject *leaf)
+{
+	const char *bytes = rope_literal(leaf);
+	rope_packing *pk = leaf->packing;
+
+	if (bytes && pk && !pk->incompressible) {
+		if (pk->hot)
+			compress_unlink(pk);
+		pk->incompressible = 1;
+	}
+	return bytes;
+}
+
+/* Compress every eligible leaf under self now, whatever the budget.
+ * Returns 0, or -1 with an error set. */
+static int
+rope_compress_leaves(RopeObject *self)
+{
+	rope_packing *pk;
+
+	switch (self->type) {
+	case LITERAL_NODE:
+		if (!rope_packable(self))
+			return 0;
+		pk = self->packing;
+		if (pk == NULL) {
+			pk = compress_track(self);
+			if (pk == NULL)
+				return -1;
+			compress_push(pk);
+		}
+		if (pk->hot)
+			compress_evict(pk);
+		return 0;
+	case CONCAT_NODE:
+		if (rope_compress_leaves(self->v.concat.left) < 0)
+			return -1;
+		return rope_compress_leaves(self->v.concat.right);
+	case REPEAT_NODE:
+		return rope_compress_leaves(self->v.repeat.child);
+	case SUBSTRING_NODE:
+		return rope_compress_leaves(self->v.substring.child);
+	case TRANSFORM_NODE:
+		return rope_compress_leaves(self->v.transform.child);
+	}
+	return 0;
+}
+
+/* Flatten cache
+ *
+ * A rope that is turned into a string again and again is copied out
+ * every time.  While the cache is on, str() leaves a flat copy of what it
+ * made on the node (any node but a literal, which is flat already), and
+ * hands the same string back next time.  Anything reading through the
+ * node then takes its bytes from the copy as if it were a leaf.  Copies
+ * are kept in order of use, and the least recently used are dropped once
+ * they add up to more than flat_max_bytes.  Ropes do not change, so a
+ * copy stays good for the node's life; the one place a node is changed,
+ * appending in place, drops it first.
+ *
+ * Copies made for, or handed to, the buffer protocol are pinned: they
+ * leave the list and stay until the node goes, whatever the budget.
+ */
+
+static Py_ssize_t flat_max_bytes = 0;	/* 0: no caching */
+static rope_flat *flat_head = NULL, *flat_tail = NULL;
+static Py_ssize_t flat_count = 0, flat_bytes = 0, flat_evictions = 0;
+static Py_ssize_t flat_pinned_bytes = 0;
+
+static void
+flat_unlink(rope_flat *f)
+{
+	if (f->prev)
+		f->prev->next = f->next;
+	else
+		flat_head = f->next;
+	if (f->next)
+		f->next->prev = f->prev;
+	else
+		flat_tail = f->prev;
+}
+
+static void
+flat_push(rope_flat *f)
+{
+	f->prev = NULL;
+	f->next = flat_head;
+	if (flat_head)
+		flat_head->prev = f;
+	else
+		flat_tail = f;
+	flat_head = f;
+}
+
+/* Return the flat copy of self, which must have one, marking it used. */
+static const char *
+rope_flat_use(RopeObject *self)
+{
+	rope_flat *f = self->flat;
+
+	if (!f->pinned && f != flat_head) {
+		flat_unlink(f);
+		flat_push(f);
+	}
+	return f->bytes;
+}
+
+static void
+rope_flat_drop(RopeObject *self)
+{
+	rope_flat *f = self->flat;
+
+	if (f->pinned)
+		flat_pinned_bytes -= f->length;
+	else {
+		flat_unlink(f);
+		flat_count--;
+		flat_bytes -= f->length;
+	}
+	if (f->owner)
+		ROPE_BASE_DECREF(f->owner);
+	else
+		ROPE_FREE(f->bytes);
+	ROPE_FREE(f);
+	self->flat = NULL;
+	rope_run_epoch++;
+}
+
+/* Drop the least recently used copies until the rest fit the budget. */
+static void
+rope_flat_trim(void)
+{
+	while (flat_tail && flat_bytes > flat_max_bytes) {
+		flat_evictions++;
+		rope_flat_drop(flat_tail->node);
+	}
+}
+
+/* Offer bytes, a flat copy of self held by owner (or, if owner is NULL,
+ * allocated with ROPE_MALLOC), to the cache, pinned if pin is set.
+ * Returns 1 if it took them, along with the reference or the allocation,
+ * 0 if not, or -1 with an error set. */
+static int
+rope_flat_attach(RopeObject *self, ROPE_BASE_TYPE *owner, char *bytes,
+		 int pin)
+{
+	rope_flat *f;
+
+	if (self->flat || self->type == LITERAL_NODE || self->length == 0 ||
+	    (!pin && self->length > flat_max_bytes))
+		return 0;
+	f = ROPE_MALLOC(sizeof(rope_flat));
+	if (f == NULL) {
+		ROPE_NOMEM();
+		return -1;
+	}
+	f->node = self;
+	f->owner = owner;
+	f->bytes = bytes;
+	f->length = self->length;
+	f->pinned = pin;
+	self->flat = f;
+	if (pin) {
+		flat_pinned_bytes += f->length;
+		return 1;
+	}
+	flat_push(f);
+	flat_count++;
+	flat_bytes += f->length;
+	rope_flat_trim();
+	return 1;
+}
+
+/* Keep the flat copy self has for as long as self lives. */
+static void
+rope_flat_pin(RopeObject *self)
+{
+	rope_flat *f = self->flat;
+
+	if (f->pinned)
+		return;
+	flat_unlink(f);
+	flat_count--;
+	flat_bytes -= f->length;
+	f->pinned = 1;
+	flat_pinned_bytes += f->length;
+}
+
+/* A node with a flat copy is read as if it were a leaf. */
+static enum node_type
+rope_read_type(RopeObject *self)
+{
+	return self->flat ? LITERAL_NODE : self->type;
+}
+
+/* The bytes of a node read as a leaf, or NULL with an error set. */
+static const char *
+rope_leaf_bytes(RopeObject *self)
+{
+	return self->flat ? rope_flat_use(self) : rope_literal(self);
+}
+
+/* dst holds period bytes; repeat them until it holds total.  The copies
+ * double in size until they reach REPEAT_FILL_BLOCK and then keep
+ * reading the same cache-sized prefix. */
+static void
+rope_fill(char *dst, Py_ssize_t period, Py_ssize_t total)
+{
+	Py_ssize_t filled = period, n;
+
+	if (period == 1) {
+		memset(dst + 1, dst[0], total - 1);
+		return;
+	}
+	while (filled < total) {
+		n = filled;
+		if (n > REPEAT_FILL_BLOCK && period <= REPEAT_FILL_BLOCK)
+			n = REPEAT_FILL_BLOCK - REPEAT_FILL_BLOCK % period;
+		if (n > total - filled)
+			n = total - filled;
+		memcpy(dst + filled, dst, n);
+		filled += n;
+	}
+}
+
+static int
+_rope_str_range(RopeObject *rope, Py_ssize_t start, Py_ssize_t len, char **p)
+{
+	Py_ssize_t n, child_length;
+	const char *literal;
+	char *q;
+
+	if (len <= 0)
+		return 0;
+	if (start == 0 && len == rope->length && rope->type != SUBSTRING_NODE)
+		return _rope_str(rope, p);
+	switch (rope_read_type(rope)) {
+	case LITERAL_NODE:
+		literal = rope_leaf_bytes(rope);
+		if (literal == NULL)
+			return -1;
+		memcpy(*p, literal + start, len);
+		*p += len;
+		break;
+	case CONCAT_NODE:
+		n = rope->v.concat.left->length - start;
+		if (n > 0) {
+			if (n > len)
+				n = len;
+			if (_rope_str_range(rope->v.concat.left, start, n,
+					    p) < 0)
+				return -1;
+			start += n;
+			len -= n;
+		}
+		return _rope_str_range(rope->v.concat.right,
+				       start - rope->v.concat.left->length,
+				       len, p);
+	case REPEAT_NODE:
+		/* the tail of one copy, then whole copies from the start */
+		child_length = rope->v.repeat.child->length;
+		start %= child_length;
+		n = child_length - start;
+		if (n > len)
+			n = len;
+		if (_rope_str_range(rope->v.repeat.child, start, n, p) < 0)
+			return -1;
+		len -= n;
+		if (len > 0) {
+			q = *p;
+			n = (len < child_length ? len : child_length);
+			if (_rope_str_range(rope->v.repeat.child, 0, n, p) < 0)
+				return -1;
+			rope_fill(q, n, len);
+			*p = q + len;
+		}
+		break;
+	case SUBSTRING_NODE:
+		return _rope_str_range(rope->v.substring.child,
+				       start + rope->v.substring.offset, len,
+				       p);
+	case TRANSFORM_NODE:
+		q = *p;
+		if (_rope_str_range(rope->v.transform.child, start, len, p) < 0)
+			return -1;
+		rope_translate(q, q, len, rope->v.transform.table);
+		break;
+	}
+	return 0;
+}
+
+/* Write the bytes of rope at *p and advance it.  Returns 0, or -1 with an
+ * error set if a compressed leaf could not be read back. */
+static int
+_rope_str(RopeObject *rope, char **p)
+{
+	const char *literal;
+	char *q;
+
+	switch (rope_read_type(rope)) {
+	case LITERAL_NODE:
+		literal = rope_leaf_bytes(rope);
+		if (literal == NULL && rope->length > 0)
+			return -1;
+		memcpy(*p, literal, rope->length);
+		*p += rope->length;
+		break;
+	case CONCAT_NODE:
+		if (rope->v.concat.left &&
+		    _rope_str(rope->v.concat.left, p) < 0)
+			return -1;
+		if (rope->v.concat.right &&
+		    _rope_str(rope->v.concat.right, p) < 0)
+			return -1;
+		break;
+	case REPEAT_NODE:
+		/* Write the child once and copy it from there */
+		q = *p;
+		if (_rope_str(rope->v.repeat.child, p) < 0)
+			return -1;
+		rope_fill(q, rope->v.repeat.child->length, rope->length);
+		*p = q + rope->length;
+		break;
+	case SUBSTRING_NODE:
+		return _rope_str_range(rope->v.substring.child,
+				       rope->v.substring.offset, rope->length,
+				       p);
+	case TRANSFORM_NODE:
+		q = *p;
+		if (_rope_str(rope->v.transform.child, p) < 0)
+			return -1;
+		rope_translate(q, q, rope->length, rope->v.transform.table);
+		break;
+	}
+	return 0;
+}
+
+/* Drop what a node holds, leaving the node itself to the caller. */
+static void
+rope_node_clear(RopeObject *self)
+{
+	if (self->flat)
+		rope_flat_drop(self);
+	switch (self->type) {
+	case LITERAL_NODE:
+		if (self->packing)
+			compress_forget(self->packing);
+		if (self->base)
+			ROPE_BASE_DECREF(self->base);
+		else
+			ROPE_FREE(self->v.literal);
+		break;
+	case CONCAT_NODE:
+		ROPE_XDECREF(self->v.concat.left);
+		ROPE_XDECREF(self->v.concat.right);
+		break;
+	case REPEAT_NODE:
+		ROPE_XDECREF(self->v.repeat.child);
+		break;
+	case SUBSTRING_NODE:
+		ROPE_XDECREF(self->v.substring.child);
+		break;
+	case TRANSFORM_NODE:
+		ROPE_XDECREF(self->v.transform.child);
+		ROPE_FREE(self->v.transform.table);
+		transform_memo_free(self->v.transform.memo);
+		break;
+	}
+}
+
+static RopeObject *
+rope_from_type(enum node_type type, Py_ssize_t len)
+{
+	RopeObject *new;
+
+	if(len < 0) {
+		ROPE_OVERFLOW("The rope is  too long!");
+		return NULL;
+	}
+	new = ROPE_NODE_NEW();
+	if (new == NULL)
+		return NULL;
+
+	new->type = type;
+	new->length = len;
+	new->hash = -1;
+	new->counted_byte = -1;
+	new->depth = 0;
+	new->base = NULL;
+	new->interned = 0;
+	new->packing = NULL;
+	new->flat = NULL;
+	return new;
+}
+
+static RopeObject *
+rope_from_string(const char *str, Py_ssize_t len)
+{
+	RopeObject *new;
+
+	new = rope_from_type(LITERAL_NODE, len);
+	if (new == NULL)
+		return NULL;
+	
+	new->v.literal = (char *)ROPE_MALLOC(len * sizeof(char));
+	if (new->v.literal == NULL) {
+		ROPE_NOMEM();
+		return NULL;
+	}
+	if (str)
+		memcpy(new->v.literal, str, len);
+
+	return new;
+}
+
+static RopeObject *
+rope_concat_unchecked(RopeObject *self, RopeObject *other)
+{
+	RopeObject *result;
+	
+	if(!other) {
+		ROPE_XINCREF(self);
+		return self;
+	}
+	if(!self) {
+		ROPE_XINCREF(other);
+		return other;
+	}
+	if(self->length <= 0) {
+		ROPE_INCREF(other);
+		return other;
+	}
+	ROPE_INCREF(self);
+	if(other->length <= 0)
+		return self;
+	ROPE_INCREF(other);
+	result = rope_from_type(CONCAT_NODE, self->length + other->length);
+	if(result == NULL)
+		return NULL;
+	result->v.concat.left = self;
+	result->v.concat.right = other;
+	result->depth =
+		(result->v.concat.left->depth>result->v.concat.right->depth?
+		 result->v.concat.left->depth:result->v.concat.right->depth)+1;
+
+	return result;
+}
+
+static RopeObject*
+rope_concat(RopeObject* self, RopeObject* other)
+{
+	RopeObject* result=rope_concat_unchecked(self, other);
+	if(result==NULL)
+		return NULL;
+	if(other && self && other->length > 0 && result->length <= self->length) {
+		ROPE_DECREF(result);
+		ROPE_OVERFLOW("The strings are WAY too large!");
+		return NULL;
+	}
+	rope_policy_note(1, 0);
+	if (result->depth > rope_policy.balance_depth) {
+		RopeObject* balanced=rope_balance(result);
+		ROPE_DECREF(result);
+		if(!balanced)
+			return NULL;
+		result=balanced;
+	}
+	return result;
+}
+
+/* A REPEAT_NODE of count >= 2 copies of child, without any checks. */
+static RopeObject *
+rope_repeat_node(RopeObject *child, Py_ssize_t count)
+{
+	RopeObject *result;
+
+	result = rope_from_type(REPEAT_NODE, child->length * count);
+	if (result == NULL)
+		return NULL;
+	ROPE_INCREF(child);
+	result->v.repeat.child = child;
+	result->v.repeat.count = count;
+	result->depth = child->depth + 1;
+	return result;
+}
+
+/* A repeat of a repeat multiplies the counts, and a single byte held by
+ * anything but a literal is copied into one, so that fills of any size
+ * are one node over a one byte leaf. */
+static RopeObject *
+rope_repeat(RopeObject *self, Py_ssize_t count)
+{
+	RopeObject *result, *byte;
+	char *p;
+
+	if (count <= 0)
+		return rope_from_string("", 0);
+	if (count == 1 || self->length == 0) {
+		ROPE_INCREF(self);
+		return self;
+	}
+	if (self->length > PY_SSIZE_T_MAX / count) {
+		ROPE_OVERFLOW("The string is too large!");
+		return NULL;
+	}
+	if (self->type == REPEAT_NODE) {
+		count *= self->v.repeat.count;
+		self = self->v.repeat.child;
+	}
+	if (self->length == 1 && self->type != LITERAL_NODE) {
+		byte = rope_from_string(NULL, 1);
+		if (byte == NULL)
+			return NULL;
+		p = byte->v.literal;
+		if (_rope_str(self, &p) < 0) {
+			ROPE_DECREF(byte);
+			return NULL;
+		}
+		result = rope_repeat_node(byte, count);
+		ROPE_DECREF(byte);
+		return result;
+	}
+	return rope_repeat_node(self, count);
+}
+
+/* Return a lazy view of self with every byte mapped through table.  A
+ * transform of a transform is fused into a single table. */
+static RopeObject *
+rope_transform(RopeObject *self, const unsigned char *table)
+{
+	RopeObject *result;
+	unsigned char *fused;
+	int c;
+
+	if (self->length == 0) {
+		ROPE_INCREF(self);
+		return self;
+	}
+	fused = ROPE_MALLOC(256);
+	if (fused == NULL) {
+		ROPE_NOMEM();
+		return NULL;
+	}
+	if (self->type == TRANSFORM_NODE) {
+		for (c = 0; c < 256; c++)
+			fused[c] = table[self->v.transform.table[c]];
+		self = self->v.transform.child;
+	}
+	else
+		memcpy(fused, table, 256);
+	result = rope_from_type(TRANSFORM_NODE, self->length);
+	if (result == NULL) {
+		ROPE_FREE(fused);
+		return NULL;
+	}
+	ROPE_INCREF(self);
+	result->v.transform.child = self;
+	result->v.transform.table = fused;
+	result->v.transform.memo = NULL;
+	result->depth = self->depth + 1;
+	return result;
+}
+
+/* Balancing follows Boehm, Atkinson and Plass: the leaves are fed left to
+ * right into a work list whose slot i holds a rope at least as long as the
+ * (i+2)th Fibonacci number.  Inserting a rope first absorbs every occupied
+ * slot at or below its own, so higher slots always hold the material
+ * further to the left, and the slots are concatenated at the end. */
+static Py_ssize_t rope_fib[ROPE_DEPTH + 1];
+
+static int
+rope_balance_slot(Py_ssize_t length)
+{
+	int i;
+
+	if (rope_fib[0] == 0) {
+		rope_fib[0] = 1;
+		rope_fib[1] = 2;
+		for (i = 2; i <= ROPE_DEPTH; i++) {
+			if (rope_fib[i - 1] > PY_SSIZE_T_MAX - rope_fib[i - 2])
+				rope_fib[i] = PY_SSIZE_T_MAX;
+			else
+				rope_fib[i] = rope_fib[i - 1] + rope_fib[i - 2];
+		}
+	}
+	for (i = 0; i < ROPE_DEPTH - 1; i++)
+		if (length < rope_fib[i + 1])
+			break;
+	return i;
+}
+
+/* Add node (a new reference, stolen) to the right of the work list. */
+static int
+rope_balance_insert(RopeBalanceState *state, RopeObject *node)
+{
+	RopeObject *merged;
+	int i, j, again;
+
+	do {
+		again = 0;
+		i = rope_balance_slot(node->length);
+		for (j = 0; j <= i; j++) {
+			if (!state->work_list[j])
+				continue;
+			merged = rope_concat_unchecked(state->work_list[j], node);
+			ROPE_DECREF(state->work_list[j]);
+			state->work_list[j] = NULL;
+			ROPE_DECREF(node);
+			if (merged == NULL)
+				return -1;
+			node = merged;
+			again = 1;
+		}
+	} while (again);
+	state->work_list[i] = node;
+	return 0;
+}
+
+static int
+rope_balance_flush(RopeBalanceState *state)
+{
+	RopeObject *new;
+
+	if (!state->string)
+		return 0;
+	new = rope_from_type(LITERAL_NODE, state->string_length);
+	if (new == NULL)
+		return -1;
+	new->v.literal = state->string;
+	state->string = NULL;
+	state->string_length = 0;
+	return rope_balance_insert(state, new);
+}
+
+static int
+_rope_balance(RopeObject* cur, RopeBalanceState* state)
+{
+#if LITERAL_MERGING
+	const char *literal;
+#endif
+
+	if(!cur || cur->length == 0)
+		return 0;
+	if(cur->type == CONCAT_NODE) {
+		if(_rope_balance(cur->v.concat.left, state) != 0) return -1;
+		return _rope_balance(cur->v.concat.right, state);
+	}
+#if LITERAL_MERGING
+	/* Runs of short literals are copied together into one leaf */
+	if(cur->type == LITERAL_NODE && cur->length < state->leaf_length) {
+		literal = rope_literal(cur);
+		if(!literal)
+			return -1;
+		if(state->string_length + cur->length > state->leaf_length &&
+		   rope_balance_flush(state) != 0)
+			return -1;
+		if(!state->string) {
+			state->string = ROPE_MALLOC(state->leaf_length);
+			if(!state->string) {
+				ROPE_NOMEM();
+				return -1;
+			}
+		}
+		memcpy(state->string + state->string_length, literal,
+		       cur->length);
+		state->string_length += cur->length;
+		return 0;
+	}
+	if(rope_balance_flush(state) != 0)
+		return -1;
+#endif
+	ROPE_INCREF(cur);
+	return rope_balance_insert(state, cur);
+}
+
+static void
+rope_balance_init(RopeBalanceState *state)
+{
+	state->string = NULL;
+	state->string_length = 0;
+	state->leaf_length = rope_policy.leaf_length;
+	memset(state->work_list, 0, sizeof(RopeObject*) * ROPE_DEPTH);
+}
+
+/* Release everything held by an unfinished work list. */
+static void
+rope_balance_clear(RopeBalanceState *state)
+{
+	int i;
+
+	ROPE_FREE(state->string);
+	state->string = NULL;
+	for(i = 0; i < ROPE_DEPTH; i++) {
+		ROPE_XDECREF(state->work_list[i]);
+		state->work_list[i] = NULL;
+	}
+}
+
+/* Concatenate the work list, emptying it. */
+static RopeObject*
+rope_balance_finish(RopeBalanceState *state)
+{
+	int i;
+	RopeObject *cur = NULL, *merged;
+
+	if(rope_balance_flush(state) != 0)
+		goto ret_err;
+	for(i = 0; i < ROPE_DEPTH; i++) {
+		if(!state->work_list[i])
+			continue;
+		if(cur) {
+			merged = rope_concat_unchecked(state->work_list[i], cur);
+			ROPE_DECREF(cur);
+			ROPE_DECREF(state->work_list[i]);
+			state->work_list[i] = NULL;
+			if(!merged)
+				goto ret_err;
+			cur = merged;
+		}
+		else {
+			cur = state->work_list[i];
+			state->work_list[i] = NULL;
+		}
+	}
+	if(!cur)
+		return rope_from_string("", 0);
+	return cur;
+  ret_err:
+	rope_balance_clear(state);
+	return NULL;
+}
+
+/* Feed bytes [start, stop) of node to the work list.  Subtrees the range
+ * covers whole are handed over as they are, so only the nodes along the
+ * two edges of the range are visited. */
+static int
+rope_balance_range(RopeBalanceState *state, RopeObject *node,
+		   Py_ssize_t start, Py_ssize_t stop)
+{
+	RopeObject *piece;
+	Py_ssize_t left_length;
+	int status;
+
+	while(start < stop) {
+		if(start == 0 && stop == node->length) {
+			if(node->type == LITERAL_NODE)
+				return _rope_balance(node, state);
+			if(rope_balance_flush(state) != 0)
+				return -1;
+			ROPE_INCREF(node);
+			return rope_balance_insert(state, node);
+		}
+		switch(node->type) {
+		case CONCAT_NODE:
+			left_length = node->v.concat.left->length;
+			if(start < left_length &&
+			   rope_balance_range(state, node->v.concat.left, start,
+					      stop < left_length ?
+					      stop : left_length) != 0)
+				return -1;
+			start = (start > left_length ? start - left_length : 0);
+			stop -= left_length;
+			node = node->v.concat.right;
+			break;
+		case SUBSTRING_NODE:
+			start += node->v.substring.offset;
+			stop += node->v.substring.offset;
+			node = node->v.substring.child;
+			break;
+		default:
+			piece = rope_slice(node, start, stop);
+			if(!piece)
+				return -1;
+			status = _rope_balance(piece, state);
+			ROPE_DECREF(piece);
+			return status;
+		}
+	}
+	return 0;
+}
+
+/* Balance r, merging short literals into leaves of up to leaf_length. */
+static RopeObject*
+rope_balance_leaves(RopeObject* r, Py_ssize_t leaf_length)
+{
+	RopeObject *cur;
+	RopeBalanceState state;
+
+	if(!r || r->type != CONCAT_NODE) {
+		ROPE_XINCREF(r);
+		return r;
+	}
+	rope_balance_init(&state);
+	state.leaf_length = leaf_length;
+	if(_rope_balance(r, &state) != 0) {
+		rope_balance_clear(&state);
+		return NULL;
+	}
+	cur = rope_balance_finish(&state);
+	assert(!cur || r->length == cur->length);
+	return cur;
+}
+
+static RopeObject*
+rope_balance(RopeObject* r)
+{
+	return rope_balance_leaves(r, rope_policy.leaf_length);
+}
+
+/* Find the contiguous run of bytes that holds position i.  Returns a
+ * pointer to byte i and sets *before and *after to the number of bytes of
+ * the run that lie before it and from it onwards (so *after >= 1).
+ * *block and *block_length describe the whole buffer the run lies in,
+ * and *block_key names it for the transform memo.  Returns NULL with an
+ * error set if a compressed leaf or a transformed block could not be
+ * produced. */
+static const char *
+_rope_chunk(RopeObject *self, Py_ssize_t i, Py_ssize_t *before,
+	    Py_ssize_t *after, const char **block, Py_ssize_t *block_length,
+	    const void **block_key)
+{
+	Py_ssize_t max_before = i, max_after = self->length - i;
+	Py_ssize_t offset, start;
+	const char *run;
+
+	assert(self && i >= 0 && i < self->length);
+
+	for (;;) {
+		switch (rope_read_type(self)) {
+		case LITERAL_NODE:
+			*block = rope_leaf_bytes(self);
+			if (*block == NULL)
+				return NULL;
+			*block_key = self;
+			*block_length = self->length;
+			*before = (i < max_before ? i : max_before);
+			*after = self->length - i;
+			if (*after > max_after)
+				*after = max_after;
+			return *block + i;
+		case CONCAT_NODE:
+			if (i < self->v.concat.left->length) {
+				self = self->v.concat.left;
+			}
+			else {
+				i -= self->v.concat.left->length;
+				self = self->v.concat.right;
+			}
+			break;
+		case REPEAT_NODE:
+			i %= self->v.repeat.child->length;
+			self = self->v.repeat.child;
+			break;
+		case SUBSTRING_NODE:
+			/* the run must not leave the substring's window */
+			if (i < max_before)
+				max_before = i;
+			if (self->length - i < max_after)
+				max_after = self->length - i;
+			i += self->v.substring.offset;
+			self = self->v.substring.child;
+			break;
+		case TRANSFORM_NODE:
+			/* Find the source run, then translate the block of
+			 * its buffer that holds it. */
+			run = _rope_chunk(self->v.transform.child, i, before,
+					  after, block, block_length,
+					  block_key);
+			if (run == NULL)
+				return NULL;
+			offset = run - *block;
+			start = offset - offset % TRANSFORM_BLOCK_LENGTH;
+			*block_length -= start;
+			if (*block_length > TRANSFORM_BLOCK_LENGTH)
+				*block_length = TRANSFORM_BLOCK_LENGTH;
+			*block = rope_transform_block(self, *block_key, start,
+						      *block + start,
+						      *block_length);
+			if (*block == NULL)
+				return NULL;
+			*block_key = *block;
+			offset -= start;
+			if (*before > offset)
+				*before = offset;
+			if (*before > max_before)
+				*before = max_before;
+			if (*after > *block_length - offset)
+				*after = *block_length - offset;
+			if (*after > max_after)
+				*after = max_after;
+			return *block + offset;
+		}
+	}
+}
+
+static const char *
+rope_chunk(RopeObject *self, Py_ssize_t i, Py_ssize_t *before,
+	   Py_ssize_t *after)
+{
+	const char *block, *run;
+	const void *block_key;
+	Py_ssize_t block_length;
+
+	run = _rope_chunk(self, i, before, after, &block, &block_length,
+			  &block_key);
+	if (run)
+		rope_policy_note(0, *after);
+	return run;
+}
+
+/* Return the byte at position i, or -1 with an error set. */
+static int
+rope_index(RopeObject *self, Py_ssize_t i)
+{
+	Py_ssize_t before, after, block_length;
+	const char *block, *run;
+	const void *block_key;
+
+	run = _rope_chunk(self, i, &before, &after, &block, &block_length,
+			  &block_key);
+	if (run == NULL)
+		return -1;
+	return (unsigned char)*run;
+}
+
+/* Copy count bytes taken every step bytes from position start (step may
+ * be negative), fetching each leaf run only once. */
+static int
+_rope_str_strided(RopeObject *self, Py_ssize_t start, Py_ssize_t step,
+		  Py_ssize_t count, char *p)
+{
+	const char *run;
+	Py_ssize_t before, after, n, k;
+
+	while (count > 0) {
+		run = rope_chunk(self, start, &before, &after);
+		if (run == NULL)
+			return -1;
+		if (step > 0)
+			n = (after - 1) / step + 1;
+		else
+			n = before / -step + 1;
+		if (n > count)
+			n = count;
+		for (k = 0; k < n; k++) {
+			*p++ = *run;
+			run += step;
+		}
+		start += n * step;
+		count -= n;
+	}
+	return 0;
+}
+
+/* Matching, spans and byte counts, all read a leaf run at a time */
+
+/* 1 if the len bytes at data appear at position pos, 0 if not, or -1
+ * with an error set. */
+static int
+rope_match(RopeObject *self, Py_ssize_t pos, const char *data,
+	   Py_ssize_t len)
+{
+	const char *run;
+	Py_ssize_t before, after;
+
+	while (len > 0) {
+		run = rope_chunk(self, pos, &before, &after);
+		if (run == NULL)
+			return -1;
+		if (after > len)
+			after = len;
+		if (memcmp(run, data, after) != 0)
+			return 0;
+		pos += after;
+		data += after;
+		len -= after;
+	}
+	return 1;
+}
+
+/* Length of the longest prefix (or, if reverse, suffix) of self made
+ * only of bytes whose entry in set is non-zero, or -1 with an error
+ * set. */
+static Py_ssize_t
+rope_span(RopeObject *self, const char *set, int reverse)
+{
+	const char *run;
+	Py_ssize_t i = 0, before, after, k;
+
+	while (i < self->length) {
+		if (reverse) {
+			run = rope_chunk(self, self->length - 1 - i,
+					 &before, &after);
+			if (run == NULL)
+				return -1;
+			for (k = 0; k <= before &&
+				     set[(unsigned char) run[-k]]; k++)
+				;
+			i += k;
+			if (k <= before)
+				break;
+		}
+		else {
+			run = rope_chunk(self, i, &before, &after);
+			if (run == NULL)
+				return -1;
+			for (k = 0; k < after && set[(unsigned char) run[k]]; k++)
+				;
+			i += k;
+			if (k < after)
+				break;
+		}
+	}
+	return i;
+}
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_LOW7 0x7f7f7f7f7f7f7f7fULL
+#define SWAR_EVEN 0x00ff00ff00ff00ffULL
+
+/* Count the bytes equal to c, eight at a time.  After x ^= c * ONES a
+ * byte of x is zero exactly when the top bit of the same byte of
+ * ~(((x & LOW7) + LOW7) | x) is set; those bits are added up lane by
+ * lane and the lanes summed every 255 words, before they can carry. */
+static Py_ssize_t
+rope_count_run(const char *p, Py_ssize_t n, unsigned char c)
+{
+	unsigned long long pattern = SWAR_ONES * c, x, lanes;
+	Py_ssize_t total = 0;
+	int k;
+
+	while (n >= 8) {
+		lanes = 0;
+		for (k = 0; k < 255 && n >= 8; k++, n -= 8, p += 8) {
+			memcpy(&x, p, 8);
+			x ^= pattern;
+			lanes += (~(((x & SWAR_LOW7) + SWAR_LOW7) | x) &
+				  ~SWAR_LOW7) >> 7;
+		}
+		lanes = (lanes & SWAR_EVEN) + ((lanes >> 8) & SWAR_EVEN);
+		total += (Py_ssize_t) ((lanes * 0x0001000100010001ULL) >> 48);
+	}
+	while (n-- > 0)
+		total += ((unsigned char) *p++ == c);
+	return total;
+}
+
+/* Number of bytes equal to c in [start, stop) of self, or -1 with an
+ * error set.  Each node remembers the count over its whole length for
+ * the last byte it was asked about, so repeated counts only read the
+ * leaves at the edges of the range. */
+static Py_ssize_t
+rope_count_byte(RopeObject *self, Py_ssize_t start, Py_ssize_t stop, int c)
+{
+	RopeObject *child;
+	const char *run;
+	Py_ssize_t total = 0, n, first, last, before, after, whole_count;
+	int whole, b, source;
+
+	if (start >= stop)
+		return 0;
+	whole = (start == 0 && stop == self->length);
+	if (whole && self->counted_byte == c)
+		return self->counted;
+	switch (rope_read_type(self)) {
+	case LITERAL_NODE:
+		run = rope_leaf_bytes(self);
+		if (run == NULL)
+			return -1;
+		total = rope_count_run(run + start, stop - start,
+				       (unsigned char) c);
+		break;
+	case CONCAT_NODE:
+		n = self->v.concat.left->length;
+		if (start < n) {
+			total = rope_count_byte(self->v.concat.left, start,
+						stop < n ? stop : n, c);
+			if (total < 0)
+				return -1;
+		}
+		if (stop > n) {
+			n = rope_count_byte(self->v.concat.right,
+					    start > n ? start - n : 0,
+					    stop - n, c);
+			if (n < 0)
+				return -1;
+			total += n;
+		}
+		break;
+	case REPEAT_NODE:
+		child = self->v.repeat.child;
+		first = start / child->length;
+		last = (stop - 1) / child->length;
+		if (first == last) {
+			total = rope_count_byte(child, start % child->length,
+						(stop - 1) % child->length + 1,
+						c);
+			break;
+		}
+		total = rope_count_byte(child, start % child->length,
+					child->length, c);
+		n = rope_count_byte(child, 0, (stop - 1) % child->length + 1,
+				    c);
+		if (total < 0 || n < 0)
+			return -1;
+		total += n;
+		if (last - first > 1) {
+			whole_count = rope_count_byte(child, 0, child->length,
+						      c);
+			if (whole_count < 0)
+				return -1;
+			total += (last - first - 1) * whole_count;
+		}
+		break;
+	case SUBSTRING_NODE:
+		total = rope_count_byte(self->v.substring.child,
+					start + self->v.substring.offset,
+					stop + self->v.substring.offset, c);
+		break;
+	case TRANSFORM_NODE:
+		/* A byte that only one source byte maps to can be counted
+		 * in the child; otherwise count the translated runs. */
+		source = -1;
+		for (b = 0; b < 256; b++)
+			if (self->v.transform.table[b] == c) {
+				if (source != -1) {
+					source = -2;
+					break;
+				}
+				source = b;
+			}
+		if (source == -1)
+			total = 0;
+		else if (source >= 0)
+			total = rope_count_byte(self->v.transform.child,
+						start, stop, source);
+		else {
+			while (start < stop) {
+				run = rope_chunk(self, start, &before, &after);
+				if (run == NULL)
+					return -1;
+				if (after > stop - start)
+					after = stop - start;
+				total += rope_count_run(run, after,
+							(unsigned char) c);
+				start += after;
+			}
+		}
+		break;
+	}
+	if (total < 0)
+		return -1;
+	if (whole) {
+		self->counted_byte = c;
+		self->counted = total;
+	}
+	return total;
+}
+
+/* Gathering many pieces at once
+ *
+ * rope_gather copies each span's bytes to its dst.  The spans are taken
+ * in order of position and the path from the root to the current leaf
+ * is kept on a stack, so moving to the next span only climbs as far as
+ * the lowest node that holds it and walks down from there: the whole
+ * batch costs one traversal of the parts of the tree it touches, not a
+ * walk from the root per span.  Each frame knows which positions it may
+ * answer for, since a substring's child extends beyond its window.
+ * Transforms and nodes with a flat copy are read through rope_chunk.  Spans
+ * of a leaf's length or more go to _rope_str_range instead: the walk
+ * from the root is small next to the copy, and repeats get filled by
+ * doubling rather than a copy at a time.
+ */
+
+typedef struct gather_frame {
+	RopeObject *node;
+	Py_ssize_t start;	/* position of the node's first byte */
+	Py_ssize_t lo, hi;	/* positions it may answer for */
+} gather_frame;
+
+/* Copy n spans, sorted by start and each within self.  Returns 0, or -1
+ * with an error set. */
+static int
+rope_gather(RopeObject *self, const RopeSpan *spans, Py_ssize_t n)
+{
+	gather_frame *stack, *top;
+	RopeObject *node, *child;
+	const char *run;
+	Py_ssize_t i, pos, left, before, after, start;
+	char *dst;
+
+	stack = ROPE_MALLOC((self->depth + 1) * sizeof(gather_frame));
+	if (stack == NULL) {
+		ROPE_NOMEM();
+		return -1;
+	}
+	top = stack;
+	top->node = self;
+	top->start = top->lo = 0;
+	top->hi = self->length;
+	for (i = 0; i < n; i++) {
+		pos = spans[i].start;
+		left = spans[i].length;
+		dst = spans[i].dst;
+		if (left >= MIN_LITERAL_LENGTH) {
+			if (_rope_str_range(self, pos, left, &dst) < 0) {
+				ROPE_FREE(stack);
+				return -1;
+			}
+			continue;
+		}
+		while (left > 0) {
+			while (pos < top->lo || pos >= top->hi)
+				top--;
+			/* down to the leaf or transform holding pos */
+			for (node = top->node; top - stack < self->depth;
+			     node = child) {
+				start = top->start;
+				if (node->flat)
+					break;
+				if (node->type == CONCAT_NODE) {
+					child = node->v.concat.left;
+					if (pos - start >= child->length) {
+						start += child->length;
+						child = node->v.concat.right;
+					}
+				}
+				else if (node->type == REPEAT_NODE) {
+					child = node->v.repeat.child;
+					start += (pos - start) / child->length *
+						child->length;
+				}
+				else if (node->type == SUBSTRING_NODE) {
+					child = node->v.substring.child;
+					start -= node->v.substring.offset;
+				}
+				else
+					break;
+				top[1].node = child;
+				top[1].start = start;
+				top[1].lo = (start > top->lo ? start : top->lo);
+				top[1].hi = (start + child->length < top->hi ?
+					     start + child->length : top->hi);
+				top++;
+			}
+			run = rope_chunk(node, pos - top->start, &before,
+					 &after);
+			if (run == NULL) {
+				ROPE_FREE(stack);
+				return -1;
+			}
+			if (after > top->hi - pos)
+				after = top->hi - pos;
+			if (after > left)
+				after = left;
+			memcpy(dst, run, after);
+			dst += after;
+			pos += after;
+			left -= after;
+		}
+	}
+	ROPE_FREE(stack);
+	return 0;
+}
+
+/* Slicing is O(1): the result is a SUBSTRING_NODE that views the
+ * original rope, and a slice of a slice views the innermost child
+ * directly.  Short slices that would keep a much larger rope alive are
+ * copied out into a literal instead. */
+static RopeObject *
+rope_slice(RopeObject *self, Py_ssize_t start, Py_ssize_t stop)
+{
+	RopeObject *retval, *child;
+	Py_ssize_t length;
+	char *p;
+
+	if (start < 0)
+		start = 0;
+	if (stop > self->length)
+		stop = self->length;
+	if (stop < start)
+		stop = start;
+	if (start == 0 && stop == self->length) {
+		ROPE_INCREF(self);
+		return self;
+	}
+	length = stop - start;
+	rope_policy_note(1, 0);
+	if (self->type == SUBSTRING_NODE) {
+		start += self->v.substring.offset;
+		self = self->v.substring.child;
+	}
+
+	if (length <= rope_policy.leaf_length &&
+	    self->length / SUBSTRING_PIN_RATIO >= length) {
+		retval = rope_from_string(NULL, length);
+		if (retval == NULL)
+			return NULL;
+		p = retval->v.literal;
+		if (_rope_str_range(self, start, length, &p) < 0) {
+			ROPE_DECREF(retval);
+			return NULL;
+		}
+		return retval;
+	}
+	if (self->type == REPEAT_NODE) {
+		/* Slices within one copy, or of whole copies, drop the
+		 * repeat or shorten it rather than viewing it. */
+		child = self->v.repeat.child;
+		if (start / child->length == (start + length - 1) / child->length)
+			return rope_slice(child, start % child->length,
+					  start % child->length + length);
+		if (start % child->length == 0 && length % child->length == 0)
+			return rope_repeat_node(child, length / child->length);
+	}
+
+	retval = rope_from_type(SUBSTRING_NODE, length);
+	if (retval == NULL)
+		return NULL;
+	ROPE_INCREF(self);
+	retval->v.substring.child = self;
+	retval->v.substring.offset = start;
+	retval->depth = self->depth + 1;
+	return retval;
+}
+
@@ -0,0 +1,287 @@
+/*
+ * ropecore.h
+ * This file is part of CRopes: A Ropes data type for CPython
+ *
+ * Copyright (C) 2007 - Travis Athougies
+ *
+ * CRopes: A Ropes data type for CPython is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * CRopes: A Ropes data type for CPython is distributed in the hope
+ * that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CRopes: A Ropes data type for CPython; if not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/* The rope node algebra, independent of the interpreter.
+ *
+ * ropecore.c is not compiled on its own: it is included by the file that
+ * provides its environment, so that the core's small functions can still
+ * be inlined into their callers.  ropes.c includes it with the CPython
+ * hooks below (nodes are Rope_Type objects, memory comes from PyMem and
+ * errors are Python exceptions).  Defining ROPE_STANDALONE selects plain
+ * C hooks instead: nodes carry their own reference count, memory comes
+ * from rope_allocator and the last error message is left in rope_error.
+ * bench/ropebench.c is built that way.
+ *
+ * Functions returning RopeObject * return a new reference, or NULL with
+ * an error set.
+ */
+
+#ifndef ROPECORE_H
+#define ROPECORE_H
+
+#ifdef ROPE_STANDALONE
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* The core is written against the CPython size type. */
+typedef ssize_t Py_ssize_t;
+#define PY_SSIZE_T_MAX SSIZE_MAX
+
+typedef struct RopeAllocator {
+	void *(*alloc) (size_t size);
+	void (*release) (void *p);
+} RopeAllocator;
+
+static RopeAllocator rope_allocator = { malloc, free };
+static const char *rope_error;
+
+#define ROPE_OBJECT_HEAD	Py_ssize_t ob_refcnt;
+#define ROPE_BASE_TYPE		void	/* no borrowed literals */
+
+#define ROPE_MALLOC(n)		(rope_allocator.alloc(n))
+#define ROPE_FREE(p)		(rope_allocator.release(p))
+#define ROPE_NOMEM()		(rope_error = "out of memory")
+#define ROPE_OVERFLOW(msg)	(rope_error = (msg))
+#define ROPE_FAIL(msg)		(rope_error = (msg))
+
+#define ROPE_NODE_NEW()		rope_node_new()
+#define ROPE_INCREF(op)		((op)->ob_refcnt++)
+#define ROPE_DECREF(op)						\
+	do {								\
+		if (--(op)->ob_refcnt == 0)				\
+			rope_release(op);				\
+	} while (0)
+#define ROPE_BASE_DECREF(b)	((void)(b))
+
+#else /* !ROPE_STANDALONE */
+
+#include "Python.h"
+
+#define ROPE_OBJECT_HEAD	PyObject_HEAD
+#define ROPE_BASE_TYPE		PyObject
+
+#define ROPE_MALLOC(n)		PyMem_Malloc(n)
+#define ROPE_FREE(p)		PyMem_Free(p)
+#define ROPE_NOMEM()		PyErr_NoMemory()
+#define ROPE_OVERFLOW(msg)	PyErr_SetString(PyExc_OverflowError, msg)
+#define ROPE_FAIL(msg)		PyErr_SetString(PyExc_SystemError, msg)
+
+#define ROPE_NODE_NEW()		PyObject_GC_New(RopeObject, &Rope_Type)
+#define ROPE_INCREF(op)		Py_INCREF(op)
+#define ROPE_DECREF(op)		Py_DECREF(op)
+#define ROPE_BASE_DECREF(b)	Py_DECREF(b)
+
+static PyTypeObject Rope_Type;
+
+#endif /* ROPE_STANDALONE */
+
+#include <time.h>
+#include <zlib.h>
+
+#define ROPE_XINCREF(op)	do { if (op) ROPE_INCREF(op); } while (0)
+#define ROPE_XDECREF(op)	do { if (op) ROPE_DECREF(op); } while (0)
+
+#define LITERAL_MERGING 1
+#define MIN_LITERAL_LENGTH 1024	/* default leaf_length of RopePolicy */
+#define ROPE_DEPTH 90		/* enough Fibonacci slots for any length */
+#define ROPE_BALANCE_DEPTH 32	/* default balance_depth of RopePolicy */
+#define ROPE_MAX_BALANCE_DEPTH 64
+#define ROPE_MIN_BALANCE_DEPTH 16
+#define ROPE_MAX_LEAF_LENGTH (1024 * 1024)
+#define ROPE_ADAPT_MIN_LEAF 64	/* the smallest leaf_length adapted to */
+#define ROPE_ADAPT_WINDOW 4096	/* operations between adaptive retunes */
+#define ROPE_LEAF_VISIT_COST 4096	/* bytes copied per leaf visited */
+#define SUBSTRING_PIN_RATIO 16
+#define TRANSFORM_BLOCK_LENGTH (16 * MIN_LITERAL_LENGTH)
+#define REPEAT_FILL_BLOCK (256 * 1024)
+#define ROPE_HOT_MIN_LEAVES 4	/* never compressed, however large */
+
+enum node_type {
+	LITERAL_NODE,
+	CONCAT_NODE,
+	REPEAT_NODE,
+	SUBSTRING_NODE,
+	TRANSFORM_NODE,
+};
+
+/* Translated copies of the source blocks a TRANSFORM_NODE has been read
+ * through.  A block is known by what holds it (the leaf, or the
+ * translated block of a nested transform), its offset there and its
+ * length; not by its address, which changes when a compressed leaf is
+ * read back. */
+typedef struct transform_memo {
+	Py_ssize_t used;
+	Py_ssize_t size;	/* power of two */
+	struct transform_memo_entry {
+		const void *key;
+		Py_ssize_t offset;
+		Py_ssize_t length;
+		char *data;
+	} entries[1];
+} transform_memo;
+
+/* Compression bookkeeping of a literal, from the first time it is read
+ * while compression is on (see rope_literal). */
+typedef struct rope_packing {
+	struct RopeObject *leaf;
+	struct rope_packing *prev, *next;	/* in the hot list */
+	int hot;		/* bytes present and in the hot list */
+	int incompressible;	/* bytes stay, out of the hot list */
+	char *packed;		/* zlib copy, NULL until first evicted */
+	Py_ssize_t packed_length;
+} rope_packing;
+
+/* A flat copy of a node's bytes in the flatten cache.  owner holds the
+ * bytes (the str returned by str(), say) or is NULL if they are ours.  A
+ * pinned copy has had its address handed out; it is never evicted. */
+typedef struct rope_flat {
+	struct RopeObject *node;
+	struct rope_flat *prev, *next;	/* most recently used first */
+	ROPE_BASE_TYPE *owner;
+	char *bytes;
+	Py_ssize_t length;
+	int pinned;
+} rope_flat;
+
+/* How ropes are shaped as they are built.  Balancing merges runs of
+ * literals shorter than leaf_length into leaves of up to that size, and a
+ * concatenation deeper than balance_depth is rebalanced.  rope_policy is
+ * the module's; a builder may carry its own.  With adaptive set,
+ * rope_policy retunes itself from the mix of edits and scans. */
+typedef struct RopePolicy {
+	Py_ssize_t leaf_length;
+	int balance_depth;
+	int adaptive;
+} RopePolicy;
+
+typedef struct RopeCompressStats {
+	Py_ssize_t hot_leaves, hot_bytes;	/* tracked, bytes present */
+	Py_ssize_t cold_leaves, cold_bytes;	/* only held compressed */
+	Py_ssize_t packed_bytes;	/* all compressed copies */
+	Py_ssize_t compressions, decompressions;
+	double compress_seconds, decompress_seconds;
+} RopeCompressStats;
+
+typedef struct RopeObject {
+	ROPE_OBJECT_HEAD
+	enum node_type type;
+	Py_ssize_t length;
+	long hash;		/* -1 if not computed. */
+	int counted_byte;	/* byte counted over the node, or -1 */
+	Py_ssize_t counted;	/* how many times it occurs */
+	int depth;		/* not used yet. */
+	ROPE_BASE_TYPE *base;	/* owner of a borrowed literal, or NULL */
+	int interned;		/* literal is in the intern table */
+	struct rope_packing *packing;	/* literal is tracked for compression */
+	struct rope_flat *flat;	/* cached flat copy of the bytes, or NULL */
+	union {
+		char *literal;
+		struct concat_node {
+			struct RopeObject *left;
+			struct RopeObject *right;
+		} concat;
+		struct repeat_node {
+			struct RopeObject *child;
+			Py_ssize_t count;
+		} repeat;
+		struct substring_node {
+			struct RopeObject *child;
+			Py_ssize_t offset;
+		} substring;
+		struct transform_node {
+			struct RopeObject *child;
+			unsigned char *table;	/* 256 entries */
+			struct transform_memo *memo;
+		} transform;
+	} v;
+} RopeObject;
+
+/* A piece of a rope to copy out, see rope_gather */
+typedef struct RopeSpan {
+	Py_ssize_t start, length;
+	char *dst;
+} RopeSpan;
+
+typedef struct RopeBalanceState
+{
+	RopeObject* work_list[ROPE_DEPTH];
+	char* string;
+	Py_ssize_t string_length;
+	Py_ssize_t leaf_length;	/* from the policy in force at init */
+} RopeBalanceState;
+
+#ifdef ROPE_STANDALONE
+static RopeObject *rope_node_new(void);
+static void rope_release(RopeObject *self);
+#endif
+static void rope_node_clear(RopeObject *self);
+
+static void rope_policy_note(Py_ssize_t edits, Py_ssize_t scanned);
+
+static RopeObject *rope_from_type(enum node_type type, Py_ssize_t len);
+static RopeObject *rope_from_string(const char *str, Py_ssize_t len);
+static RopeObject *rope_concat_unchecked(RopeObject *self, RopeObject *other);
+static RopeObject *rope_concat(RopeObject *self, RopeObject *other);
+static RopeObject *rope_repeat(RopeObject *self, Py_ssize_t count);
+static RopeObject *rope_transform(RopeObject *self,
+				  const unsigned char *table);
+static RopeObject *rope_slice(RopeObject *self, Py_ssize_t start,
+			      Py_ssize_t stop);
+static RopeObject *rope_balance(RopeObject *r);
+static RopeObject *rope_balance_leaves(RopeObject *r, Py_ssize_t leaf_length);
+static void rope_balance_init(RopeBalanceState *state);
+static void rope_balance_clear(RopeBalanceState *state);
+static int rope_balance_range(RopeBalanceState *state, RopeObject *node,
+			      Py_ssize_t start, Py_ssize_t stop);
+static RopeObject *rope_balance_finish(RopeBalanceState *state);
+
+static const char *rope_literal(RopeObject *leaf);
+static const char *rope_literal_pin(RopeObject *leaf);
+static int rope_compress_leaves(RopeObject *self);
+static const char *rope_flat_use(RopeObject *self);
+static int rope_flat_attach(RopeObject *self, ROPE_BASE_TYPE *owner,
+			    char *bytes, int pin);
+static void rope_flat_pin(RopeObject *self);
+static void rope_flat_drop(RopeObject *self);
+static void rope_flat_trim(void);
+
+static int _rope_str(RopeObject *rope, char **p);
+static int _rope_str_range(RopeObject *rope, Py_ssize_t start,
+			   Py_ssize_t len, char **p);
+static int _rope_str_strided(RopeObject *self, Py_ssize_t start,
+			     Py_ssize_t step, Py_ssize_t count, char *p);
+static const char *rope_chunk(RopeObject *self, Py_ssize_t i,
+			      Py_ssize_t *before, Py_ssize_t *after);
+static int rope_index(RopeObject *self, Py_ssize_t i);
+static int rope_match(RopeObject *self, Py_ssize_t pos, const char *data,
+		      Py_ssize_t len);
+static Py_ssize_t rope_span(RopeObject *self, const char *set, int reverse);
+static Py_ssize_t rope_count_byte(RopeObject *self, Py_ssize_t start,
+				  Py_ssize_t stop, int c);
+static int rope_gather(RopeObject *self, const RopeSpan *spans,
+		       Py_ssize_t n);
+
+#endif /* ROPECORE_H */
@@ -24,120 +24,91 @@
 
 #include "Python.h"
 #include "limits.h"
+#include "frameobject.h"
+#include "opcode.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ROPES_MODULE
+#include "ropes.h"
+#include "ropecore.c"
 
 #define DEBUG 1
-#define LITERAL_MERGING 1
-#define MIN_LITERAL_LENGTH 1024
-#define ROPE_DEPTH 32
-#define ROPE_BALANCE_DEPTH 32
+#define TAIL_LITERAL_CAPACITY						\
+	(rope_policy.leaf_length > 16 * MIN_LITERAL_LENGTH ?		\
+	 rope_policy.leaf_length : 16 * MIN_LITERAL_LENGTH)
 
 /* XXX More documentation */
 PyDoc_STRVAR(ropes_module_doc, "Ropes implementation for CPython");
 
-enum node_type {
-	LITERAL_NODE,
-	CONCAT_NODE,
-	REPEAT_NODE,
-};
-
-typedef struct RopeObject {
+typedef struct RopeTailBuffer {
 	PyObject_HEAD
-	enum node_type type;
-	Py_ssize_t length;
-	long hash;		/* -1 if not computed. */
-	int depth;		/* not used yet. */
-	union {
-		char *literal;
-		struct concat_node {
-			struct RopeObject *left;
-			struct RopeObject *right;
-		} concat;
-		struct repeat_node {
-			struct RopeObject *child;
-			int count;
-		} repeat;
-	} v;
-} RopeObject;
+	char *data;
+	Py_ssize_t used;	/* high water mark */
+	Py_ssize_t capacity;
+} RopeTailBuffer;
 
 typedef struct RopeIter {
 	PyObject_HEAD
 	RopeObject *rope;
-	RopeObject **list;
-	Py_ssize_t list_length;
-	char *cur;
-	Py_ssize_t cur_length;
-	Py_ssize_t base_length;
-	Py_ssize_t pos, list_pos, cur_pos;
+	Py_ssize_t pos;		/* next byte to produce */
+	const char *run;
+	Py_ssize_t run_left;
+	size_t epoch;		/* rope_run_epoch when run was found */
 } RopeIter;
 
-typedef struct RopeBalanceState
-{
-  RopeObject* work_list[ROPE_DEPTH]; 
-	Py_ssize_t a, b, old_a, empty;
-	RopeObject *first_node;
-	char* string;
-	int string_length;
-} RopeBalanceState;
-
+typedef struct RopeReverseIter {
+	PyObject_HEAD
+	RopeObject *rope;
+	Py_ssize_t pos;		/* bytes left to produce */
+	int chunks;		/* yield whole leaf runs, not characters */
+	const char *run;
+	Py_ssize_t run_left;
+	size_t epoch;		/* rope_run_epoch when run was found */
+} RopeReverseIter;
 
-static PyTypeObject Rope_Type;
 static PyTypeObject RopeIter_Type;
+static PyTypeObject RopeReverseIter_Type;
 
-static RopeObject* rope_balance(RopeObject *r);
-static RopeObject *rope_slice(RopeObject *self, Py_ssize_t start,
-			      Py_ssize_t stop);
-static RopeObject *rope_slice_left(RopeObject *self, Py_ssize_t stop);
-static RopeObject *rope_slice_right(RopeObject *self, Py_ssize_t start);
+static void intern_remove(RopeObject *leaf);
 
-#define Rope_Check(op) (((PyObject *)(op))->ob_type == &Rope_Type)
-
-static void
-_rope_str(RopeObject *rope, char **p)
-{
-	int i;
-	char *tmp, *q;
+static Py_ssize_t flat_hits = 0;	/* str() answered by the flatten cache */
 
-	switch (rope->type) {
-	case LITERAL_NODE:
-		memcpy(*p, rope->v.literal, rope->length);
-		*p += rope->length;
-		break;
-	case CONCAT_NODE:
-		if (rope->v.concat.left)
-			_rope_str(rope->v.concat.left, p);
-		if (rope->v.concat.right)
-			_rope_str(rope->v.concat.right, p);
-		break;
-	case REPEAT_NODE:
-		/* Compute the child's str once and repeat it */
-		tmp = (char *)PyMem_Malloc(rope->length * sizeof(char));
-		if (tmp == NULL) {
-			PyErr_NoMemory();
-			return;
-		}
-		q = tmp;
-		_rope_str(rope->v.repeat.child, &q);
-		for (i = 0; i < rope->v.repeat.count; i++) {
-			memcpy(*p, tmp, rope->v.repeat.child->length);
-			*p += rope->v.repeat.child->length;
-		}
-		PyMem_Free(tmp);
-	}
-}
+#define Rope_Check(op) (((PyObject *)(op))->ob_type == &Rope_Type)
 
 static PyObject *
 rope_str(RopeObject *self)
 {
 	PyObject *str;
 	char *p;
+	int cached;
 
+	if (self->flat) {
+		rope_flat_use(self);
+		flat_hits++;
+		Py_INCREF(self->flat->owner);
+		return self->flat->owner;
+	}
 	str = PyString_FromStringAndSize(NULL, self->length);
 	if (str == NULL)
 		return NULL;
 	p = PyString_AS_STRING(str);
-	_rope_str(self, &p);
-	if (PyErr_Occurred())
+	if (_rope_str(self, &p) < 0) {
+		Py_DECREF(str);
 		return NULL;
+	}
+	rope_policy_note(0, self->length);
+	if (flat_max_bytes > 0) {
+		Py_INCREF(str);
+		cached = rope_flat_attach(self, str, PyString_AS_STRING(str),
+					  0);
+		if (cached <= 0)
+			Py_DECREF(str);
+		if (cached < 0)
+			PyErr_Clear();	/* the string is still good */
+	}
 
 	return str;
 }
@@ -182,39 +153,11 @@ rope_repr(RopeObject *self)
 	return v;
 }
 
-static char
-rope_index(RopeObject *self, Py_ssize_t i)
-{
-	assert(self && i < self->length);
-
-	switch (self->type) {
-	case LITERAL_NODE:
-		return self->v.literal[i];
-	case CONCAT_NODE:
-		if (self->v.concat.left && i < self->v.concat.left->length) {
-			return rope_index(self->v.concat.left, i);
-		}
-		else if (self->v.concat.right) {
-			i = i - self->v.concat.right->length;
-			return rope_index(self->v.concat.right, i);
-		}
-		break;
-	case REPEAT_NODE:
-		if (self->v.repeat.child) {
-			return rope_index(self->v.repeat.child,
-					  i % self->v.repeat.child->length);
-		}
-		break;
-	}
-
-	/* never reached */
-	return -1;
-}
-
 static PyObject *
 rope_getitem(RopeObject *self, Py_ssize_t i)
 {
-	char c;
+	int c;
+	char ch;
 
 	if (i < 0)
 		i += self->length;
@@ -223,7 +166,10 @@ rope_getitem(RopeObject *self, Py_ssize_t i)
 		return NULL;
 	}
 	c = rope_index(self, i);
-	return PyString_FromStringAndSize(&c, 1);
+	if (c < 0)
+		return NULL;
+	ch = (char)c;
+	return PyString_FromStringAndSize(&ch, 1);
 }
 
 static PyObject *
@@ -243,9 +189,16 @@ rope_subscript(RopeObject *self, PyObject * item)
 					&start, &stop, &step, &length) < 0) {
 			return NULL;
 		}
-		if(step != 1) {
-			Py_INCREF(Py_NotImplemented);
-			return Py_NotImplemented;
+		if (step != 1) {
+			RopeObject *retval = rope_from_string(NULL, length);
+			if (retval == NULL)
+				return NULL;
+			if (_rope_str_strided(self, start, step, length,
+					      retval->v.literal) < 0) {
+				Py_DECREF(retval);
+				return NULL;
+			}
+			return (PyObject *) retval;
 		}
 		return (PyObject *) rope_slice(self, start, stop);
 	}
@@ -261,59 +214,299 @@ rope_dealloc(RopeObject *self)
 {
 	PyObject_GC_UnTrack(self);
 	Py_TRASHCAN_SAFE_BEGIN(self)
-		switch (self->type) {
-	case LITERAL_NODE:
-		PyMem_Free(self->v.literal);
-		break;
-	case CONCAT_NODE:
-		Py_XDECREF(self->v.concat.left);
-		Py_XDECREF(self->v.concat.right);
-		break;
-	case REPEAT_NODE:
-		Py_XDECREF(self->v.repeat.child);
-		break;
-	}
+	if (self->interned)
+		intern_remove(self);
+	rope_node_clear(self);
 	((PyObject *) self)->ob_type->tp_free(self);
 	Py_TRASHCAN_SAFE_END(self)
 }
 
+/* Leaf interning
+ *
+ * When enabled, literals made from strings are looked up by content in a
+ * global table first, so every rope built from the same bytes shares one
+ * leaf and equal interned leaves are always the same object.  Like
+ * mortal interned strings the table only borrows its leaves: a leaf takes
+ * itself out of the table when it is freed.  Once max_bytes worth of
+ * leaves are interned, new leaves are simply not interned.
+ */
+
+typedef struct intern_entry {
+	size_t hash;
+	RopeObject *leaf;	/* NULL if never used, INTERN_DUMMY if freed */
+} intern_entry;
+
+static intern_entry *intern_table = NULL;
+static Py_ssize_t intern_size = 0;	/* power of two */
+static Py_ssize_t intern_fill = 0;	/* used and dummy slots */
+static Py_ssize_t intern_used = 0;
+static Py_ssize_t intern_bytes = 0;
+static Py_ssize_t intern_max_bytes = 64 * 1024 * 1024;
+static Py_ssize_t intern_hits = 0;
+static int intern_enabled = 0;
+
+#define INTERN_DUMMY ((RopeObject *) &intern_table)
+
+static size_t
+intern_hash(const char *data, Py_ssize_t len)
+{
+	/* FNV-1a */
+	size_t h = (size_t)2166136261u;
+	const unsigned char *p = (const unsigned char *)data;
+
+	while (len-- > 0)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static intern_entry *
+intern_lookup(const char *data, Py_ssize_t len, size_t hash)
+{
+	intern_entry *free_slot = NULL, *entry;
+	size_t i, mask = intern_size - 1;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		entry = &intern_table[i];
+		if (entry->leaf == NULL)
+			return free_slot ? free_slot : entry;
+		if (entry->leaf == INTERN_DUMMY) {
+			if (!free_slot)
+				free_slot = entry;
+		}
+		else if (entry->hash == hash && entry->leaf->length == len &&
+			 memcmp(entry->leaf->v.literal, data, len) == 0)
+			return entry;
+	}
+}
+
+static int
+intern_resize(void)
+{
+	intern_entry *old = intern_table, *entry;
+	Py_ssize_t old_size = intern_size, size = 8, i;
+
+	while (size <= 4 * intern_used)
+		size *= 2;
+	intern_table = PyMem_Malloc(size * sizeof(intern_entry));
+	if (intern_table == NULL) {
+		intern_table = old;
+		PyErr_NoMemory();
+		return -1;
+	}
+	memset(intern_table, 0, size * sizeof(intern_entry));
+	intern_size = size;
+	intern_fill = intern_used;
+	for (i = 0; i < old_size; i++) {
+		if (old[i].leaf == NULL || old[i].leaf == INTERN_DUMMY)
+			continue;
+		entry = intern_lookup(old[i].leaf->v.literal,
+				      old[i].leaf->length, old[i].hash);
+		*entry = old[i];
+	}
+	PyMem_Free(old);
+	return 0;
+}
+
+static void
+intern_remove(RopeObject *leaf)
+{
+	intern_entry *entry;
+	size_t hash = intern_hash(leaf->v.literal, leaf->length);
+
+	entry = intern_lookup(leaf->v.literal, leaf->length, hash);
+	if (entry->leaf == leaf) {
+		entry->leaf = INTERN_DUMMY;
+		intern_used--;
+		intern_bytes -= leaf->length;
+	}
+}
+
+/* Like rope_from_string, but share the leaf through the intern table
+ * when interning is on. */
 static RopeObject *
-rope_from_type(enum node_type type, Py_ssize_t len)
+rope_from_string_interned(const char *str, Py_ssize_t len)
 {
-	RopeObject *new;
+	intern_entry *entry;
+	RopeObject *leaf;
+	size_t hash;
 
-	if(len < 0) {
-		PyErr_SetString(PyExc_OverflowError, "The rope is  too long!");
+	if (!intern_enabled || len == 0 ||
+	    intern_bytes > intern_max_bytes - len)
+		return rope_from_string(str, len);
+	if (3 * (intern_fill + 1) >= 2 * intern_size &&
+	    intern_resize() < 0)
 		return NULL;
+	hash = intern_hash(str, len);
+	entry = intern_lookup(str, len, hash);
+	if (entry->leaf && entry->leaf != INTERN_DUMMY) {
+		intern_hits++;
+		Py_INCREF(entry->leaf);
+		return entry->leaf;
 	}
-	new = PyObject_GC_New(RopeObject, &Rope_Type);
-	if (new == NULL)
+	leaf = rope_from_string(str, len);
+	if (leaf == NULL)
 		return NULL;
+	if (entry->leaf == NULL)
+		intern_fill++;
+	entry->hash = hash;
+	entry->leaf = leaf;
+	leaf->interned = 1;
+	intern_used++;
+	intern_bytes += len;
+	return leaf;
+}
+
+static PyObject *
+ropes_set_interning(PyObject *module, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "enabled", "max_bytes", 0 };
+	int enabled;
+	Py_ssize_t max_bytes = intern_max_bytes;
 
-	new->type = type;
-	new->length = len;
-	new->hash = -1;
-	new->depth = 0;
-	return new;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|n:set_interning",
+					 kwlist, &enabled, &max_bytes))
+		return NULL;
+	if (max_bytes < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"max_bytes must not be negative");
+		return NULL;
+	}
+	intern_enabled = enabled;
+	intern_max_bytes = max_bytes;
+	Py_RETURN_NONE;
 }
 
-static RopeObject *
-rope_from_string(const char *str, Py_ssize_t len)
+static PyObject *
+ropes_intern_stats(PyObject *module)
+{
+	return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+			     "leaves", intern_used,
+			     "bytes", intern_bytes,
+			     "max_bytes", intern_max_bytes,
+			     "hits", intern_hits);
+}
+
+static PyObject *
+ropes_set_compression(PyObject *module, PyObject *args, PyObject *kwds)
 {
-	RopeObject *new;
+	static char *kwlist[] = { "enabled", "hot_bytes", "min_leaf", 0 };
+	int enabled;
+	Py_ssize_t hot_bytes = compress_hot_bytes;
+	Py_ssize_t min_leaf = compress_min_leaf;
 
-	new = rope_from_type(LITERAL_NODE, len);
-	if (new == NULL)
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|nn:set_compression",
+					 kwlist, &enabled, &hot_bytes,
+					 &min_leaf))
 		return NULL;
-	
-	new->v.literal = (char *)PyMem_Malloc(len * sizeof(char));
-	if (new->v.literal == NULL) {
-		PyErr_NoMemory();
+	if (hot_bytes < 0 || min_leaf < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"hot_bytes and min_leaf must not be negative");
+		return NULL;
+	}
+	compress_enabled = enabled;
+	compress_hot_bytes = hot_bytes;
+	compress_min_leaf = min_leaf;
+	compress_trim();
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropes_set_flat_cache(PyObject *module, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "max_bytes", 0 };
+	Py_ssize_t max_bytes;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "n:set_flat_cache",
+					 kwlist, &max_bytes))
 		return NULL;
+	if (max_bytes < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"max_bytes must not be negative");
+		return NULL;
+	}
+	flat_max_bytes = max_bytes;
+	rope_flat_trim();
+	Py_RETURN_NONE;
+}
+
+static int
+rope_check_policy(RopePolicy *policy)
+{
+	if (policy->leaf_length < 1 ||
+	    policy->leaf_length > ROPE_MAX_LEAF_LENGTH) {
+		PyErr_Format(PyExc_ValueError,
+			     "leaf_length must be between 1 and %d",
+			     ROPE_MAX_LEAF_LENGTH);
+		return -1;
+	}
+	if (policy->balance_depth < ROPE_MIN_BALANCE_DEPTH ||
+	    policy->balance_depth > ROPE_MAX_BALANCE_DEPTH) {
+		PyErr_Format(PyExc_ValueError,
+			     "balance_depth must be between %d and %d",
+			     ROPE_MIN_BALANCE_DEPTH, ROPE_MAX_BALANCE_DEPTH);
+		return -1;
 	}
-	memcpy(new->v.literal, str, len);
+	return 0;
+}
+
+static PyObject *
+ropes_set_policy(PyObject *module, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "leaf_length", "balance_depth", "adaptive",
+				  0 };
+	RopePolicy policy = rope_policy;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nii:set_policy",
+					 kwlist, &policy.leaf_length,
+					 &policy.balance_depth,
+					 &policy.adaptive) ||
+	    rope_check_policy(&policy) < 0)
+		return NULL;
+	policy.adaptive = (policy.adaptive != 0);
+	rope_policy = policy;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropes_policy(PyObject *module)
+{
+	return Py_BuildValue("{s:n,s:i,s:O,s:n}",
+			     "leaf_length", rope_policy.leaf_length,
+			     "balance_depth", rope_policy.balance_depth,
+			     "adaptive",
+			     rope_policy.adaptive ? Py_True : Py_False,
+			     "retunes", policy_retunes);
+}
+
+static PyObject *
+ropes_flat_cache_stats(PyObject *module)
+{
+	return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n}",
+			     "ropes", flat_count,
+			     "bytes", flat_bytes,
+			     "max_bytes", flat_max_bytes,
+			     "pinned_bytes", flat_pinned_bytes,
+			     "hits", flat_hits,
+			     "evictions", flat_evictions);
+}
+
+static PyObject *
+ropes_compression_stats(PyObject *module)
+{
+	RopeCompressStats *st = &compress_stats;
 
-	return new;
+	return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:d,s:d}",
+			     "hot_leaves", st->hot_leaves,
+			     "hot_bytes", st->hot_bytes,
+			     "max_hot_bytes", compress_hot_bytes,
+			     "cold_leaves", st->cold_leaves,
+			     "cold_bytes", st->cold_bytes,
+			     "packed_bytes", st->packed_bytes,
+			     "saved_bytes", st->cold_bytes - st->packed_bytes,
+			     "compressions", st->compressions,
+			     "decompressions", st->decompressions,
+			     "compress_seconds", st->compress_seconds,
+			     "decompress_seconds", st->decompress_seconds);
 }
 
 static PyObject *
@@ -342,94 +535,352 @@ rope_new(PyTypeObject * type, PyObject * args, PyObject * kwds)
 	}
 	literal = PyString_AS_STRING(str);
 	length = PyString_GET_SIZE(str);
-	self = rope_from_string(literal, length);
+	self = rope_from_string_interned(literal, length);
 
 	return (PyObject *) self;
 }
 
-static RopeObject *
-rope_concat_unchecked(RopeObject *self, RopeObject *other)
+static PyObject *
+rope_sq_concat(RopeObject *self, PyObject *other)
 {
-	RopeObject *result;
-	
-	if(!other) {
-		Py_XINCREF(self);
-		return self;
-	}
-	if(!self) {
-		Py_XINCREF(other);
-		return other;
-	}
 	if (!Rope_Check(other)) {
 		PyErr_Format(PyExc_TypeError,
 			     "cannot concatenate Rope with '%.50s'",
-			     ((PyObject *) other)->ob_type->tp_name);
+			     other->ob_type->tp_name);
 		return NULL;
 	}
-	if(self->length <= 0) {
-		Py_INCREF(other);
-		return other;
-	}
-	Py_INCREF(self);
-	if(other->length <= 0)
-		return self;
-	Py_INCREF(other);
-	result = rope_from_type(CONCAT_NODE, self->length + other->length);
-	if(result == NULL)
-		return NULL;
-	result->v.concat.left = self;
-	result->v.concat.right = other;
-	result->depth =
-		(result->v.concat.left->depth>result->v.concat.right->depth?
-		 result->v.concat.left->depth:result->v.concat.right->depth)+1;
+	return (PyObject *) rope_concat(self, (RopeObject *) other);
+}
 
-	return result;
+/* Appending
+ *
+ * Leaves built by += live in a RopeTailBuffer with spare capacity.  A
+ * leaf whose bytes end exactly at the buffer's high water mark may be
+ * extended by writing past the mark: no existing rope can see those
+ * bytes, so every rope keeps its value.  Buffers double in size until
+ * they reach TAIL_LITERAL_CAPACITY, after which a new leaf is started.
+ */
+
+static void
+tailbuffer_dealloc(RopeTailBuffer *self)
+{
+	PyMem_Free(self->data);
+	PyObject_Del(self);
+}
+
+/* Read into by Rope.read_from(), through a memoryview that must keep the
+ * buffer alive; see ingest_readinto. */
+static int
+tailbuffer_getbuffer(RopeTailBuffer *self, Py_buffer *view, int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject *) self, self->data,
+				 self->capacity, 0, flags);
+}
+
+static PyBufferProcs tailbuffer_as_buffer = {
+	0,					/* bf_getreadbuffer */
+	0,					/* bf_getwritebuffer */
+	0,					/* bf_getsegcount */
+	0,					/* bf_getcharbuffer */
+	(getbufferproc) tailbuffer_getbuffer,	/* bf_getbuffer */
+	0,					/* bf_releasebuffer */
+};
+
+static PyTypeObject RopeTailBuffer_Type = {
+	PyObject_HEAD_INIT(0)
+	0,			/* ob_size */
+	"ropes.RopeTailBuffer",	/* tp_name */
+	sizeof(RopeTailBuffer),	/* tp_basicsize */
+	0,			/* tp_itemsize */
+	(destructor) tailbuffer_dealloc,	/* tp_dealloc */
+	0,			/* tp_print */
+	0,			/* tp_getattr */
+	0,			/* tp_setattr */
+	0,			/* tp_compare */
+	0,			/* tp_repr */
+	0,			/* tp_as_number */
+	0,			/* tp_as_sequence */
+	0,			/* tp_as_mapping */
+	0,			/* tp_hash */
+	0,			/* tp_call */
+	0,			/* tp_str */
+	0,			/* tp_getattro */
+	0,			/* tp_setattro */
+	&tailbuffer_as_buffer,	/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER,	/* tp_flags */
+	0,			/* tp_doc */
+};
+
+static RopeTailBuffer *
+tailbuffer_new(Py_ssize_t capacity)
+{
+	RopeTailBuffer *buf;
+
+	buf = PyObject_New(RopeTailBuffer, &RopeTailBuffer_Type);
+	if (buf == NULL)
+		return NULL;
+	buf->data = PyMem_Malloc(capacity);
+	if (buf->data == NULL) {
+		PyObject_Del(buf);
+		PyErr_NoMemory();
+		return NULL;
+	}
+	buf->capacity = capacity;
+	buf->used = 0;
+	return buf;
 }
 
-static RopeObject*
-rope_concat(RopeObject* self, RopeObject* other)
+/* Return a new leaf holding the bytes of head followed by those of tail,
+ * in a fresh tail buffer with room to grow. */
+static RopeObject *
+rope_tail_literal(RopeObject *head, RopeObject *tail)
 {
-	RopeObject* result=rope_concat_unchecked(self, other);
-	if(result==NULL)
+	RopeTailBuffer *buf;
+	RopeObject *leaf;
+	Py_ssize_t length = (head ? head->length : 0) + tail->length;
+	Py_ssize_t capacity = 2 * length;
+	char *p;
+
+	if (capacity < 64)
+		capacity = 64;
+	if (capacity > TAIL_LITERAL_CAPACITY)
+		capacity = TAIL_LITERAL_CAPACITY;
+	if (capacity < length)
+		capacity = length;
+	buf = tailbuffer_new(capacity);
+	if (buf == NULL)
 		return NULL;
-	if(other && self && other->length > 0 && result->length <= self->length) {
-		Py_DECREF(result);
-		PyErr_SetString(PyExc_OverflowError, "The strings are WAY too large!");
+	buf->used = length;
+	p = buf->data;
+	if ((head && _rope_str(head, &p) < 0) || _rope_str(tail, &p) < 0) {
+		Py_DECREF(buf);
 		return NULL;
 	}
-	if (result->depth > ROPE_BALANCE_DEPTH) {
-		RopeObject* balanced=rope_balance(result);
-		Py_DECREF(result);
-		if(!balanced)
-			return NULL;
-		result=balanced;
+
+	leaf = rope_from_type(LITERAL_NODE, length);
+	if (leaf == NULL) {
+		Py_DECREF(buf);
+		return NULL;
 	}
-	return result;
+	leaf->v.literal = buf->data;
+	leaf->base = (PyObject *) buf;
+	return leaf;
+}
+
+/* How many references to self `name += text` holds by itself: the value
+ * stack's, plus the variable's when the result goes straight back into
+ * it, just as ceval's string_concatenate reasons for str.  Called from
+ * anywhere else, only the caller's own. */
+static Py_ssize_t
+rope_caller_refs(RopeObject *self)
+{
+	PyFrameObject *f = PyEval_GetFrame();
+	unsigned char *code;
+	PyObject *name, *value = NULL;
+	int oparg;
+
+	if (f == NULL || f->f_lasti < 0 ||
+	    f->f_lasti + 3 >= PyString_GET_SIZE(f->f_code->co_code))
+		return 1;
+	code = (unsigned char *) PyString_AS_STRING(f->f_code->co_code) +
+		f->f_lasti;
+	if (code[0] != INPLACE_ADD)
+		return 1;
+	oparg = code[2] | (code[3] << 8);
+	switch (code[1]) {
+	case STORE_FAST:
+		value = f->f_localsplus[oparg];
+		break;
+	case STORE_DEREF:
+		value = PyCell_GET(f->f_localsplus[f->f_code->co_nlocals +
+						   oparg]);
+		break;
+	case STORE_NAME:
+	case STORE_GLOBAL:
+		name = PyTuple_GET_ITEM(f->f_code->co_names, oparg);
+		if (code[1] == STORE_NAME && f->f_locals != NULL &&
+		    PyDict_CheckExact(f->f_locals))
+			value = PyDict_GetItem(f->f_locals, name);
+		else if (code[1] == STORE_GLOBAL)
+			value = PyDict_GetItem(f->f_globals, name);
+		break;
+	}
+	return value == (PyObject *) self ? 2 : 1;
 }
 
 static RopeObject *
-rope_repeat(RopeObject *self, int count)
+rope_inplace_concat(RopeObject *self, RopeObject *other)
 {
-	RopeObject *result;
+	RopeObject *path[ROPE_MAX_BALANCE_DEPTH + 1];
+	RopeObject *tail, *child, *copy;
+	RopeTailBuffer *buf = NULL;
+	Py_ssize_t n, self_refs;
+	int depth = 0, unique = 0, owned = 0, i;
+
+	if (!Rope_Check(other) || other->length == 0 || self->length == 0 ||
+	    other->length > rope_policy.leaf_length ||
+	    self->length > PY_SSIZE_T_MAX - other->length)
+		return (RopeObject *) rope_sq_concat(self,
+						       (PyObject *) other);
+	n = other->length;
+	rope_policy_note(1, 0);
+	self_refs = rope_caller_refs(self);
+
+	/* Walk down the right spine.  The first `unique` nodes are owned
+	 * only by their parent (the root by the caller) and may be
+	 * changed in place. */
+	for (tail = self; tail->type == CONCAT_NODE; ) {
+		if (depth > rope_policy.balance_depth)
+			return rope_concat(self, other);
+		if (unique == depth &&
+		    Py_REFCNT(tail) == (tail == self ? self_refs : 1))
+			unique++;
+		path[depth++] = tail;
+		tail = tail->v.concat.right;
+	}
+	if (tail->type != LITERAL_NODE)
+		return rope_concat(self, other);
+	if (tail->base && tail->base->ob_type == &RopeTailBuffer_Type)
+		buf = (RopeTailBuffer *) tail->base;
+	if (unique == depth && Py_REFCNT(tail) == (tail == self ? self_refs : 1))
+		owned = 1;
+
+	/* A full buffer that nothing else can see grows where it is,
+	 * rather than being copied into a new leaf. */
+	if (buf && owned && Py_REFCNT(buf) == 1 &&
+	    tail->v.literal + tail->length == buf->data + buf->used &&
+	    buf->capacity - buf->used < n &&
+	    buf->used + n <= TAIL_LITERAL_CAPACITY) {
+		Py_ssize_t offset = tail->v.literal - buf->data;
+		Py_ssize_t capacity = 2 * (buf->used + n);
+		char *data;
+
+		if (capacity > TAIL_LITERAL_CAPACITY)
+			capacity = TAIL_LITERAL_CAPACITY;
+		data = PyMem_Realloc(buf->data, capacity);
+		if (data == NULL)
+			return (RopeObject *) PyErr_NoMemory();
+		buf->data = data;
+		buf->capacity = capacity;
+		tail->v.literal = data + offset;
+		rope_run_epoch++;
+	}
+
+	if (buf && tail->v.literal + tail->length == buf->data + buf->used &&
+	    buf->capacity - buf->used >= n) {
+		char *p = buf->data + buf->used;
+		if (_rope_str(other, &p) < 0)
+			return NULL;
+		buf->used += n;
+		if (owned) {
+			for (i = 0; i < depth; i++)
+				if (path[i]->flat)
+					rope_flat_drop(path[i]);
+			tail->length += n;
+			tail->hash = -1;
+			tail->counted_byte = -1;
+			for (i = 0; i < depth; i++) {
+				path[i]->length += n;
+				path[i]->hash = -1;
+				path[i]->counted_byte = -1;
+			}
+			Py_INCREF(self);
+			return self;
+		}
+		child = rope_from_type(LITERAL_NODE, tail->length + n);
+		if (child == NULL)
+			return NULL;
+		child->v.literal = tail->v.literal;
+		Py_INCREF(buf);
+		child->base = (PyObject *) buf;
+	}
+	else if (tail->length + n <= (buf ? TAIL_LITERAL_CAPACITY :
+				      rope_policy.leaf_length)) {
+		child = rope_tail_literal(tail, other);
+		if (child == NULL)
+			return NULL;
+	}
+	else {
+		RopeObject *result;
+
+		child = rope_tail_literal(NULL, other);
+		if (child == NULL)
+			return NULL;
+		result = rope_concat(self, child);
+		Py_DECREF(child);
+		return result;
+	}
+
+	/* Copy the shared part of the spine, then hang the copy off the
+	 * deepest node that is ours to change. */
+	for (i = depth - 1; i >= unique; i--) {
+		copy = rope_concat_unchecked(path[i]->v.concat.left, child);
+		Py_DECREF(child);
+		if (copy == NULL)
+			return NULL;
+		child = copy;
+	}
+	if (unique == 0)
+		return child;
+	Py_DECREF(path[unique - 1]->v.concat.right);
+	path[unique - 1]->v.concat.right = child;
+	for (i = unique - 1; i >= 0; i--) {
+		RopeObject *left = path[i]->v.concat.left;
+		RopeObject *right = path[i]->v.concat.right;
+		if (path[i]->flat)
+			rope_flat_drop(path[i]);
+		path[i]->length += n;
+		path[i]->hash = -1;
+		path[i]->counted_byte = -1;
+		path[i]->depth = (left->depth > right->depth ?
+				  left->depth : right->depth) + 1;
+	}
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *
+rope_upper(RopeObject *self)
+{
+	unsigned char table[256];
+	int c;
+
+	for (c = 0; c < 256; c++)
+		table[c] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+	return (PyObject *) rope_transform(self, table);
+}
 
-	if (count <= 1) {
+static PyObject *
+rope_lower(RopeObject *self)
+{
+	unsigned char table[256];
+	int c;
+
+	for (c = 0; c < 256; c++)
+		table[c] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+	return (PyObject *) rope_transform(self, table);
+}
+
+static PyObject *
+rope_translate_method(RopeObject *self, PyObject *table)
+{
+	if (table == Py_None) {
 		Py_INCREF(self);
-		return self;
+		return (PyObject *) self;
 	}
-	result = rope_from_type(REPEAT_NODE, self->length * count);
-	if(result == NULL)
+	if (!PyString_Check(table)) {
+		PyErr_Format(PyExc_TypeError,
+			     "expected string argument, not %.50s",
+			     table->ob_type->tp_name);
 		return NULL;
-	if(result->length <= self->length) {
-		result->v.repeat.child = NULL;
-		Py_DECREF(result);
-		PyErr_SetString(PyExc_OverflowError, "The string is too large!");
+	}
+	if (PyString_GET_SIZE(table) != 256) {
+		PyErr_SetString(PyExc_ValueError,
+				"translation table must be 256 characters long");
 		return NULL;
 	}
-	result->v.repeat.count = count;
-	Py_INCREF(self);
-	result->v.repeat.child = self;
-
-	return result;
+	return (PyObject *) rope_transform(self,
+			(const unsigned char *) PyString_AS_STRING(table));
 }
 
 typedef int (*charproc) (char c, void *arg);
@@ -437,13 +888,17 @@ typedef int (*charproc) (char c, void *arg);
 static int
 rope_char_iter(RopeObject *self, charproc f, void *arg)
 {
-	int status = -1;
+	const char *literal;
+	int status = 0;
 	Py_ssize_t i;
 
-	switch (self->type) {
+	switch (rope_read_type(self)) {
 	case LITERAL_NODE:
+		literal = rope_leaf_bytes(self);
+		if (literal == NULL)
+			return -1;
 		for (i = 0; i < self->length; i++) {
-			status = (*f) (self->v.literal[i], arg);
+			status = (*f) (literal[i], arg);
 			if (status == -1)
 				return -1;
 		}
@@ -451,13 +906,27 @@ rope_char_iter(RopeObject *self, charproc f, void *arg)
 	case CONCAT_NODE:
 		if (self->v.concat.left)
 			status = rope_char_iter(self->v.concat.left, f, arg);
-		if (self->v.concat.right)
+		if (status != -1 && self->v.concat.right)
 			status = rope_char_iter(self->v.concat.right, f, arg);
 		break;
 	case REPEAT_NODE:
-		for (i = 0; i < self->v.repeat.count; i++)
+		for (i = 0; i < self->v.repeat.count && status != -1; i++)
 			status = rope_char_iter(self->v.repeat.child, f, arg);
 		break;
+	case SUBSTRING_NODE:
+	case TRANSFORM_NODE:
+		for (i = 0; i < self->length; ) {
+			Py_ssize_t before, after;
+			const char *run = rope_chunk(self, i, &before, &after);
+			if (run == NULL)
+				return -1;
+			for (i += after; after > 0; after--) {
+				status = (*f) (*run++, arg);
+				if (status == -1)
+					return -1;
+			}
+		}
+		break;
 	}
 
 	return status;
@@ -478,9 +947,10 @@ rope_hash(RopeObject *self)
 
 	if (self->hash != -1)
 		return self->hash;
-	hash = rope_index(self, 0) << 7;
+	hash = self->length ? rope_index(self, 0) << 7 : 0;
 	p = &hash;
-	rope_char_iter(self, (charproc)_rope_hash, p);
+	if (hash < 0 || rope_char_iter(self, (charproc)_rope_hash, p) < 0)
+		return -1;
 	hash = *p;
 	hash ^= self->length;
 	if (hash == -1)
@@ -500,7 +970,14 @@ rope_traverse(RopeObject *self, visitproc visit, void *arg)
 	case REPEAT_NODE:
 		Py_VISIT(self->v.repeat.child);
 		break;
-	case LITERAL_NODE:
+	case SUBSTRING_NODE:
+		Py_VISIT(self->v.substring.child);
+		break;
+	case TRANSFORM_NODE:
+		Py_VISIT(self->v.transform.child);
+		break;
+	case LITERAL_NODE:
+		Py_VISIT(self->base);
 		break;
 	}
 	return 0;
@@ -512,57 +989,33 @@ rope_length(RopeObject *self)
 	return self->length;
 }
 
+/* Forward iteration walks the rope one leaf run at a time through
+ * rope_chunk, like reverse iteration, so a substring or transform is
+ * never flattened whole. */
 static void
 ropeiter_dealloc(RopeIter *r)
 {
-	PyMem_Free(r->list);
 	Py_DECREF(r->rope);
 	PyObject_Del(r);
 }
 
-static char *
-ropeiter_get_string(RopeObject *rope, Py_ssize_t *base_length)
-{
-	char *retval, *retval_p;
-	PyObject *to_str;
-	if (rope->type == REPEAT_NODE) {
-		*base_length = rope->v.concat.left->length;
-		to_str = (PyObject *) rope->v.concat.left;
-	}
-	else {
-		*base_length = rope->length;
-		to_str = (PyObject *) rope;
-	}
-	retval = PyMem_Malloc(*base_length);
-	retval_p = retval;
-	_rope_str((RopeObject *) to_str, &retval_p);
-	return retval;
-}
-
 static PyObject *
 ropeiter_next(RopeIter *self)
 {
-	PyObject *retval;
+	Py_ssize_t before, after;
+
 	if (self->pos >= self->rope->length)
 		return NULL;
-	if (self->cur_pos >= self->cur_length) {
-		self->cur_pos = 0;
-		self->list_pos++;
-		if (self->list_pos >= self->list_length)
+	if (self->run_left <= 0 || self->epoch != rope_run_epoch) {
+		self->run = rope_chunk(self->rope, self->pos, &before, &after);
+		if (self->run == NULL)
 			return NULL;
-		PyMem_Free(self->cur);
-		self->cur_length = self->list[self->list_pos]->length;
-		self->base_length = self->cur_length;
-		self->cur =
-			ropeiter_get_string(self->list[self->list_pos],
-					    &self->base_length);
-	}
-	retval = PyString_FromStringAndSize(&self->
-					    cur[self->cur_pos %
-						self->base_length], 1);
-	self->cur_pos++;
+		self->run_left = after;
+		self->epoch = rope_run_epoch;
+	}
 	self->pos++;
-	return retval;
+	self->run_left--;
+	return PyString_FromStringAndSize(self->run++, 1);
 }
 
 PyDoc_STRVAR(ropeiter_doc, "Rope Iterator");
@@ -609,148 +1062,114 @@ static PyTypeObject RopeIter_Type = {
 	0,			/* tp_new */
 };
 
-static int
-rope_get_iter_list_count(RopeObject *node)
+/* Reverse iteration walks the rope right to left one leaf run at a time
+ * through rope_chunk, so no leaf list or flat copy is ever built. */
+static void
+ropereviter_dealloc(RopeReverseIter *r)
 {
-	int retval = 0;
-	if (!node)
-		return 0;
-	if (node->type == CONCAT_NODE)
-		retval +=
-			rope_get_iter_list_count(node->v.concat.left) +
-			rope_get_iter_list_count(node->v.concat.right);
-	else
-		retval = 1;
-	return retval;
+	Py_DECREF(r->rope);
+	PyObject_Del(r);
 }
 
-static int
-_rope_get_iter_list(RopeObject **node_list, RopeObject *node)
+static PyObject *
+ropereviter_next(RopeReverseIter *self)
 {
-	if (!node)
-		return 0;
-	if (node->type == CONCAT_NODE) {
-		int where = _rope_get_iter_list(node_list,
-						   node->v.concat.left);
-		where += _rope_get_iter_list(node_list + where,
-						node->v.concat.right);
-		return where;
+	Py_ssize_t before, after;
+	const char *run;
+
+	if (self->pos <= 0)
+		return NULL;
+	if (self->chunks) {
+		run = rope_chunk(self->rope, self->pos - 1, &before, &after);
+		if (run == NULL)
+			return NULL;
+		self->pos -= before + 1;
+		return PyString_FromStringAndSize(run - before, before + 1);
 	}
-	else {
-		*node_list = node;
-		return 1;
+	if (self->run_left <= 0 || self->epoch != rope_run_epoch) {
+		self->run = rope_chunk(self->rope, self->pos - 1,
+				       &before, &after);
+		if (self->run == NULL)
+			return NULL;
+		self->run_left = before + 1;
+		self->epoch = rope_run_epoch;
 	}
-	return 0;
+	self->pos--;
+	self->run_left--;
+	return PyString_FromStringAndSize(self->run--, 1);
 }
 
-static int
-_rope_balance(RopeObject* cur, RopeBalanceState* state, int literal_merging)
+PyDoc_STRVAR(roperevtiter_doc, "Reverse Rope Iterator");
+
+static PyTypeObject RopeReverseIter_Type = {
+	PyObject_HEAD_INIT(0)
+	0,			/* ob_size */
+	"ropes.RopeReverseIter",	/* tp_name */
+	sizeof(RopeReverseIter),	/* tp_basicsize */
+	0,			/* tp_itemsize */
+	(destructor) ropereviter_dealloc,	/* tp_dealloc */
+	0,			/* tp_print */
+	0,			/* tp_getattr */
+	0,			/* tp_setattr */
+	0,			/* tp_compare */
+	0,			/* tp_repr */
+	0,			/* tp_as_number */
+	0,			/* tp_as_sequence */
+	0,			/* tp_as_mapping */
+	0,			/* tp_hash */
+	0,			/* tp_call */
+	0,			/* tp_str */
+	0,			/* tp_getattro */
+	0,			/* tp_setattro */
+	0,			/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,	/* tp_flags */
+	roperevtiter_doc,	/* tp_doc */
+	0,			/* tp_traverse */
+	0,			/* tp_clear */
+	0,			/* tp_richcompare */
+	0,			/* tp_weaklistoffset */
+	(getiterfunc) PyObject_SelfIter,	/* tp_iter */
+	(iternextfunc) ropereviter_next,	/* tp_iternext */
+	0,			/* tp_methods */
+	0,			/* tp_members */
+	0,			/* tp_getset */
+	0,			/* tp_base */
+	0,			/* tp_dict */
+	0,			/* tp_descr_get */
+	0,			/* tp_descr_set */
+	0,			/* tp_dictoffset */
+	0,			/* tp_init */
+	PyType_GenericAlloc,	/* tp_alloc */
+	0,			/* tp_new */
+};
+
+static PyObject *
+rope_reverse_iter(RopeObject *self, int chunks)
 {
-	if(!cur)
-		return 0;
-	if(cur->type == CONCAT_NODE) {
-		if(_rope_balance(cur->v.concat.left, state, 1) != 0) return -1;
-		return _rope_balance(cur->v.concat.right, state, 1);
-	}
-	if(literal_merging == 1) {
-		if(cur->type == LITERAL_NODE && cur->length < MIN_LITERAL_LENGTH && state->string_length < MIN_LITERAL_LENGTH) {
-			if(!state->string) {
-				state->string = PyMem_Malloc(MIN_LITERAL_LENGTH);
-				memcpy(state->string, cur->v.literal, cur->length);
-				state->string_length = cur->length;
-			}
-			else {
-				memcpy(state->string + state->string_length, cur->v.literal, cur->length);
-				state->string_length += cur->length;
-			}
-			return 0;
-		}
-		else if(state->string) {
-			RopeObject* new;
-			new= rope_from_type(LITERAL_NODE, state->string_length);
-			if(new == NULL)
-				return -1;
-			new->v.literal = PyMem_Realloc(state->string, state->string_length);
-			state->string = NULL;
-			state->string_length = 0;
-			if(_rope_balance(new, state, 0) != 0) return -1;
-		}
-	}
-	if(cur->length < state->a) {
-		state->a=1;
-		state->b=2;
-		state->empty=0;
-		while(! (cur->length < state->b)) {
-			state->empty++;
-			state->old_a = state->a;
-			state->a = state->b;
-			state->b = state->old_a + state->b;
-		}
-	}
-	else {
-		while(! (cur->length < state->b &&
-			 ! state->work_list[state->empty])) {
-			if(state->work_list[state->empty]) {
-				if(!(state->empty < ROPE_DEPTH))
-					return -1;
-				cur = rope_concat_unchecked(state->work_list[state->empty], cur);
-				state->work_list[state->empty] = NULL;
-			}
-			else {
-				state->empty++;
-				state->old_a = state->a;
-				state->a = state->b;
-				state->b = state->old_a + state->b;
-			} 
-		}
-	}
-	if(!(state->empty < ROPE_DEPTH))
-		return -1;
-	state->work_list[state->empty] = cur;
-	state->first_node = cur;
-	return 0;
+	RopeReverseIter *retval;
+
+	retval = PyObject_New(RopeReverseIter, &RopeReverseIter_Type);
+	if (!retval)
+		return NULL;
+	Py_INCREF(self);
+	retval->rope = self;
+	retval->pos = self->length;
+	retval->chunks = chunks;
+	retval->run = NULL;
+	retval->run_left = 0;
+	return (PyObject *) retval;
 }
 
-static RopeObject*
-rope_balance(RopeObject* r)
+static PyObject *
+rope_reversed(RopeObject *self)
 {
-	int i=0;
-	RopeObject *cur;
-	Py_ssize_t begin_length=r->length;
-	RopeBalanceState state;
-	if(!r || r->type != CONCAT_NODE)
-		return NULL;
-	state.a = state.b = PY_SSIZE_T_MAX;
-	state.empty = ROPE_DEPTH;
-	state.string = NULL;
-	state.string_length = 0;
-	state.first_node = NULL;
-	memset(state.work_list, 0, sizeof(RopeObject*) * ROPE_DEPTH);
-	if(_rope_balance(r, &state, 1) != 0) goto ret_err;
-	if(state.string) {
-		cur = rope_from_type(LITERAL_NODE, state.string_length);
-		if(cur == NULL) goto ret_err;
-		cur->v.literal = state.string;
-
-		if(_rope_balance(cur, &state, 0)!=0) goto ret_err;
-	}
-	cur = state.first_node;
-	for(i = state.empty+1; i < ROPE_DEPTH;i++) {
-		if(!(i < ROPE_DEPTH)) goto ret_err;
-		if(state.work_list[i]) {
-			cur = rope_concat_unchecked(state.work_list[i], cur);
-		}
-	}
-	assert(begin_length==cur->length);
-	return cur;
-  ret_err:
-	Py_XDECREF(state.first_node);
-	for(i = state.empty + 1;i <ROPE_DEPTH;i++) {
-		if(state.work_list[i])
-			Py_XDECREF(state.work_list[i]);
-	}
-	PyErr_SetString(PyExc_OverflowError, "The rope has grown too long!");
-	return NULL;
+	return rope_reverse_iter(self, 0);
+}
+
+static PyObject *
+rope_rchunks(RopeObject *self)
+{
+	return rope_reverse_iter(self, 1);
 }
 
 static int
@@ -862,233 +1281,3416 @@ rope_compare(RopeObject *self, RopeObject *other)
 	return retval;
 }
 
+/* Equality tests that can be answered without looking at the bytes:
+ * the same object, different lengths, or two distinct interned leaves
+ * (which never have the same contents).  Everything else falls back to
+ * rope_compare. */
+static PyObject *
+rope_richcompare(PyObject *self, PyObject *other, int op)
+{
+	RopeObject *a = (RopeObject *) self, *b = (RopeObject *) other;
+	int equal;
+
+	if ((op != Py_EQ && op != Py_NE) || !Rope_Check(self) ||
+	    !Rope_Check(other)) {
+		Py_INCREF(Py_NotImplemented);
+		return Py_NotImplemented;
+	}
+	if (a == b)
+		equal = 1;
+	else if (a->length != b->length || (a->interned && b->interned))
+		equal = 0;
+	else {
+		Py_INCREF(Py_NotImplemented);
+		return Py_NotImplemented;
+	}
+	if (equal == (op == Py_EQ))
+		Py_RETURN_TRUE;
+	Py_RETURN_FALSE;
+}
+
 static RopeIter *
 rope_iter(RopeObject *self)
 {
-	RopeIter *retval = (RopeIter *)PyType_GenericNew(&RopeIter_Type, NULL,
-							 NULL);
+	RopeIter *retval;
+
+	retval = PyObject_New(RopeIter, &RopeIter_Type);
 	if (!retval)
 		return NULL;
 	Py_INCREF(self);
-	retval->pos = 0;
 	retval->rope = self;
-	retval->list_length = rope_get_iter_list_count(self);
-	retval->list =
-		PyMem_Malloc(sizeof(struct RopeObject *) *
-			     retval->list_length);
-	_rope_get_iter_list(retval->list, self);
-	retval->list_pos = 0;
-	retval->cur_length = retval->list[0]->length;
-	retval->base_length = retval->cur_length;
-	retval->cur_pos = 0;
-	retval->cur =
-		(retval->
-		 list_length ? ropeiter_get_string(retval->list[0],
-						   &retval->
-						   base_length) : NULL);
-	if (PyErr_Occurred())
-		return NULL;
+	retval->pos = 0;
+	retval->run = NULL;
+	retval->run_left = 0;
 	return retval;
 }
 
-static RopeObject *
-rope_slice_right(RopeObject *self, Py_ssize_t start)
+/* Structural comparison
+ *
+ * A RopeWalk is a stack of pieces (a window onto some node) covering a
+ * range of a rope in order, the next piece on top.  Comparing two walks
+ * only expands nodes until the two tops are the same node at the same
+ * place, and then skips the shared part without looking at it, so ropes
+ * derived from one another compare in time proportional to the parts
+ * that differ.
+ */
+
+typedef struct RopePiece {
+	RopeObject *node;	/* borrowed */
+	Py_ssize_t start, stop;	/* window onto node */
+} RopePiece;
+
+typedef struct RopeWalk {
+	RopePiece *pieces;
+	Py_ssize_t count;
+	Py_ssize_t allocated;
+	int reverse;		/* walk from the end towards the start */
+} RopeWalk;
+
+static int
+walk_push(RopeWalk *w, RopeObject *node, Py_ssize_t start, Py_ssize_t stop)
 {
-	while (1) {
-		if (start == 0) {
-			Py_INCREF(self);
-			return self;
-		}
-		if (self->type == CONCAT_NODE) {
-			Py_ssize_t llen = self->v.concat.left->length;
-			if (start >= llen) {
-				self = self->v.concat.right;
-				start = start - llen;
-				continue;
-			}
-			else {
-				RopeObject *left, *retval;
-				left = rope_slice_right(self->v.concat.left,
-							start);
-				retval = rope_concat(left,
-						     self->v.concat.right);
-				Py_DECREF(left);
-				return retval;
-			}
+	if (start >= stop)
+		return 0;
+	if (w->count == w->allocated) {
+		Py_ssize_t size = w->allocated ? 2 * w->allocated : 32;
+		RopePiece *p = PyMem_Realloc(w->pieces,
+					     size * sizeof(RopePiece));
+		if (p == NULL) {
+			PyErr_NoMemory();
+			return -1;
 		}
-		return rope_slice(self, start, self->length);
+		w->pieces = p;
+		w->allocated = size;
 	}
+	w->pieces[w->count].node = node;
+	w->pieces[w->count].start = start;
+	w->pieces[w->count].stop = stop;
+	w->count++;
+	return 0;
 }
 
-static RopeObject *
-rope_slice_left(RopeObject *self, Py_ssize_t stop)
+static int
+walk_init(RopeWalk *w, RopeObject *node, Py_ssize_t start, Py_ssize_t stop,
+	  int reverse)
 {
-	while (1) {
-		if (stop == self->length) {
-			Py_INCREF(self);
-			return self;
+	w->pieces = NULL;
+	w->count = w->allocated = 0;
+	w->reverse = reverse;
+	return walk_push(w, node, start, stop);
+}
+
+/* Push two pieces so that the one that comes first in walk order ends up
+ * on top. */
+static int
+walk_push_pair(RopeWalk *w, RopeObject *a, Py_ssize_t a_start,
+	       Py_ssize_t a_stop, RopeObject *b, Py_ssize_t b_start,
+	       Py_ssize_t b_stop)
+{
+	if (w->reverse)
+		return (walk_push(w, a, a_start, a_stop) < 0 ||
+			walk_push(w, b, b_start, b_stop) < 0) ? -1 : 0;
+	return (walk_push(w, b, b_start, b_stop) < 0 ||
+		walk_push(w, a, a_start, a_stop) < 0) ? -1 : 0;
+}
+
+/* Replace the top piece by its children.  Returns 0 if it is a leaf and
+ * cannot be split, 1 if it was split and -1 on error. */
+static int
+walk_expand(RopeWalk *w)
+{
+	RopePiece top = w->pieces[w->count - 1];
+	RopeObject *node = top.node, *child;
+	Py_ssize_t llen, clen, first, last;
+
+	switch (node->type) {
+	case CONCAT_NODE:
+		llen = node->v.concat.left->length;
+		w->count--;
+		return walk_push_pair(w, node->v.concat.left, top.start,
+				      top.stop < llen ? top.stop : llen,
+				      node->v.concat.right,
+				      top.start > llen ? top.start - llen : 0,
+				      top.stop - llen) < 0 ? -1 : 1;
+	case SUBSTRING_NODE:
+		w->pieces[w->count - 1].node = node->v.substring.child;
+		w->pieces[w->count - 1].start += node->v.substring.offset;
+		w->pieces[w->count - 1].stop += node->v.substring.offset;
+		return 1;
+	case REPEAT_NODE:
+		/* split off one copy of the child at the near end */
+		child = node->v.repeat.child;
+		clen = child->length;
+		w->count--;
+		if (w->reverse) {
+			last = (top.stop - 1) % clen + 1;
+			first = last - (top.stop - top.start);
+			if (first < 0)
+				first = 0;
+			if (walk_push(w, node, top.start,
+				      top.stop - (last - first)) < 0 ||
+			    walk_push(w, child, first, last) < 0)
+				return -1;
 		}
-		if (self->type == CONCAT_NODE) {
-			Py_ssize_t llen = self->v.concat.left->length;
-			if (stop <= llen) {
-				self = self->v.concat.left;
-				continue;
-			}
-			else {
-				RopeObject *right, *retval;
-				right = rope_slice_left(self->v.concat.right,
-							stop - llen);
-				retval = rope_concat(self->v.concat.left,
-						     right);
-				Py_DECREF(right);
-				return retval;
-			}
+		else {
+			first = top.start % clen;
+			last = first + (top.stop - top.start);
+			if (last > clen)
+				last = clen;
+			if (walk_push(w, node, top.start + (last - first),
+				      top.stop) < 0 ||
+			    walk_push(w, child, first, last) < 0)
+				return -1;
 		}
-		return rope_slice(self, 0, stop);
+		return 1;
+	default:
+		return 0;
 	}
 }
 
-static RopeObject *
-rope_slice(RopeObject *self, Py_ssize_t start, Py_ssize_t stop)
+/* Consume n bytes from the top piece. */
+static void
+walk_advance(RopeWalk *w, Py_ssize_t n)
 {
-	RopeObject *retval;
-	Py_ssize_t adj_start, adj_stop;
-	Py_ssize_t new_start, child_length;
-	RopeObject *left, *right, *old_retval;
-	if (stop > self->length)
-		stop = self->length;
-	if (start >= self->length) {
-		PyErr_SetString(PyExc_ValueError, "No sane value to slice!");
-		return NULL;
+	RopePiece *top = &w->pieces[w->count - 1];
+
+	if (w->reverse)
+		top->stop -= n;
+	else
+		top->start += n;
+	if (top->start >= top->stop)
+		w->count--;
+}
+
+/* Return the contiguous bytes at the near end of the top piece, which
+ * must be a leaf: *p points at the first byte in walk order and *n is set
+ * to the number available. */
+static int
+walk_run(RopeWalk *w, const char **p, Py_ssize_t *n)
+{
+	RopePiece *top = &w->pieces[w->count - 1];
+	Py_ssize_t before, after;
+
+	if (w->reverse) {
+		*p = rope_chunk(top->node, top->stop - 1, &before, &after);
+		*n = before + 1;
 	}
-	if(stop < start) {
-		stop = start;
+	else {
+		*p = rope_chunk(top->node, top->start, &before, &after);
+		*n = after;
 	}
-	switch (self->type) {
-	case LITERAL_NODE:
-		retval = rope_from_string(self->v.literal + start,
-					  stop - start);
-		break;
-	case REPEAT_NODE:
-		/* The basic procedure here is to first find how much the new
-		 * repeat node needs to be repeated. Then we need to create two
-		 * new concatenation nodes, then two new literal nodes, one for
-		 * the leftest node and one for the rightest node. Then concatenate
-		 * them together
-		 */
-		retval = rope_from_type(REPEAT_NODE, 0);
-		if(retval == NULL)
-			return NULL;
-		retval->v.repeat.child = self->v.repeat.child;
-		Py_INCREF(retval->v.repeat.child);
-		child_length = self->v.repeat.child->length;
-		new_start = start % child_length;
-		adj_start = (new_start ? start + (child_length - new_start) : start);
-		adj_stop = stop - (stop % child_length);
-		retval->v.repeat.count = ((adj_stop - adj_start) / child_length);
-		retval->length = retval->v.repeat.count * child_length;
-		old_retval = retval;
-		if (retval->v.repeat.count <= 0) {
-			left = right = NULL;
-			left = rope_slice(retval->v.repeat.child, new_start, new_start + (stop - start));
-			retval = left;
-			if (retval && retval->length == (stop - start))
-				break;
+	if (*n > top->stop - top->start)
+		*n = top->stop - top->start;
+	return *p ? 0 : -1;
+}
+
+/* Length of the common prefix (or suffix, for reverse walks) of what is
+ * left in two walks, which are consumed up to the first difference.
+ * Returns -1 on error. */
+static Py_ssize_t
+walk_common(RopeWalk *a, RopeWalk *b)
+{
+	Py_ssize_t total = 0, n, na, nb, k;
+	RopePiece *x, *y;
+	const char *pa, *pb;
+	int status;
+
+	while (a->count && b->count) {
+		x = &a->pieces[a->count - 1];
+		y = &b->pieces[b->count - 1];
+		if (x->node == y->node &&
+		    (a->reverse ? x->stop == y->stop : x->start == y->start)) {
+			/* the same bytes of the same node */
+			n = x->stop - x->start;
+			if (y->stop - y->start < n)
+				n = y->stop - y->start;
+			walk_advance(a, n);
+			walk_advance(b, n);
+			total += n;
+			continue;
 		}
-		if ((start % child_length) != 0 && old_retval->v.repeat.count > 0) {
-			left = rope_slice(old_retval->v.repeat.child, (start % child_length), child_length);
-			retval = rope_concat(left, old_retval);
-			Py_DECREF(left);	/* Because their refcounts were increased in rope_concat */
-			Py_DECREF(old_retval);
+		if (x->node->type == REPEAT_NODE &&
+		    y->node->type == REPEAT_NODE &&
+		    x->node->v.repeat.child == y->node->v.repeat.child &&
+		    (a->reverse ? x->stop : x->start) %
+		    x->node->v.repeat.child->length ==
+		    (b->reverse ? y->stop : y->start) %
+		    y->node->v.repeat.child->length) {
+			/* copies of one child at the same phase: equal for
+			 * as far as both go, however many copies that is */
+			n = x->stop - x->start;
+			if (y->stop - y->start < n)
+				n = y->stop - y->start;
+			walk_advance(a, n);
+			walk_advance(b, n);
+			total += n;
+			continue;
 		}
-		if ((stop % child_length) != 0) {
-			right = rope_slice(old_retval->v.repeat.child, 0, (stop % child_length));
-			old_retval = retval;
-			retval = rope_concat(retval, right);
-			Py_XDECREF(right);
-			Py_XDECREF(old_retval);
+		if (x->stop - x->start >= y->stop - y->start) {
+			status = walk_expand(a);
+			if (status == 0)
+				status = walk_expand(b);
 		}
-		break;
-	case CONCAT_NODE:
-		if (start == 0) {
-			if (stop == self->length) {
-				Py_INCREF(self);
-				retval = self;
-			}
-			return rope_slice_left(self, stop);
+		else {
+			status = walk_expand(b);
+			if (status == 0)
+				status = walk_expand(a);
+		}
+		if (status < 0)
+			return -1;
+		if (status > 0)
+			continue;
+
+		/* two leaves: compare bytes */
+		if (walk_run(a, &pa, &na) < 0 || walk_run(b, &pb, &nb) < 0)
+			return -1;
+		n = na < nb ? na : nb;
+		if (a->reverse) {
+			for (k = 0; k < n && pa[-k] == pb[-k]; k++)
+				;
+		}
+		else if (memcmp(pa, pb, n) == 0)
+			k = n;
+		else
+			for (k = 0; pa[k] == pb[k]; k++)
+				;
+		total += k;
+		if (k < n)
+			break;
+		walk_advance(a, n);
+		walk_advance(b, n);
+	}
+	return total;
+}
+
+static Py_ssize_t
+rope_common_length(RopeObject *a, Py_ssize_t a_start, Py_ssize_t a_stop,
+		   RopeObject *b, Py_ssize_t b_start, Py_ssize_t b_stop,
+		   int reverse)
+{
+	RopeWalk wa, wb;
+	Py_ssize_t retval = -1;
+
+	wa.pieces = wb.pieces = NULL;
+	if (walk_init(&wa, a, a_start, a_stop, reverse) == 0 &&
+	    walk_init(&wb, b, b_start, b_stop, reverse) == 0)
+		retval = walk_common(&wa, &wb);
+	PyMem_Free(wa.pieces);
+	PyMem_Free(wb.pieces);
+	return retval;
+}
+
+/* Pieces shorter than 1/2**ANCHOR_SHIFT of the range searched are looked
+ * up whole but not split, which bounds the search by the depth of the
+ * ropes rather than by their size.  Diffing the ranges between anchors
+ * searches again at a finer grain. */
+#define ANCHOR_SHIFT 10
+
+/* Two windows onto repeats of the same child, one in a recorded as
+ * (pos, start, stop) and one in b at b_pos, hold the same bytes wherever
+ * they are at the same phase.  Returns the length of the longer of the
+ * two such stretches that start where one of the windows does, and sets
+ * where it is in a and b. */
+static Py_ssize_t
+anchor_repeat_overlap(PyObject *record, Py_ssize_t clen, RopePiece *top,
+		      Py_ssize_t b_pos, Py_ssize_t *a_at, Py_ssize_t *b_at)
+{
+	Py_ssize_t a_pos, a_start, a_stop, shift, n, best;
+
+	a_pos = PyInt_AsSsize_t(PyTuple_GET_ITEM(record, 0));
+	a_start = PyInt_AsSsize_t(PyTuple_GET_ITEM(record, 1));
+	a_stop = PyInt_AsSsize_t(PyTuple_GET_ITEM(record, 2));
+
+	/* from the start of b's window */
+	shift = ((top->start - a_start) % clen + clen) % clen;
+	best = a_stop - a_start - shift;
+	if (best > top->stop - top->start)
+		best = top->stop - top->start;
+	*a_at = a_pos + shift;
+	*b_at = b_pos;
+
+	/* from the start of a's window */
+	shift = ((a_start - top->start) % clen + clen) % clen;
+	n = top->stop - top->start - shift;
+	if (n > a_stop - a_start)
+		n = a_stop - a_start;
+	if (n > best) {
+		best = n;
+		*a_at = a_pos;
+		*b_at = b_pos + shift;
+	}
+	return best > 0 ? best : 0;
+}
+
+/* Find a stretch that appears in both a[a_start:a_stop] and
+ * b[b_start:b_stop]: a node that appears whole in both, or repeats of
+ * one child at the same phase.  Returns 1 and sets the positions and
+ * length of the leftmost such stretch in b, 0 if there is none and -1
+ * on error.  Only nodes the search reaches (see ANCHOR_SHIFT) are
+ * candidates. */
+static int
+rope_find_anchor(RopeObject *a, Py_ssize_t a_start, Py_ssize_t a_stop,
+		 RopeObject *b, Py_ssize_t b_start, Py_ssize_t b_stop,
+		 Py_ssize_t *a_pos, Py_ssize_t *b_pos, Py_ssize_t *length)
+{
+	PyObject *seen, *repeats, *walked = NULL, *key, *value;
+	RopeWalk w;
+	RopePiece *top;
+	RopeObject *child;
+	Py_ssize_t pos, grain, skip;
+	int status, found = 0, pass;
+
+	seen = PyDict_New();
+	if (seen == NULL)
+		return -1;
+	/* the first window in a onto a repeat of each child */
+	repeats = PyDict_New();
+	if (repeats == NULL) {
+		Py_DECREF(seen);
+		return -1;
+	}
+	for (pass = 0; pass < 2 && !found; pass++) {
+		/* children of repeats that have been searched in this pass */
+		Py_XDECREF(walked);
+		walked = PyDict_New();
+		if (walked == NULL) {
+			Py_DECREF(seen);
+			Py_DECREF(repeats);
+			return -1;
 		}
-		else if (stop == self->length) {
-			return rope_slice_right(self, start);
+		if (pass == 0) {
+			status = walk_init(&w, a, a_start, a_stop, 0);
+			pos = a_start;
+			grain = (a_stop - a_start) >> ANCHOR_SHIFT;
 		}
 		else {
-			RopeObject *left, *right;
-			if (stop < self->v.concat.left->length) {
-				return rope_slice(self->v.concat.left, start,
-						  stop);
-			}
-			else if (start > self->v.concat.left->length) {
-				return rope_slice(self->v.concat.right,
-						  start -
-						  self->v.concat.left->length,
-						  stop -
-						  self->v.concat.left->length);
+			status = walk_init(&w, b, b_start, b_stop, 0);
+			pos = b_start;
+			grain = (b_stop - b_start) >> ANCHOR_SHIFT;
+		}
+		while (status == 0 && w.count) {
+			top = &w.pieces[w.count - 1];
+			if (top->node->type == REPEAT_NODE) {
+				child = top->node->v.repeat.child;
+				key = PyLong_FromVoidPtr(child);
+				if (key == NULL) {
+					status = -1;
+					break;
+				}
+				value = PyDict_GetItem(repeats, key);
+				if (pass == 1 && value) {
+					*length = anchor_repeat_overlap(
+						value, child->length, top, pos,
+						a_pos, b_pos);
+					found = *length > 0;
+				}
+				else if (pass == 0 && !value) {
+					value = Py_BuildValue("(nnn)", pos,
+							      top->start,
+							      top->stop);
+					if (value == NULL ||
+					    PyDict_SetItem(repeats, key,
+							   value) < 0)
+						status = -1;
+					Py_XDECREF(value);
+				}
+				Py_DECREF(key);
+				if (found || status < 0)
+					break;
 			}
-			left = rope_slice_right(self->v.concat.left, start);
-			right = rope_slice_left(self->v.concat.right,
-						stop -
-						self->v.concat.left->length);
-			if (left && right) {
-				retval = rope_concat(left, right);
-				Py_DECREF(left);
-				Py_DECREF(right);
+			if (top->node->type == REPEAT_NODE &&
+			    top->start % top->node->v.repeat.child->length == 0) {
+				/* once one copy of the child has been searched,
+				 * the others hold nothing new */
+				child = top->node->v.repeat.child;
+				key = PyLong_FromVoidPtr(child);
+				if (key == NULL) {
+					status = -1;
+					break;
+				}
+				if (PyDict_GetItem(walked, key)) {
+					skip = (top->stop - top->start) /
+						child->length * child->length;
+					pos += skip;
+					top->start += skip;
+				}
+				else if (PyDict_SetItem(walked, key, Py_None) < 0)
+					status = -1;
+				Py_DECREF(key);
+				if (status < 0)
+					break;
+				if (top->start >= top->stop) {
+					w.count--;
+					continue;
+				}
 			}
-			else if (right) {
-				retval = right;
+			if (top->start == 0 && top->stop == top->node->length) {
+				key = PyLong_FromVoidPtr(top->node);
+				if (key == NULL) {
+					status = -1;
+					break;
+				}
+				value = PyDict_GetItem(seen, key);
+				if (pass == 1 && value) {
+					*a_pos = PyInt_AsSsize_t(value);
+					*b_pos = pos;
+					*length = top->node->length;
+					found = 1;
+				}
+				else if (pass == 0 && !value) {
+					value = PyInt_FromSsize_t(pos);
+					if (value == NULL ||
+					    PyDict_SetItem(seen, key, value) < 0)
+						status = -1;
+					Py_XDECREF(value);
+				}
+				Py_DECREF(key);
+				if (found || status < 0)
+					break;
 			}
-			else {
-				retval = left;
+			if (top->stop - top->start >= grain)
+				status = walk_expand(&w);
+			else
+				status = 0;
+			if (status == 0) {
+				pos += top->stop - top->start;
+				w.count--;
 			}
+			else if (status > 0)
+				status = 0;
+		}
+		PyMem_Free(w.pieces);
+		if (status < 0) {
+			Py_DECREF(seen);
+			Py_DECREF(repeats);
+			Py_DECREF(walked);
+			return -1;
 		}
-		break;
 	}
-	return retval;
+	Py_DECREF(seen);
+	Py_DECREF(repeats);
+	Py_DECREF(walked);
+	return found;
 }
 
-static PySequenceMethods rope_as_sequence = {
-	(lenfunc) rope_length,		/* sq_length */
-	(binaryfunc) rope_concat,	/* sq_concat */
-	(ssizeargfunc) rope_repeat,	/* sq_repeat */
-	(ssizeargfunc) rope_getitem,	/* sq_item */
-	0,				/* sq_slice */
-	0,				/* sq_ass_item */
-	0,				/* sq_ass_slice */
-	(objobjproc) rope_contains,	/* sq_contains */
-	0,				/* sq_inplace_concat */
-	0,				/* sq_inplace_repeat */
-};
-
-static PyMappingMethods rope_as_mapping = {
-	(lenfunc) rope_length,		/* mp_length */
-	(binaryfunc) rope_subscript,	/* mp_subscript */
-	0,				/* mp_ass_subscript */
-};
-
-/* XXX More documentation */
-PyDoc_STRVAR(rope_doc, "Rope type");
-
-#if DEBUG
-static PyObject *
-rope_balance_method(PyObject * self, PyObject * args, PyObject * kwds)
+static int
+rope_diff_ranges(RopeObject *a, Py_ssize_t a_start, Py_ssize_t a_stop,
+		 RopeObject *b, Py_ssize_t b_start, Py_ssize_t b_stop,
+		 PyObject *result)
 {
-	RopeObject* retval = rope_balance((RopeObject *) self);
-	return (PyObject *) retval;
-}
+	Py_ssize_t n, a_pos, b_pos, length;
+	PyObject *hunk;
+	int status;
 
-static PyMethodDef RopeMethods[] = {
-	{"balance", (PyCFunction) rope_balance_method, METH_VARARGS, "Balance the rope"},
-	{NULL, NULL, 0, NULL}
-};
-#endif
+	for (;;) {
+		n = rope_common_length(a, a_start, a_stop, b, b_start, b_stop, 0);
+		if (n < 0)
+			return -1;
+		a_start += n;
+		b_start += n;
+		n = rope_common_length(a, a_start, a_stop, b, b_start, b_stop, 1);
+		if (n < 0)
+			return -1;
+		a_stop -= n;
+		b_stop -= n;
+		if (a_start == a_stop && b_start == b_stop)
+			return 0;
+		status = 0;
+		if (a_start < a_stop && b_start < b_stop)
+			status = rope_find_anchor(a, a_start, a_stop,
+						  b, b_start, b_stop,
+						  &a_pos, &b_pos, &length);
+		if (status < 0)
+			return -1;
+		if (status == 0) {
+			hunk = Py_BuildValue("(nnnn)", a_start, a_stop,
+					     b_start, b_stop);
+			if (hunk == NULL || PyList_Append(result, hunk) < 0) {
+				Py_XDECREF(hunk);
+				return -1;
+			}
+			Py_DECREF(hunk);
+			return 0;
+		}
+		/* Diff what precedes the shared node, then carry on after it */
+		if (rope_diff_ranges(a, a_start, a_pos, b, b_start, b_pos,
+				     result) < 0)
+			return -1;
+		a_start = a_pos + length;
+		b_start = b_pos + length;
+	}
+}
+
+/* Return a new reference to obj as a rope; strings are wrapped. */
+static RopeObject *
+rope_from_object(PyObject *obj)
+{
+	if (Rope_Check(obj)) {
+		Py_INCREF(obj);
+		return (RopeObject *) obj;
+	}
+	if (PyString_Check(obj))
+		return rope_from_string(PyString_AS_STRING(obj),
+					PyString_GET_SIZE(obj));
+	PyErr_Format(PyExc_TypeError, "expected Rope or string, not %.50s",
+		     obj->ob_type->tp_name);
+	return NULL;
+}
+
+static PyObject *
+rope_common_affix(RopeObject *self, PyObject *arg, int reverse)
+{
+	RopeObject *other;
+	Py_ssize_t n;
+
+	other = rope_from_object(arg);
+	if (other == NULL)
+		return NULL;
+	n = rope_common_length(self, 0, self->length,
+			       other, 0, other->length, reverse);
+	Py_DECREF(other);
+	if (n < 0)
+		return NULL;
+	return PyInt_FromSsize_t(n);
+}
+
+static PyObject *
+rope_common_prefix_length(RopeObject *self, PyObject *arg)
+{
+	return rope_common_affix(self, arg, 0);
+}
+
+static PyObject *
+rope_common_suffix_length(RopeObject *self, PyObject *arg)
+{
+	return rope_common_affix(self, arg, 1);
+}
+
+static PyObject *
+rope_diff(RopeObject *self, PyObject *arg)
+{
+	RopeObject *other;
+	PyObject *result;
+
+	other = rope_from_object(arg);
+	if (other == NULL)
+		return NULL;
+	result = PyList_New(0);
+	if (result && rope_diff_ranges(self, 0, self->length,
+				       other, 0, other->length, result) < 0) {
+		Py_DECREF(result);
+		result = NULL;
+	}
+	Py_DECREF(other);
+	return result;
+}
+
+/* Prefixes, stripping and counting */
+
+/* Clip start and stop as str methods do with their optional range. */
+static void
+rope_adjust_indices(RopeObject *self, Py_ssize_t *start, Py_ssize_t *stop)
+{
+	if (*stop > self->length)
+		*stop = self->length;
+	else if (*stop < 0) {
+		*stop += self->length;
+		if (*stop < 0)
+			*stop = 0;
+	}
+	if (*start < 0) {
+		*start += self->length;
+		if (*start < 0)
+			*start = 0;
+	}
+}
+
+/* Does affix (a string or rope) start, or if suffix end, self[start:stop]?
+ * Returns 1, 0 or -1 with an exception set. */
+static int
+rope_affix_match(RopeObject *self, PyObject *affix, Py_ssize_t start,
+		 Py_ssize_t stop, int suffix)
+{
+	RopeObject *other;
+	Py_ssize_t n, pos, common;
+
+	if (PyString_Check(affix))
+		n = PyString_GET_SIZE(affix);
+	else if (Rope_Check(affix))
+		n = ((RopeObject *) affix)->length;
+	else {
+		PyErr_Format(PyExc_TypeError,
+			     "expected Rope, string or tuple, not %.50s",
+			     affix->ob_type->tp_name);
+		return -1;
+	}
+	if (stop - start < n)
+		return 0;
+	pos = (suffix ? stop - n : start);
+	if (PyString_Check(affix))
+		return rope_match(self, pos, PyString_AS_STRING(affix), n);
+	/* ropes are compared structurally, skipping shared subtrees */
+	other = (RopeObject *) affix;
+	common = rope_common_length(self, pos, pos + n, other, 0, n, suffix);
+	if (common < 0)
+		return -1;
+	return common == n;
+}
+
+static PyObject *
+rope_affix_method(RopeObject *self, PyObject *args, int suffix)
+{
+	PyObject *affix;
+	Py_ssize_t start = 0, stop = PY_SSIZE_T_MAX, i;
+	int result;
+
+	if (!PyArg_ParseTuple(args, suffix ? "O|O&O&:endswith" :
+			      "O|O&O&:startswith", &affix,
+			      _PyEval_SliceIndex, &start,
+			      _PyEval_SliceIndex, &stop))
+		return NULL;
+	rope_adjust_indices(self, &start, &stop);
+	if (start > self->length)
+		Py_RETURN_FALSE;
+	if (!PyTuple_Check(affix)) {
+		result = rope_affix_match(self, affix, start, stop, suffix);
+		if (result < 0)
+			return NULL;
+		return PyBool_FromLong(result);
+	}
+	for (i = 0; i < PyTuple_GET_SIZE(affix); i++) {
+		result = rope_affix_match(self, PyTuple_GET_ITEM(affix, i),
+					  start, stop, suffix);
+		if (result < 0)
+			return NULL;
+		if (result)
+			Py_RETURN_TRUE;
+	}
+	Py_RETURN_FALSE;
+}
+
+static PyObject *
+rope_startswith(RopeObject *self, PyObject *args)
+{
+	return rope_affix_method(self, args, 0);
+}
+
+static PyObject *
+rope_endswith(RopeObject *self, PyObject *args)
+{
+	return rope_affix_method(self, args, 1);
+}
+
+#define STRIP_LEFT 1
+#define STRIP_RIGHT 2
+
+/* Strip by slicing: the result views self rather than copying it. */
+static PyObject *
+rope_strip_method(RopeObject *self, PyObject *args, int sides)
+{
+	PyObject *chars = Py_None;
+	char set[256];
+	Py_ssize_t left = 0, right = 0, i;
+	const char *p;
+
+	if (!PyArg_ParseTuple(args, sides == STRIP_LEFT ? "|O:lstrip" :
+			      sides == STRIP_RIGHT ? "|O:rstrip" : "|O:strip",
+			      &chars))
+		return NULL;
+	memset(set, 0, sizeof(set));
+	if (chars == Py_None) {
+		for (p = " \t\n\r\v\f"; *p; p++)
+			set[(unsigned char) *p] = 1;
+	}
+	else if (PyString_Check(chars)) {
+		p = PyString_AS_STRING(chars);
+		for (i = 0; i < PyString_GET_SIZE(chars); i++)
+			set[(unsigned char) p[i]] = 1;
+	}
+	else {
+		PyErr_SetString(PyExc_TypeError,
+				"strip arg must be None or str");
+		return NULL;
+	}
+	if (sides & STRIP_LEFT) {
+		left = rope_span(self, set, 0);
+		if (left < 0)
+			return NULL;
+	}
+	if ((sides & STRIP_RIGHT) && left < self->length) {
+		right = rope_span(self, set, 1);
+		if (right < 0)
+			return NULL;
+	}
+	return (PyObject *) rope_slice(self, left, self->length - right);
+}
+
+static PyObject *
+rope_lstrip(RopeObject *self, PyObject *args)
+{
+	return rope_strip_method(self, args, STRIP_LEFT);
+}
+
+static PyObject *
+rope_rstrip(RopeObject *self, PyObject *args)
+{
+	return rope_strip_method(self, args, STRIP_RIGHT);
+}
+
+static PyObject *
+rope_strip(RopeObject *self, PyObject *args)
+{
+	return rope_strip_method(self, args, STRIP_LEFT | STRIP_RIGHT);
+}
+
+static PyObject *
+rope_count(RopeObject *self, PyObject *args)
+{
+	PyObject *sub;
+	Py_ssize_t start = 0, stop = PY_SSIZE_T_MAX, n;
+	int c;
+
+	if (!PyArg_ParseTuple(args, "O|O&O&:count", &sub,
+			      _PyEval_SliceIndex, &start,
+			      _PyEval_SliceIndex, &stop))
+		return NULL;
+	if (PyString_Check(sub) && PyString_GET_SIZE(sub) == 1)
+		c = (unsigned char) PyString_AS_STRING(sub)[0];
+	else if (Rope_Check(sub) && ((RopeObject *) sub)->length == 1) {
+		c = rope_index((RopeObject *) sub, 0);
+		if (c < 0)
+			return NULL;
+	}
+	else {
+		PyErr_SetString(PyExc_ValueError,
+				"count() takes a single character");
+		return NULL;
+	}
+	rope_adjust_indices(self, &start, &stop);
+	n = rope_count_byte(self, start, stop, c);
+	if (n < 0)
+		return NULL;
+	return PyInt_FromSsize_t(n);
+}
+
+/* Batch gathering */
+
+static int
+ropespan_compare(const void *a, const void *b)
+{
+	const RopeSpan *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Sort spans for rope_gather, unless they already are.  Large batches
+ * are radix sorted on start a byte at a time, which is several times
+ * quicker than qsort once there are thousands of them.  Returns 0, or -1
+ * with an exception set. */
+static int
+rope_sort_spans(RopeSpan *spans, Py_ssize_t n)
+{
+	RopeSpan *tmp, *src, *dst, *swap;
+	Py_ssize_t i, count[256], sum, k;
+	size_t max = 0, shift;
+	int sorted = 1;
+
+	for (i = 0; i < n; i++) {
+		if (i > 0 && spans[i].start < spans[i - 1].start)
+			sorted = 0;
+		if ((size_t) spans[i].start > max)
+			max = spans[i].start;
+	}
+	if (sorted)
+		return 0;
+	if (n < 256) {
+		qsort(spans, n, sizeof(RopeSpan), ropespan_compare);
+		return 0;
+	}
+	tmp = PyMem_Malloc(n * sizeof(RopeSpan));
+	if (tmp == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	src = spans;
+	dst = tmp;
+	for (shift = 0; shift < 8 * sizeof(size_t) && (max >> shift) != 0;
+	     shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[((size_t) src[i].start >> shift) & 255]++;
+		for (i = 0, sum = 0; i < 256; i++) {
+			k = count[i];
+			count[i] = sum;
+			sum += k;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[((size_t) src[i].start >> shift) & 255]++] =
+				src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != spans)
+		memcpy(spans, src, n * sizeof(RopeSpan));
+	PyMem_Free(tmp);
+	return 0;
+}
+
+/* Item i of a one-dimensional buffer of native integers.  Returns -1 if
+ * the buffer holds something else, and 1 if the item does not fit in a
+ * Py_ssize_t. */
+static int
+rope_buffer_integer(Py_buffer *view, Py_ssize_t i, Py_ssize_t *value)
+{
+	const char *item = (const char *) view->buf + i * view->itemsize;
+	const char *format = view->format ? view->format : "B";
+
+#define BUFFER_ITEM(type)						\
+	do {								\
+		type v_;						\
+		if (view->itemsize != sizeof(type))			\
+			return -1;					\
+		memcpy(&v_, item, sizeof(type));			\
+		*value = (Py_ssize_t) v_;				\
+	} while (0)
+#define BUFFER_UNSIGNED_ITEM(type)					\
+	do {								\
+		type v_;						\
+		if (view->itemsize != sizeof(type))			\
+			return -1;					\
+		memcpy(&v_, item, sizeof(type));			\
+		*value = (Py_ssize_t) v_;				\
+		if (*value < 0 || (type) *value != v_)			\
+			return 1;					\
+	} while (0)
+
+	/* native order, as ctypes arrays describe themselves, will do too;
+	 * the itemsize check below catches standard sizes that differ */
+#ifdef WORDS_BIGENDIAN
+	if (*format == '@' || *format == '=' || *format == '>' ||
+	    *format == '!')
+#else
+	if (*format == '@' || *format == '=' || *format == '<')
+#endif
+		format++;
+	if (format[0] == '\0' || format[1] != '\0')
+		return -1;
+	switch (*format) {
+	case 'b': BUFFER_ITEM(signed char); break;
+	case 'B': BUFFER_ITEM(unsigned char); break;
+	case 'h': BUFFER_ITEM(short); break;
+	case 'H': BUFFER_ITEM(unsigned short); break;
+	case 'i': BUFFER_ITEM(int); break;
+	case 'I': BUFFER_UNSIGNED_ITEM(unsigned int); break;
+	case 'l': BUFFER_ITEM(long); break;
+	case 'L': BUFFER_UNSIGNED_ITEM(unsigned long); break;
+	case 'q': BUFFER_ITEM(PY_LONG_LONG); break;
+	case 'Q': BUFFER_UNSIGNED_ITEM(unsigned PY_LONG_LONG); break;
+	case 'n': BUFFER_ITEM(Py_ssize_t); break;
+	case 'N': BUFFER_UNSIGNED_ITEM(size_t); break;
+	default:
+		return -1;
+	}
+#undef BUFFER_ITEM
+#undef BUFFER_UNSIGNED_ITEM
+	return 0;
+}
+
+static PyObject *
+rope_take(RopeObject *self, PyObject *indices)
+{
+	Py_buffer view;
+	PyObject *seq = NULL, *result = NULL;
+	RopeSpan *spans = NULL;
+	Py_ssize_t n, i, pos;
+	char *out;
+	int buffered = 0;
+
+	/* offsets in a buffer of integers are read in place */
+	if (!PyString_Check(indices) && PyObject_CheckBuffer(indices)) {
+		if (PyObject_GetBuffer(indices, &view,
+				       PyBUF_FORMAT | PyBUF_ND) < 0)
+			PyErr_Clear();
+		else if (view.ndim <= 1 && view.itemsize > 0 &&
+			 (view.len == 0 ||
+			  rope_buffer_integer(&view, 0, &pos) >= 0))
+			buffered = 1;
+		else
+			PyBuffer_Release(&view);
+	}
+	if (buffered)
+		n = view.len / view.itemsize;
+	else {
+		seq = PySequence_Fast(indices,
+				      "take() expects a sequence of offsets");
+		if (seq == NULL)
+			return NULL;
+		n = PySequence_Fast_GET_SIZE(seq);
+	}
+
+	result = PyString_FromStringAndSize(NULL, n);
+	if (result == NULL)
+		goto done;
+	spans = PyMem_Malloc(n * sizeof(RopeSpan) + 1);
+	if (spans == NULL) {
+		PyErr_NoMemory();
+		goto error;
+	}
+	out = PyString_AS_STRING(result);
+	for (i = 0; i < n; i++) {
+		if (buffered) {
+			if (rope_buffer_integer(&view, i, &pos) > 0) {
+				PyErr_SetString(PyExc_IndexError,
+						"rope index out of range");
+				goto error;
+			}
+		}
+		else {
+			pos = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(seq,
+									  i),
+						 PyExc_IndexError);
+			if (pos == -1 && PyErr_Occurred())
+				goto error;
+		}
+		if (pos < 0)
+			pos += self->length;
+		if (pos < 0 || pos >= self->length) {
+			PyErr_SetString(PyExc_IndexError,
+					"rope index out of range");
+			goto error;
+		}
+		spans[i].start = pos;
+		spans[i].length = 1;
+		spans[i].dst = out + i;
+	}
+	if (rope_sort_spans(spans, n) == 0 &&
+	    rope_gather(self, spans, n) == 0)
+		goto done;
+error:
+	Py_CLEAR(result);
+done:
+	PyMem_Free(spans);
+	if (buffered)
+		PyBuffer_Release(&view);
+	Py_XDECREF(seq);
+	return result;
+}
+
+static PyObject *
+rope_extract(RopeObject *self, PyObject *ranges)
+{
+	PyObject *seq, *item, *piece, *result = NULL;
+	RopeSpan *spans = NULL;
+	Py_ssize_t n, i, start, stop;
+
+	seq = PySequence_Fast(ranges,
+			      "extract() expects a sequence of (start, stop)");
+	if (seq == NULL)
+		return NULL;
+	n = PySequence_Fast_GET_SIZE(seq);
+	result = PyList_New(n);
+	if (result == NULL)
+		goto done;
+	spans = PyMem_Malloc(n * sizeof(RopeSpan) + 1);
+	if (spans == NULL) {
+		PyErr_NoMemory();
+		goto error;
+	}
+	for (i = 0; i < n; i++) {
+		item = PySequence_Fast_GET_ITEM(seq, i);
+		if (!PyTuple_Check(item)) {
+			PyErr_SetString(PyExc_TypeError,
+					"extract() expects (start, stop) tuples");
+			goto error;
+		}
+		if (!PyArg_ParseTuple(item, "nn:extract", &start, &stop))
+			goto error;
+		rope_adjust_indices(self, &start, &stop);
+		if (stop < start)
+			stop = start;
+		piece = PyString_FromStringAndSize(NULL, stop - start);
+		if (piece == NULL)
+			goto error;
+		PyList_SET_ITEM(result, i, piece);
+		spans[i].start = start;
+		spans[i].length = stop - start;
+		spans[i].dst = PyString_AS_STRING(piece);
+	}
+	if (rope_sort_spans(spans, n) == 0 &&
+	    rope_gather(self, spans, n) == 0)
+		goto done;
+error:
+	Py_CLEAR(result);
+done:
+	PyMem_Free(spans);
+	Py_DECREF(seq);
+	return result;
+}
+
+/* Batched editing
+ *
+ * rope.edit() returns an editor that collects insertions, deletions and
+ * replacements, all given in positions of the original rope.  commit()
+ * sorts them and builds the result in one left to right pass: the
+ * untouched stretches between edits are handed whole to the balancing
+ * work list, so the cost is linear in the number of edits plus a walk
+ * down the rope for each, and the result is balanced once.
+ */
+
+typedef struct RopeEdit {
+	Py_ssize_t start, stop;	/* range replaced, in the original */
+	Py_ssize_t seq;		/* order in which it was added */
+	RopeObject *text;	/* NULL for a deletion */
+} RopeEdit;
+
+typedef struct RopeEditor {
+	PyObject_HEAD
+	RopeObject *rope;
+	RopeEdit *edits;
+	Py_ssize_t count, allocated;
+	PyObject *result;	/* set by commit */
+	RopePolicy policy;	/* shape of the result */
+} RopeEditor;
+
+static PyTypeObject RopeEditor_Type;
+
+static void
+ropeeditor_dealloc(RopeEditor *self)
+{
+	Py_ssize_t i;
+
+	for (i = 0; i < self->count; i++)
+		Py_XDECREF(self->edits[i].text);
+	PyMem_Free(self->edits);
+	Py_DECREF(self->rope);
+	Py_XDECREF(self->result);
+	PyObject_Del(self);
+}
+
+static Py_ssize_t
+ropeeditor_position(RopeEditor *self, Py_ssize_t i)
+{
+	if (i < 0)
+		i += self->rope->length;
+	if (i < 0)
+		return 0;
+	if (i > self->rope->length)
+		return self->rope->length;
+	return i;
+}
+
+static int
+ropeeditor_add(RopeEditor *self, Py_ssize_t start, Py_ssize_t stop,
+	       PyObject *text)
+{
+	RopeEdit *edits;
+	RopeObject *rope = NULL;
+	Py_ssize_t allocated;
+
+	if (self->result) {
+		PyErr_SetString(PyExc_ValueError,
+				"edits have already been committed");
+		return -1;
+	}
+	if (text) {
+		rope = rope_from_object(text);
+		if (rope == NULL)
+			return -1;
+	}
+	if (self->count == self->allocated) {
+		allocated = self->allocated ? 2 * self->allocated : 8;
+		edits = PyMem_Realloc(self->edits,
+				      allocated * sizeof(RopeEdit));
+		if (edits == NULL) {
+			Py_XDECREF(rope);
+			PyErr_NoMemory();
+			return -1;
+		}
+		self->edits = edits;
+		self->allocated = allocated;
+	}
+	start = ropeeditor_position(self, start);
+	stop = ropeeditor_position(self, stop);
+	self->edits[self->count].start = start;
+	self->edits[self->count].stop = (stop > start ? stop : start);
+	self->edits[self->count].seq = self->count;
+	self->edits[self->count].text = rope;
+	self->count++;
+	return 0;
+}
+
+static PyObject *
+ropeeditor_insert(RopeEditor *self, PyObject *args)
+{
+	Py_ssize_t pos;
+	PyObject *text;
+
+	if (!PyArg_ParseTuple(args, "nO:insert", &pos, &text) ||
+	    ropeeditor_add(self, pos, pos, text) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropeeditor_delete(RopeEditor *self, PyObject *args)
+{
+	Py_ssize_t start, stop;
+
+	if (!PyArg_ParseTuple(args, "nn:delete", &start, &stop) ||
+	    ropeeditor_add(self, start, stop, NULL) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropeeditor_replace(RopeEditor *self, PyObject *args)
+{
+	Py_ssize_t start, stop;
+	PyObject *text;
+
+	if (!PyArg_ParseTuple(args, "nnO:replace", &start, &stop, &text) ||
+	    ropeeditor_add(self, start, stop, text) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+/* Order by position; insertions go before a range starting at the same
+ * place, and otherwise edits keep the order they were made in. */
+static int
+ropeedit_compare(const void *a, const void *b)
+{
+	const RopeEdit *x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	if ((x->stop > x->start) != (y->stop > y->start))
+		return x->stop > x->start ? 1 : -1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static PyObject *
+ropeeditor_commit(RopeEditor *self)
+{
+	RopeBalanceState state;
+	RopeEdit *edit;
+	RopeObject *result, *balanced;
+	Py_ssize_t i, pos = 0;
+
+	if (self->result) {
+		Py_INCREF(self->result);
+		return self->result;
+	}
+	qsort(self->edits, self->count, sizeof(RopeEdit), ropeedit_compare);
+	for (i = 1; i < self->count; i++)
+		if (self->edits[i].start < self->edits[i - 1].stop) {
+			PyErr_SetString(PyExc_ValueError, "overlapping edits");
+			return NULL;
+		}
+
+	rope_policy_note(self->count, 0);
+	rope_balance_init(&state);
+	state.leaf_length = self->policy.leaf_length;
+	for (i = 0; i < self->count; i++) {
+		edit = &self->edits[i];
+		if (rope_balance_range(&state, self->rope, pos,
+				       edit->start) != 0 ||
+		    (edit->text && rope_balance_range(&state, edit->text, 0,
+						      edit->text->length) != 0)) {
+			rope_balance_clear(&state);
+			return NULL;
+		}
+		pos = edit->stop;
+	}
+	if (rope_balance_range(&state, self->rope, pos,
+			       self->rope->length) != 0) {
+		rope_balance_clear(&state);
+		return NULL;
+	}
+	result = rope_balance_finish(&state);
+	if (result && result->depth > self->policy.balance_depth) {
+		/* whole subtrees of the inputs were kept as they were */
+		balanced = rope_balance_leaves(result,
+					       self->policy.leaf_length);
+		Py_DECREF(result);
+		result = balanced;
+	}
+	if (result == NULL)
+		return NULL;
+
+	for (i = 0; i < self->count; i++)
+		Py_CLEAR(self->edits[i].text);
+	self->count = 0;
+	self->result = (PyObject *) result;
+	Py_INCREF(self->result);
+	return self->result;
+}
+
+static PyObject *
+ropeeditor_enter(RopeEditor *self)
+{
+	Py_INCREF(self);
+	return (PyObject *) self;
+}
+
+static PyObject *
+ropeeditor_exit(RopeEditor *self, PyObject *args)
+{
+	PyObject *type, *value, *traceback, *result;
+
+	if (!PyArg_UnpackTuple(args, "__exit__", 3, 3,
+			       &type, &value, &traceback))
+		return NULL;
+	if (type == Py_None) {
+		result = ropeeditor_commit(self);
+		if (result == NULL)
+			return NULL;
+		Py_DECREF(result);
+	}
+	Py_RETURN_FALSE;
+}
+
+static PyObject *
+ropeeditor_get_result(RopeEditor *self, void *closure)
+{
+	PyObject *result = self->result ? self->result : Py_None;
+
+	Py_INCREF(result);
+	return result;
+}
+
+static Py_ssize_t
+ropeeditor_length(RopeEditor *self)
+{
+	return self->count;
+}
+
+static PyObject *
+rope_edit(RopeObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "leaf_length", "balance_depth", 0 };
+	RopeEditor *editor;
+	RopePolicy policy = rope_policy;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ni:edit", kwlist,
+					 &policy.leaf_length,
+					 &policy.balance_depth) ||
+	    rope_check_policy(&policy) < 0)
+		return NULL;
+	editor = PyObject_New(RopeEditor, &RopeEditor_Type);
+	if (editor == NULL)
+		return NULL;
+	Py_INCREF(self);
+	editor->rope = self;
+	editor->edits = NULL;
+	editor->count = editor->allocated = 0;
+	editor->result = NULL;
+	editor->policy = policy;
+	return (PyObject *) editor;
+}
+
+static PyMethodDef ropeeditor_methods[] = {
+	{"insert", (PyCFunction) ropeeditor_insert, METH_VARARGS,
+	 "insert(pos, text): insert text before position pos"},
+	{"delete", (PyCFunction) ropeeditor_delete, METH_VARARGS,
+	 "delete(start, stop): remove rope[start:stop]"},
+	{"replace", (PyCFunction) ropeeditor_replace, METH_VARARGS,
+	 "replace(start, stop, text): put text in place of rope[start:stop]"},
+	{"commit", (PyCFunction) ropeeditor_commit, METH_NOARGS,
+	 "commit() -> Rope\n\n"
+	 "Apply the edits and return the new rope.  Edits must not overlap;\n"
+	 "several insertions at one position keep the order they were\n"
+	 "made in.  Once committed the editor takes no more edits."},
+	{"__enter__", (PyCFunction) ropeeditor_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction) ropeeditor_exit, METH_VARARGS,
+	 "Commit, unless the block raised an exception"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef ropeeditor_getset[] = {
+	{"result", (getter) ropeeditor_get_result, NULL,
+	 "The rope made by commit(), or None", NULL},
+	{NULL}
+};
+
+static PySequenceMethods ropeeditor_as_sequence = {
+	(lenfunc) ropeeditor_length,	/* sq_length */
+};
+
+PyDoc_STRVAR(ropeeditor_doc,
+"Pending edits to a rope, made by Rope.edit()\n\n\
+Positions always refer to the original rope:\n\n\
+    with rope.edit() as e:\n\
+        e.replace(10, 15, 'world')\n\
+        e.delete(0, 4)\n\
+    rope = e.result");
+
+static PyTypeObject RopeEditor_Type = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/* ob_size */
+	"ropes.RopeEditor",	/* tp_name */
+	sizeof(RopeEditor),	/* tp_basicsize */
+	0,			/* tp_itemsize */
+	(destructor) ropeeditor_dealloc,	/* tp_dealloc */
+	0,			/* tp_print */
+	0,			/* tp_getattr */
+	0,			/* tp_setattr */
+	0,			/* tp_compare */
+	0,			/* tp_repr */
+	0,			/* tp_as_number */
+	&ropeeditor_as_sequence,	/* tp_as_sequence */
+	0,			/* tp_as_mapping */
+	0,			/* tp_hash */
+	0,			/* tp_call */
+	0,			/* tp_str */
+	0,			/* tp_getattro */
+	0,			/* tp_setattro */
+	0,			/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,	/* tp_flags */
+	ropeeditor_doc,		/* tp_doc */
+	0,			/* tp_traverse */
+	0,			/* tp_clear */
+	0,			/* tp_richcompare */
+	0,			/* tp_weaklistoffset */
+	0,			/* tp_iter */
+	0,			/* tp_iternext */
+	ropeeditor_methods,	/* tp_methods */
+	0,			/* tp_members */
+	ropeeditor_getset,	/* tp_getset */
+};
+
+/* File-like access
+ *
+ * A RopeIO reads a rope through a position, as StringIO reads a string,
+ * without flattening it: read() and readline() copy only the bytes they
+ * return, and readinto() copies from the leaves straight into the
+ * caller's buffer.  The run of bytes around the position is remembered
+ * between calls, so reading line by line does not walk down from the
+ * root for every line.  Writes make a new rope: appends take the same
+ * path as +=, and writes over existing bytes splice slices together.
+ */
+
+typedef struct RopeIO {
+	PyObject_HEAD
+	RopeObject *rope;	/* NULL once closed */
+	Py_ssize_t pos;		/* may lie past the end */
+	const char *run;	/* bytes [run_start, run_stop) of the rope */
+	Py_ssize_t run_start, run_stop;
+	size_t epoch;		/* rope_run_epoch when run was found */
+} RopeIO;
+
+static PyTypeObject RopeIO_Type;
+
+static void
+ropeio_dealloc(RopeIO *self)
+{
+	Py_XDECREF(self->rope);
+	PyObject_Del(self);
+}
+
+static int
+ropeio_check(RopeIO *self)
+{
+	if (self->rope == NULL) {
+		PyErr_SetString(PyExc_ValueError,
+				"I/O operation on closed RopeIO");
+		return -1;
+	}
+	return 0;
+}
+
+/* Point *p at the byte at the position and return how many bytes of its
+ * run lie from there on: 0 at the end, -1 with an error set. */
+static Py_ssize_t
+ropeio_run(RopeIO *self, const char **p)
+{
+	Py_ssize_t before, after;
+
+	*p = NULL;
+	if (self->pos >= self->rope->length)
+		return 0;
+	if (self->run == NULL || self->epoch != rope_run_epoch ||
+	    self->pos < self->run_start || self->pos >= self->run_stop) {
+		self->run = rope_chunk(self->rope, self->pos, &before, &after);
+		if (self->run == NULL)
+			return -1;
+		self->run -= before;
+		self->run_start = self->pos - before;
+		self->run_stop = self->pos + after;
+		self->epoch = rope_run_epoch;
+	}
+	*p = self->run + (self->pos - self->run_start);
+	return self->run_stop - self->pos;
+}
+
+/* Return the next n bytes (or all that are left, if n < 0 or fewer are)
+ * as a string and move past them. */
+static PyObject *
+ropeio_take(RopeIO *self, Py_ssize_t n)
+{
+	PyObject *result;
+	const char *run;
+	char *p;
+	Py_ssize_t left = self->rope->length - self->pos, avail;
+
+	if (left < 0)
+		left = 0;
+	if (n < 0 || n > left)
+		n = left;
+	if (n > 0) {
+		/* most reads lie within the current run */
+		avail = ropeio_run(self, &run);
+		if (avail < 0)
+			return NULL;
+		if (avail >= n) {
+			self->pos += n;
+			return PyString_FromStringAndSize(run, n);
+		}
+	}
+	result = PyString_FromStringAndSize(NULL, n);
+	if (result == NULL)
+		return NULL;
+	p = PyString_AS_STRING(result);
+	if (_rope_str_range(self->rope, self->pos, n, &p) < 0) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	self->pos += n;
+	return result;
+}
+
+/* Return the next line, ending at a newline or after size bytes. */
+static PyObject *
+ropeio_line(RopeIO *self, Py_ssize_t size)
+{
+	const char *run, *newline;
+	Py_ssize_t start = self->pos, limit, n = 0, avail;
+
+	limit = self->rope->length - start;
+	if (size >= 0 && size < limit)
+		limit = size;
+	while (n < limit) {
+		self->pos = start + n;
+		avail = ropeio_run(self, &run);
+		if (avail < 0) {
+			self->pos = start;
+			return NULL;
+		}
+		if (avail > limit - n)
+			avail = limit - n;
+		newline = memchr(run, '\n', avail);
+		if (newline) {
+			n += newline - run + 1;
+			break;
+		}
+		n += avail;
+	}
+	self->pos = start;
+	return ropeio_take(self, n);
+}
+
+static PyObject *
+ropeio_read(RopeIO *self, PyObject *args)
+{
+	Py_ssize_t n = -1;
+
+	if (!PyArg_ParseTuple(args, "|n:read", &n) || ropeio_check(self) < 0)
+		return NULL;
+	return ropeio_take(self, n);
+}
+
+static PyObject *
+ropeio_readline(RopeIO *self, PyObject *args)
+{
+	Py_ssize_t size = -1;
+
+	if (!PyArg_ParseTuple(args, "|n:readline", &size) ||
+	    ropeio_check(self) < 0)
+		return NULL;
+	return ropeio_line(self, size);
+}
+
+static PyObject *
+ropeio_readinto(RopeIO *self, PyObject *args)
+{
+	PyObject *buffer;
+	void *data;
+	char *p;
+	Py_ssize_t size, n;
+
+	if (!PyArg_ParseTuple(args, "O:readinto", &buffer) ||
+	    ropeio_check(self) < 0 ||
+	    PyObject_AsWriteBuffer(buffer, &data, &size) < 0)
+		return NULL;
+	n = self->rope->length - self->pos;
+	if (n > size)
+		n = size;
+	if (n < 0)
+		n = 0;
+	p = data;
+	if (_rope_str_range(self->rope, self->pos, n, &p) < 0)
+		return NULL;
+	self->pos += n;
+	return PyInt_FromSsize_t(n);
+}
+
+static PyObject *
+ropeio_seek(RopeIO *self, PyObject *args)
+{
+	Py_ssize_t pos;
+	int whence = 0;
+
+	if (!PyArg_ParseTuple(args, "n|i:seek", &pos, &whence) ||
+	    ropeio_check(self) < 0)
+		return NULL;
+	if (whence == 1)
+		pos += self->pos;
+	else if (whence == 2)
+		pos += self->rope->length;
+	else if (whence != 0) {
+		PyErr_SetString(PyExc_ValueError, "invalid whence");
+		return NULL;
+	}
+	self->pos = (pos > 0 ? pos : 0);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropeio_tell(RopeIO *self)
+{
+	if (ropeio_check(self) < 0)
+		return NULL;
+	return PyInt_FromSsize_t(self->pos);
+}
+
+/* Return rope with text written at pos over whatever was there, padding
+ * with NUL bytes if pos lies past the end. */
+static RopeObject *
+ropeio_splice(RopeObject *rope, Py_ssize_t pos, RopeObject *text)
+{
+	RopeObject *head, *tail, *result;
+
+	if (pos > rope->length) {
+		tail = rope_from_string(NULL, pos - rope->length);
+		if (tail == NULL)
+			return NULL;
+		memset(tail->v.literal, 0, tail->length);
+		head = rope_inplace_concat(rope, tail);
+		Py_DECREF(tail);
+		if (head == NULL)
+			return NULL;
+		result = rope_inplace_concat(head, text);
+		Py_DECREF(head);
+		return result;
+	}
+	if (pos == rope->length)
+		return rope_inplace_concat(rope, text);
+	head = rope_slice(rope, 0, pos);
+	if (head == NULL)
+		return NULL;
+	result = rope_concat(head, text);
+	Py_DECREF(head);
+	if (result == NULL || text->length >= rope->length - pos)
+		return result;
+	head = result;
+	tail = rope_slice(rope, pos + text->length, rope->length);
+	result = (tail ? rope_concat(head, tail) : NULL);
+	Py_DECREF(head);
+	Py_XDECREF(tail);
+	return result;
+}
+
+static PyObject *
+ropeio_write(RopeIO *self, PyObject *obj)
+{
+	RopeObject *text, *result;
+	Py_ssize_t n;
+
+	if (ropeio_check(self) < 0)
+		return NULL;
+	text = rope_from_object(obj);
+	if (text == NULL)
+		return NULL;
+	n = text->length;
+	result = ropeio_splice(self->rope, self->pos, text);
+	Py_DECREF(text);
+	if (result == NULL)
+		return NULL;
+	Py_DECREF(self->rope);
+	self->rope = result;
+	self->pos += n;
+	self->run = NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropeio_truncate(RopeIO *self, PyObject *args)
+{
+	RopeObject *result;
+	Py_ssize_t size = -1;
+
+	if (!PyArg_ParseTuple(args, "|n:truncate", &size) ||
+	    ropeio_check(self) < 0)
+		return NULL;
+	if (PyTuple_GET_SIZE(args) == 0)
+		size = self->pos;
+	if (size < 0) {
+		PyErr_SetString(PyExc_ValueError, "negative size value");
+		return NULL;
+	}
+	if (size < self->rope->length) {
+		result = rope_slice(self->rope, 0, size);
+		if (result == NULL)
+			return NULL;
+		Py_DECREF(self->rope);
+		self->rope = result;
+		self->run = NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropeio_getvalue(RopeIO *self)
+{
+	if (ropeio_check(self) < 0)
+		return NULL;
+	Py_INCREF(self->rope);
+	return (PyObject *) self->rope;
+}
+
+static PyObject *
+ropeio_close(RopeIO *self)
+{
+	Py_CLEAR(self->rope);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropeio_get_closed(RopeIO *self, void *closure)
+{
+	return PyBool_FromLong(self->rope == NULL);
+}
+
+static PyObject *
+ropeio_iternext(RopeIO *self)
+{
+	PyObject *line;
+
+	if (ropeio_check(self) < 0)
+		return NULL;
+	line = ropeio_line(self, -1);
+	if (line && PyString_GET_SIZE(line) == 0) {
+		Py_DECREF(line);
+		return NULL;
+	}
+	return line;
+}
+
+static PyObject *
+ropeio_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "rope", 0 };
+	PyObject *initial = NULL;
+	RopeIO *self;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:RopeIO", kwlist,
+					 &initial))
+		return NULL;
+	self = PyObject_New(RopeIO, &RopeIO_Type);
+	if (self == NULL)
+		return NULL;
+	self->rope = (initial ? rope_from_object(initial) :
+		      rope_from_string(NULL, 0));
+	self->pos = 0;
+	self->run = NULL;
+	self->run_start = self->run_stop = 0;
+	self->epoch = 0;
+	if (self->rope == NULL) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	return (PyObject *) self;
+}
+
+static PyMethodDef ropeio_methods[] = {
+	{"read", (PyCFunction) ropeio_read, METH_VARARGS,
+	 "read([n]) -> str: the next n bytes, or all that are left"},
+	{"readline", (PyCFunction) ropeio_readline, METH_VARARGS,
+	 "readline([size]) -> str: the next line, newline included"},
+	{"readinto", (PyCFunction) ropeio_readinto, METH_VARARGS,
+	 "readinto(buffer) -> int\n\n"
+	 "Copy the next bytes into a writable buffer (a bytearray, say) and\n"
+	 "return how many were copied."},
+	{"seek", (PyCFunction) ropeio_seek, METH_VARARGS,
+	 "seek(pos[, whence]): whence is 0 (start), 1 (current) or 2 (end)"},
+	{"tell", (PyCFunction) ropeio_tell, METH_NOARGS,
+	 "tell() -> int: the current position"},
+	{"write", (PyCFunction) ropeio_write, METH_O,
+	 "write(text): write a string or rope at the current position"},
+	{"truncate", (PyCFunction) ropeio_truncate, METH_VARARGS,
+	 "truncate([size]): drop what lies past size, or the position"},
+	{"getvalue", (PyCFunction) ropeio_getvalue, METH_NOARGS,
+	 "getvalue() -> Rope: everything written so far"},
+	{"close", (PyCFunction) ropeio_close, METH_NOARGS,
+	 "close(): let go of the rope"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef ropeio_getset[] = {
+	{"closed", (getter) ropeio_get_closed, NULL,
+	 "True once close() has been called", NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(ropeio_doc,
+"RopeIO([rope]) -> file-like object reading and writing a rope\n\n\
+Like StringIO, but over a Rope (or a string), which is never flattened:\n\n\
+    for row in csv.reader(ropes.RopeIO(rope)):\n\
+        ...\n\n\
+getvalue() returns the rope as written so far.");
+
+static PyTypeObject RopeIO_Type = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/* ob_size */
+	"ropes.RopeIO",		/* tp_name */
+	sizeof(RopeIO),		/* tp_basicsize */
+	0,			/* tp_itemsize */
+	(destructor) ropeio_dealloc,	/* tp_dealloc */
+	0,			/* tp_print */
+	0,			/* tp_getattr */
+	0,			/* tp_setattr */
+	0,			/* tp_compare */
+	0,			/* tp_repr */
+	0,			/* tp_as_number */
+	0,			/* tp_as_sequence */
+	0,			/* tp_as_mapping */
+	0,			/* tp_hash */
+	0,			/* tp_call */
+	0,			/* tp_str */
+	0,			/* tp_getattro */
+	0,			/* tp_setattro */
+	0,			/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,	/* tp_flags */
+	ropeio_doc,		/* tp_doc */
+	0,			/* tp_traverse */
+	0,			/* tp_clear */
+	0,			/* tp_richcompare */
+	0,			/* tp_weaklistoffset */
+	PyObject_SelfIter,	/* tp_iter */
+	(iternextfunc) ropeio_iternext,	/* tp_iternext */
+	ropeio_methods,		/* tp_methods */
+	0,			/* tp_members */
+	ropeio_getset,		/* tp_getset */
+	0,			/* tp_base */
+	0,			/* tp_dict */
+	0,			/* tp_descr_get */
+	0,			/* tp_descr_set */
+	0,			/* tp_dictoffset */
+	0,			/* tp_init */
+	0,			/* tp_alloc */
+	ropeio_new,		/* tp_new */
+};
+
+/* Streaming ingestion
+ *
+ * Rope.read_from() reads straight into blocks of about ROPE_INGEST_BLOCK
+ * bytes, RopeTailBuffers, and cuts them into leaves of leaf_length that
+ * point into the block.  Each leaf goes to the balancing work list as it
+ * is cut, so the rope is built balanced while the data arrives.  The
+ * read itself is the only copy, and apart from the rope the working
+ * memory is one block.
+ *
+ * A file descriptor is read with read(2), the GIL released meanwhile.
+ * An object with readinto() is handed a memoryview of the free part of
+ * the block.  Anything else with read() has the strings it returns used
+ * in place.
+ */
+
+#define ROPE_INGEST_BLOCK (256 * 1024)
+
+typedef struct RopeIngest {
+	RopeBalanceState state;
+	Py_ssize_t leaf_length;
+	Py_ssize_t block_size;	/* a multiple of leaf_length */
+	RopeTailBuffer *block;
+	Py_ssize_t cut;		/* bytes of block already made leaves */
+} RopeIngest;
+
+/* Hand length bytes at data, owned by base, to the work list. */
+static int
+ingest_leaf(RopeIngest *in, char *data, Py_ssize_t length, PyObject *base)
+{
+	RopeObject *leaf;
+	int status;
+
+	leaf = rope_from_type(LITERAL_NODE, length);
+	if (leaf == NULL)
+		return -1;
+	leaf->v.literal = data;
+	Py_INCREF(base);
+	leaf->base = base;
+	status = rope_balance_range(&in->state, leaf, 0, length);
+	Py_DECREF(leaf);
+	return status;
+}
+
+/* Cut the bytes read into the block into leaves; the last piece too if
+ * final is set, otherwise only whole leaves. */
+static int
+ingest_cut(RopeIngest *in, int final)
+{
+	RopeTailBuffer *block = in->block;
+	Py_ssize_t n;
+
+	while (block && block->used > in->cut) {
+		n = block->used - in->cut;
+		if (n > in->leaf_length)
+			n = in->leaf_length;
+		else if (n < in->leaf_length && !final)
+			break;
+		if (ingest_leaf(in, block->data + in->cut, n,
+				(PyObject *) block) < 0)
+			return -1;
+		in->cut += n;
+	}
+	return 0;
+}
+
+/* Return where the next read goes and set *room to how much fits, at
+ * most want, going on to a new block once the current one is full. */
+static char *
+ingest_room(RopeIngest *in, Py_ssize_t want, Py_ssize_t *room)
+{
+	RopeTailBuffer *block = in->block;
+	Py_ssize_t size = in->block_size;
+
+	if (block == NULL || block->used == block->capacity) {
+		if (ingest_cut(in, 1) < 0)
+			return NULL;
+		/* no bigger than the leaves the rest of size= needs */
+		if (want < size)
+			size = (want + in->leaf_length - 1) /
+				in->leaf_length * in->leaf_length;
+		Py_XDECREF(block);
+		in->block = block = tailbuffer_new(size);
+		in->cut = 0;
+		if (block == NULL)
+			return NULL;
+	}
+	*room = block->capacity - block->used;
+	if (*room > want)
+		*room = want;
+	return block->data + block->used;
+}
+
+/* Read up to want bytes from fd.  Returns how many were read, 0 at end of
+ * file, or -1 with an error set. */
+static Py_ssize_t
+ingest_fd(RopeIngest *in, int fd, Py_ssize_t want)
+{
+	Py_ssize_t room, n;
+	char *p;
+
+	p = ingest_room(in, want, &room);
+	if (p == NULL)
+		return -1;
+	for (;;) {
+		Py_BEGIN_ALLOW_THREADS
+		n = read(fd, p, room);
+		Py_END_ALLOW_THREADS
+		if (n >= 0)
+			break;
+		if (errno != EINTR || PyErr_CheckSignals() < 0) {
+			if (!PyErr_Occurred())
+				PyErr_SetFromErrno(PyExc_IOError);
+			return -1;
+		}
+	}
+	in->block->used += n;
+	return n;
+}
+
+/* Give up the rest of the block, which a view may still write to,
+ * moving the n bytes just read at p to a block of their own. */
+static int
+ingest_move(RopeIngest *in, char *p, Py_ssize_t n)
+{
+	RopeTailBuffer *fresh;
+
+	fresh = tailbuffer_new(in->block_size);
+	if (fresh == NULL)
+		return -1;
+	memcpy(fresh->data, p, n);
+	fresh->used = n;
+	in->block->capacity = in->block->used;
+	if (ingest_cut(in, 1) < 0) {
+		Py_DECREF(fresh);
+		return -1;
+	}
+	Py_DECREF(in->block);
+	in->block = fresh;
+	in->cut = 0;
+	return 0;
+}
+
+static Py_ssize_t
+ingest_readinto(RopeIngest *in, PyObject *readinto, Py_ssize_t want)
+{
+	Py_buffer view;
+	PyObject *block, *memory, *result;
+	Py_ssize_t room, n, refs;
+	char *p;
+
+	p = ingest_room(in, want, &room);
+	if (p == NULL)
+		return -1;
+	/* the view keeps the block alive for as long as it is kept */
+	block = (PyObject *) in->block;
+	refs = Py_REFCNT(block);
+	if (PyBuffer_FillInfo(&view, block, p, room, 0, PyBUF_CONTIG) < 0)
+		return -1;
+	memory = PyMemoryView_FromBuffer(&view);
+	if (memory == NULL) {
+		PyBuffer_Release(&view);
+		return -1;
+	}
+	result = PyObject_CallFunctionObjArgs(readinto, memory, NULL);
+	Py_DECREF(memory);
+	if (result == NULL)
+		return -1;
+	if (result == Py_None) {
+		/* a non-blocking stream with nothing to read */
+		Py_DECREF(result);
+		errno = EAGAIN;
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+	n = PyNumber_AsSsize_t(result, PyExc_OverflowError);
+	Py_DECREF(result);
+	if (n == -1 && PyErr_Occurred())
+		return -1;
+	if (n < 0 || n > room) {
+		PyErr_SetString(PyExc_ValueError,
+				"readinto() returned a bad count");
+		return -1;
+	}
+	if (Py_REFCNT(block) > refs) {
+		/* the view, or one made from it, outlived the call */
+		if (ingest_move(in, p, n) < 0)
+			return -1;
+		return n;
+	}
+	in->block->used += n;
+	return n;
+}
+
+static Py_ssize_t
+ingest_read(RopeIngest *in, PyObject *read, Py_ssize_t want)
+{
+	PyObject *data;
+	Py_ssize_t n, length, i;
+
+	if (want > in->block_size)
+		want = in->block_size;
+	data = PyObject_CallFunction(read, "n", want);
+	if (data == NULL)
+		return -1;
+	if (!PyString_Check(data)) {
+		PyErr_Format(PyExc_TypeError,
+			     "read() should return a str, not %.200s",
+			     Py_TYPE(data)->tp_name);
+		Py_DECREF(data);
+		return -1;
+	}
+	length = PyString_GET_SIZE(data);
+	if (length > want) {
+		PyErr_SetString(PyExc_ValueError,
+				"read() returned too much data");
+		Py_DECREF(data);
+		return -1;
+	}
+	for (i = 0; i < length; i += n) {
+		n = length - i;
+		if (n > in->leaf_length)
+			n = in->leaf_length;
+		if (ingest_leaf(in, PyString_AS_STRING(data) + i, n,
+				data) < 0) {
+			Py_DECREF(data);
+			return -1;
+		}
+	}
+	Py_DECREF(data);
+	return length;
+}
+
+static PyObject *
+rope_read_from(PyObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "source", "size", "leaf_length", 0 };
+	PyObject *source, *method = NULL;
+	RopeObject *result = NULL;
+	RopeIngest in;
+	long value;
+	Py_ssize_t size = -1, total = 0, want, n;
+	int fd = -1;
+
+	in.leaf_length = rope_policy.leaf_length;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|nn:read_from", kwlist,
+					 &source, &size, &in.leaf_length))
+		return NULL;
+	if (in.leaf_length < 1 || in.leaf_length > ROPE_MAX_LEAF_LENGTH) {
+		PyErr_Format(PyExc_ValueError,
+			     "leaf_length must be between 1 and %d",
+			     ROPE_MAX_LEAF_LENGTH);
+		return NULL;
+	}
+	if (PyInt_Check(source) || PyLong_Check(source)) {
+		value = PyInt_AsLong(source);
+		if (value == -1 && PyErr_Occurred())
+			return NULL;
+		if (value < 0) {
+			PyErr_SetString(PyExc_ValueError,
+					"file descriptor cannot be negative");
+			return NULL;
+		}
+		if (value > INT_MAX) {
+			PyErr_SetString(PyExc_OverflowError,
+					"file descriptor is too large");
+			return NULL;
+		}
+		fd = (int) value;
+	}
+	else {
+		method = PyObject_GetAttrString(source, "readinto");
+		if (method == NULL) {
+			PyErr_Clear();
+			method = PyObject_GetAttrString(source, "read");
+			if (method == NULL) {
+				PyErr_SetString(PyExc_TypeError,
+						"read_from() needs a file "
+						"descriptor or a file-like "
+						"object");
+				return NULL;
+			}
+			fd = -2;
+		}
+	}
+
+	in.block_size = ROPE_INGEST_BLOCK - ROPE_INGEST_BLOCK % in.leaf_length;
+	if (in.block_size == 0)
+		in.block_size = in.leaf_length;
+	in.block = NULL;
+	in.cut = 0;
+	rope_balance_init(&in.state);
+	in.state.leaf_length = in.leaf_length;
+	while (size < 0 || total < size) {
+		want = (size < 0 ? PY_SSIZE_T_MAX : size - total);
+		if (fd >= 0)
+			n = ingest_fd(&in, fd, want);
+		else if (fd == -1)
+			n = ingest_readinto(&in, method, want);
+		else
+			n = ingest_read(&in, method, want);
+		if (n < 0 || (n > 0 && ingest_cut(&in, 0) < 0))
+			goto done;
+		if (n == 0)
+			break;
+		total += n;
+	}
+	if (in.block && in.cut == 0 && in.block->used < in.block->capacity) {
+		/* a short read: no leaf points into the block yet, so give
+		 * back the part left over */
+		char *data = PyMem_Realloc(in.block->data,
+					   in.block->used ? in.block->used : 1);
+		if (data) {
+			in.block->data = data;
+			in.block->capacity = in.block->used;
+		}
+	}
+	if (ingest_cut(&in, 1) < 0)
+		goto done;
+	result = rope_balance_finish(&in.state);
+  done:
+	if (result == NULL)
+		rope_balance_clear(&in.state);
+	Py_XDECREF(in.block);
+	Py_XDECREF(method);
+	return (PyObject *) result;
+}
+
+/* Serialization
+ *
+ * The dumped form keeps the shape of the rope: every distinct node is
+ * written once, in post-order, and refers to its children by index, so
+ * shared subtrees and repeat counts survive the round trip.  All literal
+ * bytes are kept in one section at the end, which lets the loader point
+ * leaves straight into the buffer it was given instead of copying them.
+ *
+ *   "RoPe" version node_count literal_length
+ *   node records: type byte followed by type specific varints
+ *     LITERAL_NODE  length
+ *     CONCAT_NODE   left_index right_index
+ *     REPEAT_NODE   child_index count
+ *     SUBSTRING_NODE child_index offset length
+ *     TRANSFORM_NODE child_index, then the 256 byte table
+ *   literal bytes, in node order
+ *
+ * The last node written is the root.
+ */
+
+#define ROPE_DUMP_MAGIC "RoPe"
+#define ROPE_DUMP_VERSION 1
+
+typedef struct RopeWriter {
+	char *data;
+	Py_ssize_t length;
+	Py_ssize_t allocated;
+} RopeWriter;
+
+typedef struct RopeDumpState {
+	PyObject *memo;		/* node address -> index */
+	Py_ssize_t count;
+	RopeWriter nodes;
+	RopeWriter literals;
+} RopeDumpState;
+
+typedef struct RopeLoadState {
+	const unsigned char *p;
+	const unsigned char *end;
+} RopeLoadState;
+
+static int
+writer_put(RopeWriter *w, const char *data, Py_ssize_t len)
+{
+	if (w->length + len > w->allocated) {
+		Py_ssize_t size = w->allocated ? w->allocated : 64;
+		char *p;
+
+		while (size < w->length + len)
+			size *= 2;
+		p = PyMem_Realloc(w->data, size);
+		if (p == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		w->data = p;
+		w->allocated = size;
+	}
+	memcpy(w->data + w->length, data, len);
+	w->length += len;
+	return 0;
+}
+
+static int
+writer_put_varint(RopeWriter *w, size_t v)
+{
+	char buf[16];
+	int n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (char)((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (char)v;
+	return writer_put(w, buf, n);
+}
+
+static Py_ssize_t
+_rope_dump(RopeObject *self, RopeDumpState *state)
+{
+	PyObject *key, *index;
+	Py_ssize_t left, right;
+	const char *literal;
+	char type = (char)self->type;
+
+	key = PyLong_FromVoidPtr(self);
+	if (key == NULL)
+		return -1;
+	index = PyDict_GetItem(state->memo, key);
+	if (index) {
+		Py_DECREF(key);
+		return PyInt_AsSsize_t(index);
+	}
+
+	switch (self->type) {
+	case LITERAL_NODE:
+		literal = rope_literal(self);
+		if ((literal == NULL && self->length > 0) ||
+		    writer_put(&state->nodes, &type, 1) < 0 ||
+		    writer_put_varint(&state->nodes, self->length) < 0 ||
+		    writer_put(&state->literals, literal, self->length) < 0)
+			goto error;
+		break;
+	case CONCAT_NODE:
+		left = _rope_dump(self->v.concat.left, state);
+		if (left < 0)
+			goto error;
+		right = _rope_dump(self->v.concat.right, state);
+		if (right < 0)
+			goto error;
+		if (writer_put(&state->nodes, &type, 1) < 0 ||
+		    writer_put_varint(&state->nodes, left) < 0 ||
+		    writer_put_varint(&state->nodes, right) < 0)
+			goto error;
+		break;
+	case REPEAT_NODE:
+		left = _rope_dump(self->v.repeat.child, state);
+		if (left < 0)
+			goto error;
+		if (writer_put(&state->nodes, &type, 1) < 0 ||
+		    writer_put_varint(&state->nodes, left) < 0 ||
+		    writer_put_varint(&state->nodes,
+				      self->v.repeat.count) < 0)
+			goto error;
+		break;
+	case SUBSTRING_NODE:
+		left = _rope_dump(self->v.substring.child, state);
+		if (left < 0)
+			goto error;
+		if (writer_put(&state->nodes, &type, 1) < 0 ||
+		    writer_put_varint(&state->nodes, left) < 0 ||
+		    writer_put_varint(&state->nodes,
+				      self->v.substring.offset) < 0 ||
+		    writer_put_varint(&state->nodes, self->length) < 0)
+			goto error;
+		break;
+	case TRANSFORM_NODE:
+		left = _rope_dump(self->v.transform.child, state);
+		if (left < 0)
+			goto error;
+		if (writer_put(&state->nodes, &type, 1) < 0 ||
+		    writer_put_varint(&state->nodes, left) < 0 ||
+		    writer_put(&state->nodes,
+			       (char *)self->v.transform.table, 256) < 0)
+			goto error;
+		break;
+	}
+
+	index = PyInt_FromSsize_t(state->count);
+	if (index == NULL || PyDict_SetItem(state->memo, key, index) < 0) {
+		Py_XDECREF(index);
+		goto error;
+	}
+	Py_DECREF(index);
+	Py_DECREF(key);
+	return state->count++;
+  error:
+	Py_DECREF(key);
+	return -1;
+}
+
+/* Dump self into state, and the header for it into header; the dumped
+ * form is then header, state->nodes and state->literals in that order. */
+static int
+rope_dump_prepare(RopeObject *self, RopeDumpState *state, RopeWriter *header)
+{
+	char version = ROPE_DUMP_VERSION;
+
+	memset(state, 0, sizeof(*state));
+	memset(header, 0, sizeof(*header));
+	state->memo = PyDict_New();
+	if (state->memo == NULL)
+		return -1;
+	if (_rope_dump(self, state) < 0 ||
+	    writer_put(header, ROPE_DUMP_MAGIC, 4) < 0 ||
+	    writer_put(header, &version, 1) < 0 ||
+	    writer_put_varint(header, state->count) < 0 ||
+	    writer_put_varint(header, state->literals.length) < 0)
+		return -1;
+	return 0;
+}
+
+static void
+rope_dump_copy(RopeDumpState *state, RopeWriter *header, char *p)
+{
+	memcpy(p, header->data, header->length);
+	p += header->length;
+	memcpy(p, state->nodes.data, state->nodes.length);
+	p += state->nodes.length;
+	memcpy(p, state->literals.data, state->literals.length);
+}
+
+static void
+rope_dump_clear(RopeDumpState *state, RopeWriter *header)
+{
+	Py_XDECREF(state->memo);
+	PyMem_Free(state->nodes.data);
+	PyMem_Free(state->literals.data);
+	PyMem_Free(header->data);
+}
+
+static PyObject *
+rope_dumps(RopeObject *self)
+{
+	RopeDumpState state;
+	RopeWriter header;
+	PyObject *retval = NULL;
+
+	if (rope_dump_prepare(self, &state, &header) < 0)
+		goto done;
+	retval = PyString_FromStringAndSize(NULL, header.length +
+					    state.nodes.length +
+					    state.literals.length);
+	if (retval == NULL)
+		goto done;
+	rope_dump_copy(&state, &header, PyString_AS_STRING(retval));
+  done:
+	rope_dump_clear(&state, &header);
+	return retval;
+}
+
+static int
+reader_get_varint(RopeLoadState *r, Py_ssize_t *v)
+{
+	size_t result = 0;
+	int shift = 0;
+
+	while (r->p < r->end && shift < (int)(8 * sizeof(size_t))) {
+		unsigned char c = *r->p++;
+		result |= (size_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			if (result > PY_SSIZE_T_MAX)
+				return -1;
+			*v = (Py_ssize_t)result;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+/* Rebuild a rope from its dumped form.  When base is not NULL the
+ * literals are not copied: the leaves point into data and keep base
+ * alive instead. */
+static RopeObject *
+rope_load(const char *data, Py_ssize_t len, PyObject *base)
+{
+	RopeLoadState r;
+	RopeObject **nodes = NULL;
+	RopeObject *node, *retval = NULL;
+	Py_ssize_t count, literal_length, i, a, b, c;
+	const char *literal, *literal_end;
+
+	r.p = (const unsigned char *)data;
+	r.end = r.p + len;
+	if (len < 5 || memcmp(data, ROPE_DUMP_MAGIC, 4) != 0 ||
+	    data[4] != ROPE_DUMP_VERSION)
+		goto invalid;
+	r.p += 5;
+	if (reader_get_varint(&r, &count) < 0 ||
+	    reader_get_varint(&r, &literal_length) < 0 ||
+	    count <= 0 || count > r.end - r.p ||
+	    literal_length > r.end - r.p)
+		goto invalid;
+	literal_end = (const char *)r.end;
+	literal = literal_end - literal_length;
+	r.end = (const unsigned char *)literal;
+
+	nodes = PyMem_Malloc(count * sizeof(RopeObject *));
+	if (nodes == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		if (r.p >= r.end)
+			goto invalid_nodes;
+		switch (*r.p++) {
+		case LITERAL_NODE:
+			if (reader_get_varint(&r, &a) < 0 ||
+			    a > literal_end - literal)
+				goto invalid_nodes;
+			if (base) {
+				node = rope_from_type(LITERAL_NODE, a);
+				if (node) {
+					node->v.literal = (char *)literal;
+					Py_INCREF(base);
+					node->base = base;
+				}
+			}
+			else
+				node = rope_from_string_interned(literal, a);
+			literal += a;
+			break;
+		case CONCAT_NODE:
+			if (reader_get_varint(&r, &a) < 0 ||
+			    reader_get_varint(&r, &b) < 0 ||
+			    a >= i || b >= i)
+				goto invalid_nodes;
+			if (nodes[a]->length > PY_SSIZE_T_MAX - nodes[b]->length)
+				goto invalid_nodes;
+			node = rope_concat_unchecked(nodes[a], nodes[b]);
+			break;
+		case REPEAT_NODE:
+			if (reader_get_varint(&r, &a) < 0 ||
+			    reader_get_varint(&r, &b) < 0 ||
+			    a >= i || b < 2)
+				goto invalid_nodes;
+			if (nodes[a]->length == 0 ||
+			    b > PY_SSIZE_T_MAX / nodes[a]->length)
+				goto invalid_nodes;
+			node = rope_repeat_node(nodes[a], b);
+			break;
+		case SUBSTRING_NODE:
+			if (reader_get_varint(&r, &a) < 0 ||
+			    reader_get_varint(&r, &b) < 0 ||
+			    reader_get_varint(&r, &c) < 0 || a >= i ||
+			    b > nodes[a]->length - c)
+				goto invalid_nodes;
+			node = rope_from_type(SUBSTRING_NODE, c);
+			if (node) {
+				Py_INCREF(nodes[a]);
+				node->v.substring.child = nodes[a];
+				node->v.substring.offset = b;
+				node->depth = nodes[a]->depth + 1;
+			}
+			break;
+		case TRANSFORM_NODE:
+			if (reader_get_varint(&r, &a) < 0 || a >= i ||
+			    r.end - r.p < 256)
+				goto invalid_nodes;
+			node = rope_transform(nodes[a], r.p);
+			r.p += 256;
+			break;
+		default:
+			goto invalid_nodes;
+		}
+		if (node == NULL)
+			goto fail;
+		nodes[i] = node;
+		/* Nothing this module builds is this deep, and walking a
+		 * deeper tree would overflow the C stack. */
+		if (node->depth > ROPE_DEPTH) {
+			i++;
+			goto invalid_nodes;
+		}
+	}
+	if (r.p != r.end || literal != literal_end)
+		goto invalid_nodes;
+	retval = nodes[count - 1];
+	Py_INCREF(retval);
+	goto fail;
+
+  invalid_nodes:
+	PyErr_SetString(PyExc_ValueError, "invalid rope data");
+  fail:
+	while (--i >= 0)
+		Py_DECREF(nodes[i]);
+	PyMem_Free(nodes);
+	return retval;
+  invalid:
+	PyErr_SetString(PyExc_ValueError, "invalid rope data");
+	return NULL;
+}
+
+static PyObject *ropes_loads_function = NULL;
+
+static PyObject *
+rope_reduce(RopeObject *self)
+{
+	PyObject *data, *retval;
+
+	data = rope_dumps(self);
+	if (data == NULL)
+		return NULL;
+	retval = Py_BuildValue("(O(N))", ropes_loads_function, data);
+	return retval;
+}
+
+static PyObject *
+ropes_loads(PyObject *module, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "data", "inplace", 0 };
+	PyObject *data, *view;
+	RopeObject *retval;
+	Py_buffer *info;
+	int inplace = 0;
+	const char *buf;
+	Py_ssize_t len;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:loads", kwlist,
+					 &data, &inplace))
+		return NULL;
+	if (PyString_Check(data))
+		return (PyObject *)rope_load(PyString_AS_STRING(data),
+					     PyString_GET_SIZE(data), data);
+	if (!inplace || !PyObject_CheckBuffer(data)) {
+		if (PyObject_AsReadBuffer(data, (const void **)&buf, &len) < 0)
+			return NULL;
+		return (PyObject *)rope_load(buf, len, NULL);
+	}
+
+	/* The leaves keep a memoryview as their base, which holds the
+	 * exporter's buffer for as long as they live, so it can neither
+	 * move nor be freed under them.  Bytes that may still be written
+	 * to are copied all the same: a rope never changes. */
+	view = PyMemoryView_FromObject(data);
+	if (view == NULL)
+		return NULL;
+	info = PyMemoryView_GET_BUFFER(view);
+	if (!PyBuffer_IsContiguous(info, 'C')) {
+		Py_DECREF(view);
+		PyErr_SetString(PyExc_ValueError,
+				"rope data must be contiguous");
+		return NULL;
+	}
+	retval = rope_load(info->buf, info->len,
+			   info->readonly ? view : NULL);
+	Py_DECREF(view);
+	return (PyObject *)retval;
+}
+
+/* Shared memory
+ *
+ * Rope.share(name) writes the dumped form of a rope into a new POSIX
+ * shared memory segment and ropes.attach(name) maps such a segment
+ * read-only and loads it in place.  The dumped form refers to nodes by
+ * index and keeps the literal bytes in a section of their own, so it
+ * needs no fixing up wherever it is mapped.  Each process builds its own
+ * node objects, which are small, while the literal bytes, which are
+ * nearly all of a large rope, exist once per host.
+ *
+ * A RopeSegment owns the mapping.  Every leaf pointing into it holds a
+ * reference to it, so it is only unmapped once the last rope using it has
+ * gone.  The name lives on until unlink() is called, as with any shared
+ * memory object.
+ */
+
+typedef struct RopeSegment {
+	PyObject_HEAD
+	PyObject *name;
+	char *data;
+	Py_ssize_t size;
+} RopeSegment;
+
+static PyTypeObject RopeSegment_Type;
+
+static void
+ropesegment_dealloc(RopeSegment *self)
+{
+	if (self->data)
+		munmap(self->data, self->size);
+	Py_XDECREF(self->name);
+	PyObject_Del(self);
+}
+
+static RopeSegment *
+ropesegment_new(const char *name, char *data, Py_ssize_t size)
+{
+	RopeSegment *self;
+
+	self = PyObject_New(RopeSegment, &RopeSegment_Type);
+	if (self == NULL) {
+		munmap(data, size);
+		return NULL;
+	}
+	self->data = data;
+	self->size = size;
+	self->name = PyString_FromString(name);
+	if (self->name == NULL) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	return self;
+}
+
+static PyObject *
+ropesegment_rope(RopeSegment *self)
+{
+	return (PyObject *) rope_load(self->data, self->size,
+				      (PyObject *) self);
+}
+
+static PyObject *
+ropesegment_unlink(RopeSegment *self)
+{
+	if (shm_unlink(PyString_AS_STRING(self->name)) < 0)
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+					PyString_AS_STRING(self->name));
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+ropesegment_repr(RopeSegment *self)
+{
+	return PyString_FromFormat("<ropes.RopeSegment %s, %zd bytes>",
+				   PyString_AS_STRING(self->name),
+				   self->size);
+}
+
+static PyObject *
+rope_share(RopeObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "name", "mode", 0 };
+	RopeDumpState state;
+	RopeWriter header;
+	RopeSegment *retval = NULL;
+	const char *name;
+	int mode = 0600, fd;
+	Py_ssize_t size;
+	char *data;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|i:share", kwlist,
+					 &name, &mode))
+		return NULL;
+	if (rope_dump_prepare(self, &state, &header) < 0)
+		goto done;
+	size = header.length + state.nodes.length + state.literals.length;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+	if (fd < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *)name);
+		goto done;
+	}
+	data = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    fd, 0);
+	if (data == MAP_FAILED) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *)name);
+		close(fd);
+		shm_unlink(name);
+		goto done;
+	}
+	close(fd);
+
+	Py_BEGIN_ALLOW_THREADS
+	rope_dump_copy(&state, &header, data);
+	mprotect(data, size, PROT_READ);
+	Py_END_ALLOW_THREADS
+	retval = ropesegment_new(name, data, size);
+	if (retval == NULL)
+		shm_unlink(name);
+  done:
+	rope_dump_clear(&state, &header);
+	return (PyObject *) retval;
+}
+
+static PyObject *
+ropes_attach(PyObject *module, PyObject *args)
+{
+	RopeSegment *segment;
+	PyObject *retval;
+	const char *name;
+	struct stat st;
+	char *data;
+	int fd;
+
+	if (!PyArg_ParseTuple(args, "s:attach", &name))
+		return NULL;
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+						      (char *)name);
+	if (fstat(fd, &st) < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *)name);
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size == 0 || st.st_size > PY_SSIZE_T_MAX) {
+		PyErr_SetString(PyExc_ValueError, "invalid rope data");
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+						      (char *)name);
+	segment = ropesegment_new(name, data, st.st_size);
+	if (segment == NULL)
+		return NULL;
+	retval = ropesegment_rope(segment);
+	Py_DECREF(segment);
+	return retval;
+}
+
+static PyMethodDef ropesegment_methods[] = {
+	{"rope", (PyCFunction) ropesegment_rope, METH_NOARGS,
+	 "rope() -> Rope: the rope in the segment, read in place"},
+	{"unlink", (PyCFunction) ropesegment_unlink, METH_NOARGS,
+	 "unlink(): remove the segment's name; mappings stay valid"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyObject *
+ropesegment_get_name(RopeSegment *self, void *closure)
+{
+	Py_INCREF(self->name);
+	return self->name;
+}
+
+static PyObject *
+ropesegment_get_size(RopeSegment *self, void *closure)
+{
+	return PyInt_FromSsize_t(self->size);
+}
+
+static PyGetSetDef ropesegment_getset[] = {
+	{"name", (getter) ropesegment_get_name, NULL,
+	 "the shared memory object's name", NULL},
+	{"size", (getter) ropesegment_get_size, NULL,
+	 "the size of the mapping in bytes", NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(ropesegment_doc,
+"A read-only mapping of a shared memory segment holding a rope\n\n\
+Made by Rope.share(); ropes read from it with rope() or ropes.attach()\n\
+keep it mapped for as long as they are alive.");
+
+static PyTypeObject RopeSegment_Type = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/* ob_size */
+	"ropes.RopeSegment",	/* tp_name */
+	sizeof(RopeSegment),	/* tp_basicsize */
+	0,			/* tp_itemsize */
+	(destructor) ropesegment_dealloc,	/* tp_dealloc */
+	0,			/* tp_print */
+	0,			/* tp_getattr */
+	0,			/* tp_setattr */
+	0,			/* tp_compare */
+	(reprfunc) ropesegment_repr,	/* tp_repr */
+	0,			/* tp_as_number */
+	0,			/* tp_as_sequence */
+	0,			/* tp_as_mapping */
+	0,			/* tp_hash */
+	0,			/* tp_call */
+	0,			/* tp_str */
+	0,			/* tp_getattro */
+	0,			/* tp_setattro */
+	0,			/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,	/* tp_flags */
+	ropesegment_doc,	/* tp_doc */
+	0,			/* tp_traverse */
+	0,			/* tp_clear */
+	0,			/* tp_richcompare */
+	0,			/* tp_weaklistoffset */
+	0,			/* tp_iter */
+	0,			/* tp_iternext */
+	ropesegment_methods,	/* tp_methods */
+	0,			/* tp_members */
+	ropesegment_getset,	/* tp_getset */
+};
+
+/* Multiple pattern search
+ *
+ * A PatternSet is an Aho-Corasick automaton compiled to a dense transition
+ * table, so scanning costs one table lookup per byte however many patterns
+ * there are.  The scan state is a single integer and is simply carried from
+ * one leaf run to the next.
+ */
+
+typedef struct PatternSetObject {
+	PyObject_HEAD
+	Py_ssize_t npatterns;
+	Py_ssize_t nstates;
+	int *delta;		/* nstates * 256 transitions */
+	int *output;		/* pattern ending at a state, or -1 */
+	int *output_link;	/* next state down the fail chain with output */
+	int *same;		/* next pattern with the same text, or -1 */
+	Py_ssize_t *lengths;	/* pattern lengths */
+} PatternSetObject;
+
+typedef struct RopeMatchIter {
+	PyObject_HEAD
+	RopeObject *rope;
+	PatternSetObject *patterns;
+	Py_ssize_t pos;		/* next byte to feed the automaton */
+	int state;
+	int emit_state;		/* state whose outputs are being produced */
+	int emit_pattern;	/* next pattern to report, or -1 */
+} RopeMatchIter;
+
+static PyTypeObject PatternSet_Type;
+static PyTypeObject RopeMatchIter_Type;
+
+#define PatternSet_Check(op) (((PyObject *)(op))->ob_type == &PatternSet_Type)
+
+static void
+patternset_dealloc(PatternSetObject *self)
+{
+	PyMem_Free(self->delta);
+	PyMem_Free(self->output);
+	PyMem_Free(self->output_link);
+	PyMem_Free(self->same);
+	PyMem_Free(self->lengths);
+	self->ob_type->tp_free((PyObject *) self);
+}
+
+static int
+patternset_compile(PatternSetObject *self, PyObject *seq)
+{
+	Py_ssize_t i, j, n, max_states = 1;
+	int state, next, c, *fail = NULL, *queue = NULL, head, tail;
+	PyObject *item;
+	const char *text;
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i < n; i++) {
+		item = PySequence_Fast_GET_ITEM(seq, i);
+		if (!PyString_Check(item)) {
+			PyErr_Format(PyExc_TypeError,
+				     "expected string pattern, not %.50s",
+				     item->ob_type->tp_name);
+			return -1;
+		}
+		if (PyString_GET_SIZE(item) == 0) {
+			PyErr_SetString(PyExc_ValueError, "empty pattern");
+			return -1;
+		}
+		max_states += PyString_GET_SIZE(item);
+		if (max_states > INT_MAX / 256) {
+			PyErr_SetString(PyExc_OverflowError,
+					"patterns are too long");
+			return -1;
+		}
+	}
+
+	self->npatterns = n;
+	self->delta = PyMem_Malloc(max_states * 256 * sizeof(int));
+	self->output = PyMem_Malloc(max_states * sizeof(int));
+	self->output_link = PyMem_Malloc(max_states * sizeof(int));
+	self->same = PyMem_Malloc((n ? n : 1) * sizeof(int));
+	self->lengths = PyMem_Malloc((n ? n : 1) * sizeof(Py_ssize_t));
+	fail = PyMem_Malloc(max_states * sizeof(int));
+	queue = PyMem_Malloc(max_states * sizeof(int));
+	if (!self->delta || !self->output || !self->output_link ||
+	    !self->same || !self->lengths || !fail || !queue) {
+		PyErr_NoMemory();
+		goto error;
+	}
+
+	/* Build the trie; missing edges are -1 for now. */
+	memset(self->delta, -1, 256 * sizeof(int));
+	self->output[0] = -1;
+	self->nstates = 1;
+	for (i = 0; i < n; i++) {
+		item = PySequence_Fast_GET_ITEM(seq, i);
+		text = PyString_AS_STRING(item);
+		self->lengths[i] = PyString_GET_SIZE(item);
+		state = 0;
+		for (j = 0; j < self->lengths[i]; j++) {
+			c = (unsigned char)text[j];
+			next = self->delta[state * 256 + c];
+			if (next < 0) {
+				next = (int)self->nstates++;
+				memset(self->delta + next * 256, -1,
+				       256 * sizeof(int));
+				self->output[next] = -1;
+				self->delta[state * 256 + c] = next;
+			}
+			state = next;
+		}
+		self->same[i] = self->output[state];
+		self->output[state] = (int)i;
+	}
+
+	/* Breadth first, fill in the fail links and turn the trie into a
+	 * complete transition table. */
+	head = tail = 0;
+	fail[0] = 0;
+	self->output_link[0] = -1;
+	queue[tail++] = 0;
+	while (head < tail) {
+		state = queue[head++];
+		for (c = 0; c < 256; c++) {
+			int *edge = &self->delta[state * 256 + c];
+			int fallback = (state == 0 ? 0 :
+					self->delta[fail[state] * 256 + c]);
+			if (*edge < 0) {
+				*edge = fallback;
+				continue;
+			}
+			next = *edge;
+			fail[next] = fallback;
+			self->output_link[next] =
+				(self->output[fallback] >= 0 ? fallback :
+				 self->output_link[fallback]);
+			queue[tail++] = next;
+		}
+	}
+	PyMem_Free(fail);
+	PyMem_Free(queue);
+	return 0;
+  error:
+	PyMem_Free(fail);
+	PyMem_Free(queue);
+	return -1;
+}
+
+static PyObject *
+patternset_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "patterns", 0 };
+	PatternSetObject *self;
+	PyObject *patterns, *seq;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:PatternSet", kwlist,
+					 &patterns))
+		return NULL;
+	seq = PySequence_Fast(patterns, "patterns must be a sequence");
+	if (seq == NULL)
+		return NULL;
+	self = (PatternSetObject *) type->tp_alloc(type, 0);
+	if (self == NULL) {
+		Py_DECREF(seq);
+		return NULL;
+	}
+	if (patternset_compile(self, seq) < 0) {
+		Py_DECREF(seq);
+		Py_DECREF(self);
+		return NULL;
+	}
+	Py_DECREF(seq);
+	return (PyObject *) self;
+}
+
+static Py_ssize_t
+patternset_length(PatternSetObject *self)
+{
+	return self->npatterns;
+}
+
+static PySequenceMethods patternset_as_sequence = {
+	(lenfunc) patternset_length,	/* sq_length */
+};
+
+PyDoc_STRVAR(patternset_doc,
+"PatternSet(patterns)\n\n"
+"A compiled set of strings to search ropes for all at once; see\n"
+"Rope.find_any.");
+
+static PyTypeObject PatternSet_Type = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/* ob_size */
+	"ropes.PatternSet",	/* tp_name */
+	sizeof(PatternSetObject),	/* tp_basicsize */
+	0,			/* tp_itemsize */
+	(destructor) patternset_dealloc,	/* tp_dealloc */
+	0,			/* tp_print */
+	0,			/* tp_getattr */
+	0,			/* tp_setattr */
+	0,			/* tp_compare */
+	0,			/* tp_repr */
+	0,			/* tp_as_number */
+	&patternset_as_sequence,	/* tp_as_sequence */
+	0,			/* tp_as_mapping */
+	0,			/* tp_hash */
+	0,			/* tp_call */
+	0,			/* tp_str */
+	0,			/* tp_getattro */
+	0,			/* tp_setattro */
+	0,			/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,	/* tp_flags */
+	patternset_doc,		/* tp_doc */
+	0,			/* tp_traverse */
+	0,			/* tp_clear */
+	0,			/* tp_richcompare */
+	0,			/* tp_weaklistoffset */
+	0,			/* tp_iter */
+	0,			/* tp_iternext */
+	0,			/* tp_methods */
+	0,			/* tp_members */
+	0,			/* tp_getset */
+	0,			/* tp_base */
+	0,			/* tp_dict */
+	0,			/* tp_descr_get */
+	0,			/* tp_descr_set */
+	0,			/* tp_dictoffset */
+	0,			/* tp_init */
+	PyType_GenericAlloc,	/* tp_alloc */
+	patternset_new,		/* tp_new */
+	0,			/* tp_free */
+};
+
+static void
+ropematchiter_dealloc(RopeMatchIter *self)
+{
+	Py_DECREF(self->rope);
+	Py_DECREF(self->patterns);
+	PyObject_Del(self);
+}
+
+static PyObject *
+ropematchiter_next(RopeMatchIter *self)
+{
+	PatternSetObject *ps = self->patterns;
+	const int *delta = ps->delta;
+	Py_ssize_t before, after, k;
+	const unsigned char *run, *p, *end;
+	int state;
+
+	for (;;) {
+		if (self->emit_pattern >= 0) {
+			k = self->emit_pattern;
+			self->emit_pattern = ps->same[k];
+			if (self->emit_pattern < 0) {
+				self->emit_state =
+					ps->output_link[self->emit_state];
+				if (self->emit_state >= 0)
+					self->emit_pattern =
+						ps->output[self->emit_state];
+			}
+			return Py_BuildValue("(nn)", self->pos - ps->lengths[k],
+					     k);
+		}
+		if (self->pos >= self->rope->length)
+			return NULL;
+
+		run = (const unsigned char *) rope_chunk(self->rope, self->pos,
+							 &before, &after);
+		if (run == NULL)
+			return NULL;
+		state = self->state;
+		for (p = run, end = run + after; p < end; ) {
+			state = delta[state * 256 + *p++];
+			if (ps->output[state] >= 0 ||
+			    ps->output_link[state] >= 0)
+				break;
+		}
+		self->pos += p - run;
+		self->state = state;
+		if (ps->output[state] >= 0 || ps->output_link[state] >= 0) {
+			self->emit_state = (ps->output[state] >= 0 ? state :
+					    ps->output_link[state]);
+			self->emit_pattern = ps->output[self->emit_state];
+		}
+	}
+}
+
+PyDoc_STRVAR(ropematchiter_doc, "Rope Match Iterator");
+
+static PyTypeObject RopeMatchIter_Type = {
+	PyObject_HEAD_INIT(0)
+	0,			/* ob_size */
+	"ropes.RopeMatchIter",	/* tp_name */
+	sizeof(RopeMatchIter),	/* tp_basicsize */
+	0,			/* tp_itemsize */
+	(destructor) ropematchiter_dealloc,	/* tp_dealloc */
+	0,			/* tp_print */
+	0,			/* tp_getattr */
+	0,			/* tp_setattr */
+	0,			/* tp_compare */
+	0,			/* tp_repr */
+	0,			/* tp_as_number */
+	0,			/* tp_as_sequence */
+	0,			/* tp_as_mapping */
+	0,			/* tp_hash */
+	0,			/* tp_call */
+	0,			/* tp_str */
+	0,			/* tp_getattro */
+	0,			/* tp_setattro */
+	0,			/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,	/* tp_flags */
+	ropematchiter_doc,	/* tp_doc */
+	0,			/* tp_traverse */
+	0,			/* tp_clear */
+	0,			/* tp_richcompare */
+	0,			/* tp_weaklistoffset */
+	(getiterfunc) PyObject_SelfIter,	/* tp_iter */
+	(iternextfunc) ropematchiter_next,	/* tp_iternext */
+	0,			/* tp_methods */
+	0,			/* tp_members */
+	0,			/* tp_getset */
+	0,			/* tp_base */
+	0,			/* tp_dict */
+	0,			/* tp_descr_get */
+	0,			/* tp_descr_set */
+	0,			/* tp_dictoffset */
+	0,			/* tp_init */
+	PyType_GenericAlloc,	/* tp_alloc */
+	0,			/* tp_new */
+};
+
+static PyObject *
+rope_find_any(RopeObject *self, PyObject *patterns)
+{
+	RopeMatchIter *retval;
+
+	if (PatternSet_Check(patterns)) {
+		Py_INCREF(patterns);
+	}
+	else {
+		patterns = PyObject_CallFunctionObjArgs(
+			(PyObject *) &PatternSet_Type, patterns, NULL);
+		if (patterns == NULL)
+			return NULL;
+	}
+	retval = PyObject_New(RopeMatchIter, &RopeMatchIter_Type);
+	if (retval == NULL) {
+		Py_DECREF(patterns);
+		return NULL;
+	}
+	Py_INCREF(self);
+	retval->rope = self;
+	retval->patterns = (PatternSetObject *) patterns;
+	retval->pos = 0;
+	retval->state = 0;
+	retval->emit_state = -1;
+	retval->emit_pattern = -1;
+	return (PyObject *) retval;
+}
+
+static PySequenceMethods rope_as_sequence = {
+	(lenfunc) rope_length,		/* sq_length */
+	(binaryfunc) rope_sq_concat,	/* sq_concat */
+	(ssizeargfunc) rope_repeat,	/* sq_repeat */
+	(ssizeargfunc) rope_getitem,	/* sq_item */
+	0,				/* sq_slice */
+	0,				/* sq_ass_item */
+	0,				/* sq_ass_slice */
+	(objobjproc) rope_contains,	/* sq_contains */
+	(binaryfunc) rope_inplace_concat,	/* sq_inplace_concat */
+	0,				/* sq_inplace_repeat */
+};
+
+/* Buffer protocol
+ *
+ * A rope hands out the address of bytes that stay put for as long as it
+ * lives: a single leaf its own (which are then never compressed), any
+ * other rope a flat copy made once and pinned to the node.  So hashlib,
+ * zlib, memoryview or socket.send() read it without a str() of their own,
+ * and the old-style protocol, which has no release, is as safe as the
+ * new one.
+ */
+
+/* Return the exported bytes of self, or NULL with an exception set. */
+static const char *
+rope_export(RopeObject *self)
+{
+	PyObject *str;
+	char *p;
+
+	if (self->length == 0)
+		return "";
+	if (self->type == LITERAL_NODE)
+		return rope_literal_pin(self);
+	if (self->flat == NULL) {
+		str = PyString_FromStringAndSize(NULL, self->length);
+		if (str == NULL)
+			return NULL;
+		p = PyString_AS_STRING(str);
+		if (_rope_str(self, &p) < 0 ||
+		    rope_flat_attach(self, str, PyString_AS_STRING(str), 1) < 0) {
+			Py_DECREF(str);
+			return NULL;
+		}
+	}
+	rope_flat_pin(self);
+	return self->flat->bytes;
+}
+
+static Py_ssize_t
+rope_getreadbuf(RopeObject *self, Py_ssize_t index, const void **ptr)
+{
+	if (index != 0) {
+		PyErr_SetString(PyExc_SystemError,
+				"accessing non-existent rope segment");
+		return -1;
+	}
+	*ptr = rope_export(self);
+	if (*ptr == NULL)
+		return -1;
+	return self->length;
+}
+
+static Py_ssize_t
+rope_getsegcount(RopeObject *self, Py_ssize_t *lenp)
+{
+	if (lenp)
+		*lenp = self->length;
+	return 1;
+}
+
+static int
+rope_getbuffer(RopeObject *self, Py_buffer *view, int flags)
+{
+	const char *bytes = rope_export(self);
+
+	if (bytes == NULL)
+		return -1;
+	return PyBuffer_FillInfo(view, (PyObject *) self, (void *) bytes,
+				 self->length, 1, flags);
+}
+
+static PyBufferProcs rope_as_buffer = {
+	(readbufferproc) rope_getreadbuf,	/* bf_getreadbuffer */
+	0,					/* bf_getwritebuffer */
+	(segcountproc) rope_getsegcount,	/* bf_getsegcount */
+	(charbufferproc) rope_getreadbuf,	/* bf_getcharbuffer */
+	(getbufferproc) rope_getbuffer,		/* bf_getbuffer */
+	0,					/* bf_releasebuffer */
+};
+
+static PyMappingMethods rope_as_mapping = {
+	(lenfunc) rope_length,		/* mp_length */
+	(binaryfunc) rope_subscript,	/* mp_subscript */
+	0,				/* mp_ass_subscript */
+};
+
+/* XXX More documentation */
+PyDoc_STRVAR(rope_doc, "Rope type");
+
+#if DEBUG
+static PyObject *
+rope_balance_method(PyObject * self, PyObject * args, PyObject * kwds)
+{
+	RopeObject* retval = rope_balance((RopeObject *) self);
+	return (PyObject *) retval;
+}
+#endif
+
+static PyObject *
+rope_compress(RopeObject *self)
+{
+	if (rope_compress_leaves(self) < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef RopeMethods[] = {
+#if DEBUG
+	{"balance", (PyCFunction) rope_balance_method, METH_VARARGS, "Balance the rope"},
+#endif
+	{"compress", (PyCFunction) rope_compress, METH_NOARGS,
+	 "Compress the rope's eligible leaves now (see set_compression)"},
+	{"upper", (PyCFunction) rope_upper, METH_NOARGS,
+	 "Return a copy of the rope converted to uppercase"},
+	{"lower", (PyCFunction) rope_lower, METH_NOARGS,
+	 "Return a copy of the rope converted to lowercase"},
+	{"translate", (PyCFunction) rope_translate_method, METH_O,
+	 "translate(table) -> Rope\n\n"
+	 "Return a copy of the rope with each byte mapped through table,\n"
+	 "which must be a string of length 256.  The result is computed\n"
+	 "lazily, a block at a time, as it is read."},
+	{"find_any", (PyCFunction) rope_find_any, METH_O,
+	 "find_any(patterns) -> iterator of (offset, pattern_index)\n\n"
+	 "Search for every occurrence of any of the given strings in a single\n"
+	 "pass.  patterns is a PatternSet or a sequence of strings; matches\n"
+	 "are produced in order of where they end."},
+	{"common_prefix_length", (PyCFunction) rope_common_prefix_length,
+	 METH_O, "Return the length of the prefix shared with another rope"},
+	{"common_suffix_length", (PyCFunction) rope_common_suffix_length,
+	 METH_O, "Return the length of the suffix shared with another rope"},
+	{"diff", (PyCFunction) rope_diff, METH_O,
+	 "diff(other) -> list of (start, stop, other_start, other_stop)\n\n"
+	 "Return the ranges where the rope and other differ, in order.\n"
+	 "Subtrees the two ropes share are skipped without being read and\n"
+	 "are used to line the two up."},
+	{"startswith", (PyCFunction) rope_startswith, METH_VARARGS,
+	 "startswith(prefix[, start[, end]]) -> bool\n\n"
+	 "Like str.startswith; prefix may be a string, a rope or a tuple of\n"
+	 "them.  Only the bytes compared are read."},
+	{"endswith", (PyCFunction) rope_endswith, METH_VARARGS,
+	 "endswith(suffix[, start[, end]]) -> bool\n\n"
+	 "Like str.endswith; suffix may be a string, a rope or a tuple of\n"
+	 "them.  Only the bytes compared are read."},
+	{"lstrip", (PyCFunction) rope_lstrip, METH_VARARGS,
+	 "lstrip([chars]) -> Rope\n\n"
+	 "Like str.lstrip, but the result shares the rope's nodes."},
+	{"rstrip", (PyCFunction) rope_rstrip, METH_VARARGS,
+	 "rstrip([chars]) -> Rope\n\n"
+	 "Like str.rstrip, but the result shares the rope's nodes."},
+	{"strip", (PyCFunction) rope_strip, METH_VARARGS,
+	 "strip([chars]) -> Rope\n\n"
+	 "Like str.strip, but the result shares the rope's nodes."},
+	{"take", (PyCFunction) rope_take, METH_O,
+	 "take(indices) -> str\n\n"
+	 "Return the bytes at the given offsets, in the order given.  indices\n"
+	 "is a sequence of integers or a buffer of native integers; the\n"
+	 "lookups are made together in one walk of the rope."},
+	{"extract", (PyCFunction) rope_extract, METH_O,
+	 "extract(ranges) -> list of str\n\n"
+	 "Return rope[start:stop] as a string for each (start, stop) pair,\n"
+	 "copied out together in one walk of the rope."},
+	{"count", (PyCFunction) rope_count, METH_VARARGS,
+	 "count(char[, start[, end]]) -> int\n\n"
+	 "Count the occurrences of a single character.  Each node remembers\n"
+	 "its count for the last character asked about."},
+	{"edit", (PyCFunction) rope_edit, METH_VARARGS | METH_KEYWORDS,
+	 "edit(leaf_length=None, balance_depth=None) -> RopeEditor\n\n"
+	 "Collect a batch of insertions, deletions and replacements and\n"
+	 "apply them together, rebalancing once (see RopeEditor).  The\n"
+	 "result is shaped by the module policy (see set_policy) unless\n"
+	 "leaf_length or balance_depth are given."},
+	{"__reversed__", (PyCFunction) rope_reversed, METH_NOARGS,
+	 "Iterate over the characters from the end"},
+	{"rchunks", (PyCFunction) rope_rchunks, METH_NOARGS,
+	 "Iterate over the contiguous runs of the rope from the end"},
+	{"read_from", (PyCFunction) rope_read_from,
+	 METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+	 "Rope.read_from(source, size=-1, leaf_length=None) -> Rope\n\n"
+	 "Read size bytes, or up to the end, from source: a file descriptor\n"
+	 "(a pipe or socket, say) or a file-like object.  The data is read\n"
+	 "straight into the rope's leaves, which are assembled into a\n"
+	 "balanced rope as they fill, so the only copy is the read itself.\n"
+	 "The GIL is released while a file descriptor is read."},
+	{"dumps", (PyCFunction) rope_dumps, METH_NOARGS,
+	 "Return the rope in its compact binary form (see ropes.loads)"},
+	{"__reduce__", (PyCFunction) rope_reduce, METH_NOARGS,
+	 "Support for pickle"},
+	{"share", (PyCFunction) rope_share, METH_VARARGS | METH_KEYWORDS,
+	 "share(name, mode=0600) -> RopeSegment\n\n"
+	 "Write the rope into a new POSIX shared memory segment called name,\n"
+	 "from which other processes can load it with ropes.attach(name).\n"
+	 "They read its bytes in place, so there is one copy of them however\n"
+	 "many processes attach."},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyMethodDef ropes_methods[] = {
+	{"loads", (PyCFunction) ropes_loads, METH_VARARGS | METH_KEYWORDS,
+	 "loads(data, inplace=False) -> Rope\n\n"
+	 "Rebuild a rope from the output of Rope.dumps().  Literals of a str\n"
+	 "argument are used in place.  Other objects are copied, unless\n"
+	 "inplace is true and they export a read-only buffer, which is then\n"
+	 "held for as long as the rope is alive."},
+	{"attach", (PyCFunction) ropes_attach, METH_VARARGS,
+	 "attach(name) -> Rope\n\n"
+	 "Map the shared memory segment written by Rope.share(name) read-only\n"
+	 "and load the rope in it in place.  The mapping stays until the\n"
+	 "rope, and every rope sharing its leaves, has gone."},
+	{"set_interning", (PyCFunction) ropes_set_interning,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "set_interning(enabled, max_bytes=None)\n\n"
+	 "Turn sharing of identical literals made by Rope(string) on or off,\n"
+	 "optionally changing the cap on the number of interned bytes."},
+	{"intern_stats", (PyCFunction) ropes_intern_stats, METH_NOARGS,
+	 "Return a dict describing the literal intern table"},
+	{"set_compression", (PyCFunction) ropes_set_compression,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "set_compression(enabled, hot_bytes=None, min_leaf=None)\n\n"
+	 "Turn compression of cold leaves on or off.  While it is on, leaves\n"
+	 "of at least min_leaf bytes are compressed with zlib once more than\n"
+	 "hot_bytes of them have been read more recently, and decompressed\n"
+	 "again when next read."},
+	{"set_flat_cache", (PyCFunction) ropes_set_flat_cache,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "set_flat_cache(max_bytes)\n\n"
+	 "Keep the strings made by str() of ropes that are not single leaves,\n"
+	 "up to max_bytes of them, dropping the least recently used first.\n"
+	 "str() of such a rope then returns the same string again, and reads\n"
+	 "through it use the flat copy.  0 (the default) turns the cache off."},
+	{"set_policy", (PyCFunction) ropes_set_policy,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "set_policy(leaf_length=None, balance_depth=None, adaptive=None)\n\n"
+	 "Change how ropes are shaped as they are built.  Rebalancing merges\n"
+	 "short literals into leaves of up to leaf_length bytes (1024 by\n"
+	 "default; small suits editing, 64KB and up suits scanning), and a\n"
+	 "concatenation deeper than balance_depth (32) is rebalanced.  With\n"
+	 "adaptive true both are retuned from the mix of edits and scans\n"
+	 "seen.  Arguments left out keep their current values."},
+	{"policy", (PyCFunction) ropes_policy, METH_NOARGS,
+	 "Return a dict describing the current shape policy"},
+	{"flat_cache_stats", (PyCFunction) ropes_flat_cache_stats,
+	 METH_NOARGS,
+	 "Return a dict describing the flatten cache"},
+	{"compression_stats", (PyCFunction) ropes_compression_stats,
+	 METH_NOARGS,
+	 "Return a dict of leaf compression counters; saved_bytes is what\n"
+	 "the cold leaves save, compressed copies included."},
+	{NULL, NULL, 0, NULL}
+};
 
 static PyTypeObject Rope_Type = {
 	PyObject_HEAD_INIT(NULL)
@@ -1110,20 +4712,17 @@ static PyTypeObject Rope_Type = {
 	(reprfunc) rope_str,	/* tp_str */
 	PyObject_GenericGetAttr,/* tp_getattro */
 	0,			/* tp_setattro */
-	0,			/* tp_as_buffer */
-	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,	/* tp_flags */
+	&rope_as_buffer,	/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC |
+		Py_TPFLAGS_HAVE_NEWBUFFER,	/* tp_flags */
 	rope_doc,		/* tp_doc */
 	(traverseproc) rope_traverse,	/* tp_traverse */
 	0,			/* tp_clear */
-	0,			/* tp_richcompare */
+	rope_richcompare,	/* tp_richcompare */
 	0,			/* tp_weaklistoffset */
 	(getiterfunc) rope_iter,		/* tp_iter */
 	0,			/* tp_iternext */
-#if DEBUG
 	RopeMethods,		/* tp_methods */
-#else
-	0,			/* tp_methods */
-#endif
 	0,			/* tp_members */
 	0,			/* tp_getset */
 	0,			/* tp_base */
@@ -1137,22 +4736,197 @@ static PyTypeObject Rope_Type = {
 	0,			/* tp_free */
 };
 
+/* C API (see ropes.h) */
+
+static RopeObject *
+capi_check(PyObject *rope)
+{
+	if (rope == NULL || !Rope_Check(rope)) {
+		PyErr_SetString(PyExc_TypeError, "expected a Rope");
+		return NULL;
+	}
+	return (RopeObject *) rope;
+}
+
+static void
+capi_clip(RopeObject *self, Py_ssize_t *start, Py_ssize_t *stop)
+{
+	if (*start < 0)
+		*start = 0;
+	if (*stop > self->length)
+		*stop = self->length;
+	if (*stop < *start)
+		*stop = *start;
+}
+
+static PyObject *
+capi_from_buffer(const char *data, Py_ssize_t len)
+{
+	return (PyObject *) rope_from_string(data, len);
+}
+
+static PyObject *
+capi_concat(PyObject *left, PyObject *right)
+{
+	if (!capi_check(left) || !capi_check(right))
+		return NULL;
+	return (PyObject *) rope_concat((RopeObject *) left,
+					(RopeObject *) right);
+}
+
+static PyObject *
+capi_slice(PyObject *rope, Py_ssize_t start, Py_ssize_t stop)
+{
+	if (!capi_check(rope))
+		return NULL;
+	return (PyObject *) rope_slice((RopeObject *) rope, start, stop);
+}
+
+static Py_ssize_t
+capi_length(PyObject *rope)
+{
+	if (!capi_check(rope))
+		return -1;
+	return ((RopeObject *) rope)->length;
+}
+
+static long
+capi_hash(PyObject *rope)
+{
+	if (!capi_check(rope))
+		return -1;
+	return rope_hash((RopeObject *) rope);
+}
+
+static int
+capi_for_each_chunk(PyObject *rope, Py_ssize_t start, Py_ssize_t stop,
+		    Ropes_ChunkFunc func, void *arg)
+{
+	RopeObject *self = capi_check(rope);
+	Py_ssize_t before, after;
+	const char *run;
+	int status;
+
+	if (self == NULL)
+		return -1;
+	capi_clip(self, &start, &stop);
+	while (start < stop) {
+		run = rope_chunk(self, start, &before, &after);
+		if (run == NULL)
+			return -1;
+		if (after > stop - start)
+			after = stop - start;
+		status = func(run, after, arg);
+		if (status != 0)
+			return status;
+		start += after;
+	}
+	return 0;
+}
+
+static Py_ssize_t
+capi_copy(PyObject *rope, Py_ssize_t start, Py_ssize_t stop, char *dst)
+{
+	RopeObject *self = capi_check(rope);
+	char *p = dst;
+
+	if (self == NULL)
+		return -1;
+	capi_clip(self, &start, &stop);
+	if (_rope_str_range(self, start, stop - start, &p) < 0)
+		return -1;
+	return p - dst;
+}
+
+static int
+capi_cursor_init(Ropes_Cursor *cursor, PyObject *rope, Py_ssize_t pos)
+{
+	if (!capi_check(rope))
+		return -1;
+	if (pos < 0 || pos > ((RopeObject *) rope)->length) {
+		PyErr_SetString(PyExc_IndexError, "rope index out of range");
+		return -1;
+	}
+	cursor->rope = rope;
+	cursor->pos = pos;
+	return 0;
+}
+
+static Py_ssize_t
+capi_cursor_next(Ropes_Cursor *cursor, const char **data)
+{
+	RopeObject *self = (RopeObject *) cursor->rope;
+	Py_ssize_t before, after;
+
+	if (cursor->pos >= self->length)
+		return 0;
+	*data = rope_chunk(self, cursor->pos, &before, &after);
+	if (*data == NULL)
+		return -1;
+	cursor->pos += after;
+	return after;
+}
+
+static Ropes_CAPI ropes_capi = {
+	ROPES_CAPI_VERSION,
+	&Rope_Type,
+	capi_from_buffer,
+	capi_concat,
+	capi_slice,
+	capi_length,
+	capi_hash,
+	capi_for_each_chunk,
+	capi_copy,
+	capi_cursor_init,
+	capi_cursor_next,
+};
+
 PyMODINIT_FUNC
 initropes(void)
 {
-	PyObject *m;
+	PyObject *m, *capi;
 
 	if (PyType_Ready(&Rope_Type) < 0)
 		return;
 	if (PyType_Ready(&RopeIter_Type) < 0)
 		return;
+	if (PyType_Ready(&RopeReverseIter_Type) < 0)
+		return;
+	if (PyType_Ready(&PatternSet_Type) < 0)
+		return;
+	if (PyType_Ready(&RopeTailBuffer_Type) < 0)
+		return;
+	if (PyType_Ready(&RopeMatchIter_Type) < 0)
+		return;
+	if (PyType_Ready(&RopeEditor_Type) < 0)
+		return;
+	if (PyType_Ready(&RopeIO_Type) < 0)
+		return;
+	if (PyType_Ready(&RopeSegment_Type) < 0)
+		return;
 
-	m = Py_InitModule3("ropes", NULL, ropes_module_doc);
+	m = Py_InitModule3("ropes", ropes_methods, ropes_module_doc);
+	if (m == NULL)
+		return;
+	ropes_loads_function = PyObject_GetAttrString(m, "loads");
+	if (ropes_loads_function == NULL)
+		return;
 	if (DEBUG) {
 		PyModule_AddIntConstant(m, "CONCAT_NODE", CONCAT_NODE);
 		PyModule_AddIntConstant(m, "REPEAT_NODE", REPEAT_NODE);
 		PyModule_AddIntConstant(m, "LITERAL_NODE", LITERAL_NODE);
+		PyModule_AddIntConstant(m, "SUBSTRING_NODE", SUBSTRING_NODE);
+		PyModule_AddIntConstant(m, "TRANSFORM_NODE", TRANSFORM_NODE);
 	}
 	Py_INCREF(&Rope_Type);
 	PyModule_AddObject(m, "Rope", (PyObject *) & Rope_Type);
+	Py_INCREF(&PatternSet_Type);
+	PyModule_AddObject(m, "PatternSet", (PyObject *) & PatternSet_Type);
+	Py_INCREF(&RopeIO_Type);
+	PyModule_AddObject(m, "RopeIO", (PyObject *) & RopeIO_Type);
+	Py_INCREF(&RopeSegment_Type);
+	PyModule_AddObject(m, "RopeSegment", (PyObject *) & RopeSegment_Type);
+	capi = PyCapsule_New(&ropes_capi, ROPES_CAPSULE_NAME, NULL);
+	if (capi != NULL)
+		PyModule_AddObject(m, "_C_API", capi);
 }
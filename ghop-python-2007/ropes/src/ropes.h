@@ -0,0 +1,113 @@
+/*
+ * ropes.h
+ * This file is part of CRopes: A Ropes data type for CPython
+ *
+ * Copyright (C) 2007 - Travis Athougies
+ *
+ * CRopes: A Ropes data type for CPython is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * CRopes: A Ropes data type for CPython is distributed in the hope
+ * that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CRopes: A Ropes data type for CPython; if not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ */
+
+/* C API for other extension modules.
+ *
+ * The ropes module publishes a table of functions as the capsule
+ * "ropes._C_API".  Call Ropes_Import() once (from your module's init
+ * function) and then go through Ropes_API:
+ *
+ *	if (Ropes_Import() < 0)
+ *		return;
+ *	rope = Ropes_API->FromBuffer(data, len);
+ *
+ * New entries are only ever added at the end of Ropes_CAPI, and version
+ * is bumped when that happens, so code built against an older header
+ * keeps working.
+ *
+ * All functions follow the usual CPython conventions: they return NULL
+ * or -1 with an exception set on failure, and functions returning
+ * PyObject * return new references.  Byte pointers handed out by
+ * ForEachChunk and the cursor functions stay valid only until the next
+ * call into the ropes module.
+ */
+
+#ifndef ROPES_H
+#define ROPES_H
+
+#include "Python.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ROPES_CAPSULE_NAME "ropes._C_API"
+#define ROPES_CAPI_VERSION 1
+
+/* Called for each contiguous run of bytes; return 0 to continue, 1 to
+ * stop early or -1 (with an exception set) to fail. */
+typedef int (*Ropes_ChunkFunc)(const char *data, Py_ssize_t len, void *arg);
+
+typedef struct Ropes_Cursor {
+	PyObject *rope;		/* borrowed; keep the rope alive yourself */
+	Py_ssize_t pos;		/* next byte to be returned */
+} Ropes_Cursor;
+
+typedef struct Ropes_CAPI {
+	int version;
+	PyTypeObject *RopeType;
+
+	/* Construction */
+	PyObject *(*FromBuffer)(const char *data, Py_ssize_t len);
+	PyObject *(*Concat)(PyObject *left, PyObject *right);
+	PyObject *(*Slice)(PyObject *rope, Py_ssize_t start, Py_ssize_t stop);
+
+	/* Queries */
+	Py_ssize_t (*Length)(PyObject *rope);
+	long (*Hash)(PyObject *rope);
+
+	/* Reading.  ForEachChunk returns 0 when it ran to the end, or what
+	 * the callback returned if that was not 0.  Copy writes
+	 * rope[start:stop] to dst and returns the number of bytes written. */
+	int (*ForEachChunk)(PyObject *rope, Py_ssize_t start, Py_ssize_t stop,
+			    Ropes_ChunkFunc func, void *arg);
+	Py_ssize_t (*Copy)(PyObject *rope, Py_ssize_t start, Py_ssize_t stop,
+			   char *dst);
+
+	/* Cursors.  CursorNext sets *data to the next run of bytes and
+	 * returns its length, or 0 at the end of the rope. */
+	int (*CursorInit)(Ropes_Cursor *cursor, PyObject *rope,
+			  Py_ssize_t pos);
+	Py_ssize_t (*CursorNext)(Ropes_Cursor *cursor, const char **data);
+} Ropes_CAPI;
+
+#define Ropes_Check(op) (Ropes_API && \
+	PyObject_TypeCheck((op), Ropes_API->RopeType))
+
+#ifndef ROPES_MODULE
+
+static Ropes_CAPI *Ropes_API = NULL;
+
+static int
+Ropes_Import(void)
+{
+	Ropes_API = (Ropes_CAPI *) PyCapsule_Import(ROPES_CAPSULE_NAME, 0);
+	return Ropes_API ? 0 : -1;
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ROPES_H */
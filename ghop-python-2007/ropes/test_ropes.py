@@ -2,6 +2,16 @@
 import unittest
 import ropes
 import random
+import pickle
+import csv
+import hashlib
+import zlib
+import os
+import resource
+import io
+import StringIO
+import ctypes
+import time
 #from test import test_support, string_tests
 
 #TODO: Make these unit tests more torturous
@@ -25,20 +35,82 @@ class TestRopes(unittest.TestCase):
         r1+=r2
         self.assertEqual(str(r1),para1+para2+para3+para4+para5);
 
-#    def testBalance(self):
-#        r1=ropes.Rope()
-#        r1+=ropes.Rope(para1)
-#        r1+=ropes.Rope(para2)
-#        r1+=ropes.Rope(para3)
-#        r1+=ropes.Rope(para4)
-#        r1+=ropes.Rope(para5)
-#        r1.balance()
-#        self.assertEqual(str(r1),para1+para2+para3+para4+para5);
+    def testBalance(self):
+        r1=ropes.Rope()
+        r1+=ropes.Rope(para1)
+        r1+=ropes.Rope(para2)
+        r1+=ropes.Rope(para3)
+        r1+=ropes.Rope(para4)
+        r1+=ropes.Rope(para5)
+        r1=r1.balance()
+        self.assertEqual(str(r1),para1+para2+para3+para4+para5);
+
+    def testInplaceAppend(self):
+        r1=ropes.Rope()
+        saved=[]
+        for i in range(2000):
+            r1+=ropes.Rope(str(i))
+            if i % 100 == 0:
+                saved.append((r1, ''.join([str(j) for j in range(i+1)])))
+        self.assertEqual(str(r1), ''.join([str(i) for i in range(2000)]))
+        for r2, s2 in saved:
+            self.assertEqual(str(r2), s2)
+        r2=saved[3][0]
+        r2+=ropes.Rope('branch')
+        self.assertEqual(str(r2), saved[3][1]+'branch')
+        self.assertEqual(str(saved[3][0]), saved[3][1])
+        self.assertEqual(str(saved[4][0]), saved[4][1])
+
+    def testInplaceAppendKeepsRoot(self):
+        # += on a rope nothing else holds updates it where it is: once
+        # its last leaf has room to grow, the root, and its spine with
+        # it, is never replaced
+        r1=ropes.Rope('x')
+        r1+=ropes.Rope('-')
+        root=id(r1)
+        for i in range(2000):
+            r1+=ropes.Rope(str(i))
+            self.assertEqual(id(r1), root)
+        self.assertEqual(str(r1), 'x-'+''.join([str(i) for i in range(2000)]))
+        r1=ropes.Rope('a'*100000)+ropes.Rope('b')
+        root=id(r1)
+        for i in range(500):
+            r1+=ropes.Rope('cd')
+            self.assertEqual(id(r1), root)
+        self.assertEqual(str(r1), 'a'*100000+'b'+'cd'*500)
+        def closure():
+            return r3
+        r3=ropes.Rope('y')
+        r3+=ropes.Rope('z')
+        root=id(r3)
+        for i in range(100):
+            r3+=ropes.Rope('z')
+        self.assertEqual(id(closure()), root)
+        self.assertEqual(str(closure()), 'y'+'z'*101)
+        # a second name still sees the old value
+        r2=r1
+        r1+=ropes.Rope('e')
+        self.assertNotEqual(id(r1), root)
+        self.assertEqual(str(r2), 'a'*100000+'b'+'cd'*500)
 
     def testRepetition(self):
         r1=ropes.Rope('hello')
         r1*=100
         self.assertEqual(str(r1),'hello'*100)
+        self.assertEqual(str(r1*0), '')
+        self.assertEqual(str(r1*-3), '')
+        self.assertEqual(str(r1[3:2000]), ('hello'*100)[3:2000])
+        # repeats of repeats, slices of whole copies and single
+        # characters all stay one node over a short leaf
+        big=ropes.Rope('ab')*3*1000*1000000
+        self.assertEqual(len(big), 6*10**9)
+        self.assert_(len(big.dumps()) < 32)
+        self.assert_(len((big*1000).dumps()) < 32)
+        self.assert_(len(big[2:6*10**8].dumps()) < 32)
+        self.assertEqual(str(big[5*10**9+3:5*10**9+5]), 'ba')
+        fill=ropes.Rope('xyz')[1:2]*5000
+        self.assertEqual(str(fill), 'y'*5000)
+        self.assertEqual(str(ropes.Rope('-')*100000), '-'*100000)
 
     def testLength(self):
         r1=ropes.Rope('hell')
@@ -59,6 +131,468 @@ class TestRopes(unittest.TestCase):
         end=random.randint(start+1, len(r1))
         self.assertEqual(str(r1[start:end]), s1[start:end])
 
+    def testSubstrings(self):
+        r1=ropes.Rope(para1)+ropes.Rope(para2)*50+ropes.Rope(para3)
+        s1=para1+para2*50+para3
+        for i in range(100):
+            start=random.randint(0, len(r1))
+            end=random.randint(start, len(r1))
+            r2=r1[start:end]
+            s2=s1[start:end]
+            self.assertEqual(str(r2), s2)
+            start=random.randint(0, len(r2))
+            end=random.randint(start, len(r2))
+            self.assertEqual(str(r2[start:end]), s2[start:end])
+            if s2:
+                self.assertEqual(r2[-1], s2[-1])
+        self.assertEqual(str(r1[len(r1):]), '')
+
+    def testIterSlices(self):
+        r1=(ropes.Rope(para1)+ropes.Rope(para2)*50).upper()
+        s1=(para1+para2*50).upper()
+        self.assertEqual(''.join(r1[7:-3]), s1[7:-3])
+        self.assert_(ropes.Rope(s1[150:155]) in r1[100:])
+        self.assertEqual(cmp(r1[1:20], ropes.Rope(s1[1:20])), 0)
+        # a slice of a 128MB rope is iterated without flattening it
+        r2=(ropes.Rope('abcdefgh')*(1<<24))[1:]
+        rss=resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        it=iter(r2)
+        self.assertEqual([it.next() for i in range(10)], list('bcdefghabc'))
+        self.assertEqual(next(iter(r2.upper()[4:])), 'F')
+        self.assert_(resource.getrusage(resource.RUSAGE_SELF).ru_maxrss -
+                     rss < 32 * 1024)
+
+    def testExtendedSlicing(self):
+        r1=ropes.Rope(para2)+ropes.Rope(para3)*3+ropes.Rope(para4)[10:-10]
+        s1=para2+para3*3+para4[10:-10]
+        for step in (-1000, -7, -2, -1, 2, 3, 1000):
+            self.assertEqual(str(r1[::step]), s1[::step])
+            self.assertEqual(str(r1[100:-100:step]), s1[100:-100:step])
+            self.assertEqual(str(r1[-100:100:step]), s1[-100:100:step])
+
+    def testReversed(self):
+        r1=ropes.Rope(para2)+ropes.Rope(para3)*3
+        s1=para2+para3*3
+        self.assertEqual(''.join(reversed(r1)), s1[::-1])
+        chunks=list(r1.rchunks())
+        chunks.reverse()
+        self.assertEqual(''.join(chunks), s1)
+
+    def testTransforms(self):
+        r1=ropes.Rope(para2)+ropes.Rope(para3.upper())*3
+        s1=para2+para3.upper()*3
+        self.assertEqual(str(r1.upper()), s1.upper())
+        self.assertEqual(str(r1.lower()), s1.lower())
+        self.assertEqual(str(r1.lower()[100:-100]), s1.lower()[100:-100])
+        self.assertEqual(r1.lower()[-1], s1.lower()[-1])
+        table=''.join([chr(255-i) for i in range(256)])
+        r2=r1.upper().translate(table)
+        self.assertEqual(r2[:10].translate(table)[:10], r1.upper()[:10])
+        self.assertEqual(str(r2), s1.upper().translate(table))
+        self.assertEqual(''.join(reversed(r2)), s1.upper().translate(table)[::-1])
+        self.assertRaises(ValueError, r1.translate, 'abc')
+
+    def testFindAny(self):
+        patterns=['ipsum', 'Proin', 'in', 'n', 'Nulla']
+        r1=ropes.Rope(para3)+ropes.Rope(para4)*2+ropes.Rope(para5)[5:]
+        s1=para3+para4*2+para5[5:]
+        expected=[]
+        for i in range(len(s1)):
+            for k, pattern in enumerate(patterns):
+                if s1.startswith(pattern, i):
+                    expected.append((i, k))
+        ps=ropes.PatternSet(patterns)
+        self.assertEqual(sorted(r1.find_any(ps)), expected)
+        self.assertEqual(sorted(r1.find_any(patterns)), expected)
+        self.assertEqual(list(ropes.Rope('ushers').find_any(['he', 'she', 'hers'])),
+                         [(1, 1), (2, 0), (2, 2)])
+        self.assertRaises(ValueError, ropes.PatternSet, [''])
+
+    def testInterning(self):
+        ropes.set_interning(True)
+        try:
+            r1=ropes.Rope(para2)
+            r2=ropes.Rope(para2)
+            self.assert_(r1 is r2)
+            self.assertEqual(r1, r2)
+            self.assertNotEqual(r1, ropes.Rope(para3[:len(para2)]))
+            leaves=ropes.intern_stats()['leaves']
+            del r1, r2
+            self.assertEqual(ropes.intern_stats()['leaves'], leaves-1)
+            ropes.set_interning(True, max_bytes=0)
+            self.assert_(ropes.Rope(para4) is not ropes.Rope(para4))
+        finally:
+            ropes.set_interning(False)
+
+    def testCompression(self):
+        ropes.set_compression(True, hot_bytes=0, min_leaf=64)
+        try:
+            r1=ropes.Rope('')
+            for i in range(10):
+                r1+=ropes.Rope(para1*(i+2))
+            s1=str(r1)
+            r2=r1.upper()
+            r1.compress()
+            stats=ropes.compression_stats()
+            self.assert_(stats['cold_leaves'] >= 10)
+            self.assert_(stats['saved_bytes'] > len(s1)/2)
+            self.assertEqual(r1[len(s1)/2], s1[len(s1)/2])
+            self.assertEqual(str(r1[100:-100]), s1[100:-100])
+            self.assertEqual(''.join(reversed(r1)), s1[::-1])
+            self.assertEqual(str(r2), s1.upper())
+            self.assertEqual(r1.count('a'), s1.count('a'))
+            self.assertEqual(str(ropes.loads(r1.dumps())), s1)
+            self.assert_(ropes.compression_stats()['decompressions'] >
+                         stats['decompressions'])
+            del r1, r2
+            self.assertEqual(ropes.compression_stats()['cold_leaves'],
+                             stats['cold_leaves']-10)
+        finally:
+            ropes.set_compression(False)
+
+    def testFlatCache(self):
+        ropes.set_flat_cache(len(para1)*4)
+        try:
+            r1=ropes.Rope(para1)+ropes.Rope(para2)*10
+            s1=str(r1)
+            self.assert_(str(r1) is s1)
+            self.assertEqual(r1[len(para1)+5], s1[len(para1)+5])
+            self.assertEqual(str(r1.upper()[10:-10]), s1.upper()[10:-10])
+            r1+=ropes.Rope('tail')
+            self.assertEqual(str(r1), s1+'tail')
+            r2=ropes.Rope(para1)*3
+            str(r2)
+            self.assertEqual(ropes.flat_cache_stats()['ropes'], 1)
+        finally:
+            ropes.set_flat_cache(0)
+        self.assertEqual(ropes.flat_cache_stats()['bytes'], 0)
+
+    def testBuffer(self):
+        r1=ropes.Rope(para2)+ropes.Rope(para3)*10
+        s1=para2+para3*10
+        self.assertEqual(hashlib.md5(r1).digest(), hashlib.md5(s1).digest())
+        self.assertEqual(zlib.decompress(zlib.compress(r1)), s1)
+        self.assertEqual(memoryview(r1).tobytes(), s1)
+        self.assertEqual(str(buffer(r1)), s1)
+        r2=ropes.Rope(para4)
+        self.assertEqual(zlib.crc32(r2), zlib.crc32(para4))
+        self.assertEqual(memoryview(ropes.Rope('')).tobytes(), '')
+
+    def testSharedMemory(self):
+        r1=ropes.Rope(para2)+(ropes.Rope(para3)*10).upper()+ropes.Rope(para4)
+        name='/ropes-test-%d' % os.getpid()
+        segment=r1.share(name)
+        try:
+            self.assertRaises(OSError, r1.share, name)
+            pid=os.fork()
+            if pid == 0:
+                os._exit(ropes.attach(name) != r1)
+            self.assertEqual(os.waitpid(pid, 0)[1], 0)
+            r2=ropes.attach(name)
+        finally:
+            segment.unlink()
+        del segment
+        self.assertEqual(str(r2), str(r1))
+        self.assertEqual(str(r2[len(para2):len(para2)+10]),
+                         para3[:10].upper())
+        self.assertRaises(OSError, ropes.attach, name)
+
+    def testPolicy(self):
+        def build(n):
+            r=ropes.Rope('')
+            for i in range(n):
+                r=r+ropes.Rope('line %05d\n' % i)
+            return r
+        s1=''.join(['line %05d\n' % i for i in range(3000)])
+        try:
+            ropes.set_policy(leaf_length=16)
+            r1=build(3000)
+            ropes.set_policy(leaf_length=65536, balance_depth=24)
+            r2=build(3000)
+            self.assertEqual(str(r1), s1)
+            self.assertEqual(str(r2), s1)
+            self.assert_(len(list(r2.rchunks())) < len(list(r1.rchunks())))
+            e=r1.edit(leaf_length=65536)
+            e.insert(5, 'x')
+            self.assert_(len(list(e.commit().rchunks())) <
+                         len(list(r1.rchunks())))
+            self.assertRaises(ValueError, ropes.set_policy, leaf_length=0)
+            self.assertRaises(ValueError, ropes.set_policy, balance_depth=3)
+            self.assertRaises(ValueError, r1.edit, balance_depth=100)
+            ropes.set_policy(leaf_length=1024, balance_depth=32,
+                             adaptive=True)
+            for i in range(5000):
+                r1=r1[:100]+ropes.Rope('ab')+r1[100:]
+            self.assertEqual(ropes.policy()['leaf_length'], 64)
+            for i in range(500):
+                str(r2)
+            self.assert_(ropes.policy()['leaf_length'] > 1024)
+            self.assert_(ropes.policy()['retunes'] > 0)
+        finally:
+            ropes.set_policy(leaf_length=1024, balance_depth=32,
+                             adaptive=False)
+
+    def testReadFrom(self):
+        s1=(para1+para2+para3+para4)*20
+        r1=ropes.Rope.read_from(io.BytesIO(s1))
+        self.assertEqual(str(r1), s1)
+        self.assertEqual(str(ropes.Rope.read_from(StringIO.StringIO(s1),
+                                                  1000)), s1[:1000])
+        self.assert_(len(list(ropes.Rope.read_from(io.BytesIO(s1),
+                     leaf_length=128).rchunks())) > len(list(r1.rchunks())))
+        rfd, wfd=os.pipe()
+        pid=os.fork()
+        if pid == 0:
+            os.close(rfd)
+            for i in range(0, len(s1), 1000):
+                os.write(wfd, s1[i:i+1000])
+            os._exit(0)
+        os.close(wfd)
+        try:
+            r2=ropes.Rope.read_from(rfd, len(s1)-10)
+            r3=ropes.Rope.read_from(rfd)
+        finally:
+            os.close(rfd)
+            os.waitpid(pid, 0)
+        self.assertEqual(str(r2), s1[:-10])
+        self.assertEqual(str(r3), s1[-10:])
+        self.assertRaises(TypeError, ropes.Rope.read_from, 'text')
+        self.assertRaises(ValueError, ropes.Rope.read_from, -1)
+        self.assertRaises(OverflowError, ropes.Rope.read_from, 2**32, 3)
+        self.assertRaises(OverflowError, ropes.Rope.read_from, 2**64, 3)
+
+    def testReadFromKeptView(self):
+        s1=(para1+para2+para3+para4)*200
+        class Keeper(object):
+            def __init__(self):
+                self.f=io.BytesIO(s1)
+                self.views=[]
+            def readinto(self, b):
+                self.views.append(b)
+                self.views.append(b[2:10])
+                return self.f.readinto(b)
+        k=Keeper()
+        r1=ropes.Rope.read_from(k)
+        self.assertEqual(str(r1), s1)
+        for view in k.views:
+            if len(view):
+                view[0]='Z'
+                view[len(view)-1]='Q'
+        self.assertEqual(str(r1), s1)
+        r1+=ropes.Rope('tail')
+        self.assertEqual(str(r1), s1+'tail')
+        del r1
+        for view in k.views:
+            if len(view):
+                view[0]='Y'
+
+    def testAffixes(self):
+        r1=ropes.Rope('  \t'+para2)+ropes.Rope(para3)*30+ropes.Rope(para4+'\n ')
+        s1='  \t'+para2+para3*30+para4+'\n '
+        self.assert_(r1.startswith('  \tCras'))
+        self.assert_(r1.startswith(ropes.Rope('Cras'), 3))
+        self.assert_(r1.endswith(('nope', para4+'\n ')))
+        self.assert_(r1.endswith(r1[-700:]))
+        self.failIf(r1.startswith('Cras'))
+        self.failIf(r1.endswith('tortor.', 0, -3) != s1.endswith('tortor.', 0, -3))
+        self.assertEqual(str(r1.strip()), s1.strip())
+        self.assertEqual(str(r1.lstrip(' ')), s1.lstrip(' '))
+        self.assertEqual(str(r1.rstrip('\n ')), s1.rstrip('\n '))
+        self.assertEqual(str(ropes.Rope('   ').strip()), '')
+        for c in 'aeiou\n':
+            self.assertEqual(r1.count(c), s1.count(c))
+            self.assertEqual(r1.count(c, 100, -100), s1.count(c, 100, -100))
+        self.assertEqual(r1.upper().count('A'), s1.upper().count('A'))
+        self.assertRaises(ValueError, r1.count, 'ab')
+
+    def testTake(self):
+        r1=(ropes.Rope(para2)+ropes.Rope(para3)*20+ropes.Rope(para4))[5:-5]
+        s1=(para2+para3*20+para4)[5:-5]
+        indices=[random.randrange(-len(s1), len(s1)) for i in range(2000)]
+        self.assertEqual(r1.take(indices), ''.join([s1[i] for i in indices]))
+        self.assertEqual(r1.take(bytearray('\x07\x03')), s1[7]+s1[3])
+        self.assertEqual(r1.take((ctypes.c_int32*3)(9, -2, 0)),
+                         s1[9]+s1[-2]+s1[0])
+        self.assertEqual(r1.take((ctypes.c_uint64*2)(4, 1)), s1[4]+s1[1])
+        # unsigned offsets too large for Py_ssize_t do not wrap around
+        # to offsets from the end
+        self.assertRaises(IndexError, r1.take, (ctypes.c_uint64*2)(1, 2**64-1))
+        self.assertRaises(IndexError, r1.take, (ctypes.c_uint64*1)(2**63))
+        self.assertRaises(IndexError, r1.take, (ctypes.c_size_t*1)(2**64-3))
+        self.assertEqual(r1.take([]), '')
+        self.assertRaises(IndexError, r1.take, [len(s1)])
+        ranges=[(100, 200), (-50, len(s1)+10), (150, 5000), (7, 3), (0, 1)]
+        self.assertEqual(r1.upper().extract(ranges),
+                         [s1.upper()[a:b] for a, b in ranges])
+        self.assertRaises(TypeError, r1.extract, [5])
+
+    def testEdit(self):
+        r1=ropes.Rope(para2)+ropes.Rope(para3)*20+ropes.Rope(para4)
+        s1=para2+para3*20+para4
+        with r1.edit() as e:
+            e.replace(1000, 1010, 'replaced')
+            e.insert(5, ropes.Rope('first'))
+            e.delete(-10, len(r1))
+            e.insert(5, 'second')
+            e.delete(0, 5)
+            self.assertEqual(len(e), 5)
+        self.assertEqual(str(e.result),
+                         'firstsecond'+s1[5:1000]+'replaced'+s1[1010:-10])
+        self.assertRaises(ValueError, e.insert, 0, 'late')
+        self.assertEqual(str(r1), s1)
+        e=r1.edit()
+        e.delete(10, 20)
+        e.replace(15, 30, 'x')
+        self.assertRaises(ValueError, e.commit)
+        self.assertEqual(str(r1.edit().commit()), s1)
+
+    def testRopeIO(self):
+        r1=ropes.Rope(para2+'\n')+ropes.Rope(para3+'\n')*20+ropes.Rope(para4)
+        s1=para2+'\n'+(para3+'\n')*20+para4
+        f=ropes.RopeIO(r1)
+        self.assertEqual(f.readline(), para2+'\n')
+        self.assertEqual(f.read(10), para3[:10])
+        buf=bytearray(1000)
+        self.assertEqual(f.readinto(buf), 1000)
+        self.assertEqual(str(buf), s1[len(para2)+11:len(para2)+1011])
+        f.seek(-len(para4), 2)
+        self.assertEqual(f.read(), para4)
+        self.assertEqual(f.tell(), len(s1))
+        f.seek(0)
+        self.assertEqual(list(f), s1.splitlines(True))
+        f=ropes.RopeIO()
+        rows=[[str(i), para2[:i]] for i in range(100)]
+        csv.writer(f).writerows(rows)
+        f.seek(0)
+        f.write('X')
+        self.assertEqual(f.tell(), 1)
+        self.assertEqual(str(f.getvalue())[:4], 'X,\r\n')
+        f.seek(0)
+        self.assertEqual(list(csv.reader(f))[1:], rows[1:])
+        f.close()
+        self.assertRaises(ValueError, f.read)
+
+    def testDiff(self):
+        r1=ropes.Rope(para2)+ropes.Rope(para3)+ropes.Rope(para4)*3
+        s1=para2+para3+para4*3
+        r2=r1[:100]+ropes.Rope('inserted')+r1[100:1000]+r1[1010:]
+        s2=s1[:100]+'inserted'+s1[100:1000]+s1[1010:]
+        self.assertEqual(r1.common_prefix_length(r2), 100)
+        self.assertEqual(r1.common_suffix_length(r2), len(s1)-1010)
+        self.assertEqual(r1.common_prefix_length(s1), len(s1))
+        self.assertEqual(r1.diff(r2), [(100, 100, 100, 108), (1000, 1010, 1008, 1008)])
+        self.assertEqual(r1.diff(r1), [])
+        self.assertEqual(ropes.Rope('abc').diff(ropes.Rope('xyz')), [(0, 3, 0, 3)])
+        # copies of a shared repeat are skipped as a whole, so the cost
+        # does not grow with the repeat count
+        r1=ropes.Rope('xy'*600)*(1<<26)
+        n=len(r1)
+        r2=ropes.Rope('Q')+r1[1:-1]+ropes.Rope('Q')
+        r3=ropes.Rope('A')+r1[1200:]+ropes.Rope('B')
+        t=time.time()
+        self.assertEqual(r1.diff(r2), [(0, 1, 0, 1), (n-1, n, n-1, n)])
+        self.assertEqual(r1.common_prefix_length(r1[1200:]), n-1200)
+        self.assertEqual(r1.common_suffix_length(r3[:-1]), n-1200)
+        hunks=r1.diff(r3)
+        self.assert_(len(hunks) <= 3)
+        self.assert_(time.time()-t < 0.5)
+
+    def testCAPI(self):
+        self.assertEqual(type(ropes._C_API).__name__, 'PyCapsule')
+        self.assert_('ropes._C_API' in repr(ropes._C_API))
+        # call through the table the way an extension module would,
+        # laid out as in ropes.h
+        api=ctypes.pythonapi
+        obj, ssize=ctypes.py_object, ctypes.c_ssize_t
+        chunkfunc=ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ssize,
+                                   ctypes.c_void_p)
+        class Cursor(ctypes.Structure):
+            _fields_=[('rope', ctypes.c_void_p), ('pos', ssize)]
+        class CAPI(ctypes.Structure):
+            _fields_=[
+                ('version', ctypes.c_int),
+                ('RopeType', ctypes.c_void_p),
+                ('FromBuffer', ctypes.PYFUNCTYPE(obj, ctypes.c_char_p, ssize)),
+                ('Concat', ctypes.PYFUNCTYPE(obj, obj, obj)),
+                ('Slice', ctypes.PYFUNCTYPE(obj, obj, ssize, ssize)),
+                ('Length', ctypes.PYFUNCTYPE(ssize, obj)),
+                ('Hash', ctypes.PYFUNCTYPE(ctypes.c_long, obj)),
+                ('ForEachChunk', ctypes.PYFUNCTYPE(ctypes.c_int, obj, ssize,
+                                                   ssize, chunkfunc,
+                                                   ctypes.c_void_p)),
+                ('Copy', ctypes.PYFUNCTYPE(ssize, obj, ssize, ssize,
+                                           ctypes.c_char_p)),
+                ('CursorInit', ctypes.PYFUNCTYPE(ctypes.c_int,
+                                                 ctypes.POINTER(Cursor),
+                                                 obj, ssize)),
+                ('CursorNext', ctypes.PYFUNCTYPE(
+                    ssize, ctypes.POINTER(Cursor),
+                    ctypes.POINTER(ctypes.c_void_p))),
+            ]
+        api.PyCapsule_GetPointer.restype=ctypes.POINTER(CAPI)
+        api.PyCapsule_GetPointer.argtypes=[obj, ctypes.c_char_p]
+        capi=api.PyCapsule_GetPointer(ropes._C_API, 'ropes._C_API').contents
+        self.assertEqual(capi.version, 1)
+        self.assertEqual(capi.RopeType, id(ropes.Rope))
+
+        r1=capi.FromBuffer(para1, len(para1))
+        self.assertEqual(type(r1), ropes.Rope)
+        self.assertEqual(str(r1), para1)
+        r1=capi.Concat(r1, (ropes.Rope(para2)*20).upper())
+        s1=para1+(para2*20).upper()
+        self.assertEqual(str(r1), s1)
+        self.assertEqual(capi.Length(r1), len(s1))
+        self.assertEqual(capi.Hash(r1), hash(r1))
+        r2=capi.Slice(r1, 100, len(s1)-100)
+        s2=s1[100:-100]
+        self.assertEqual(str(r2), s2)
+        self.assertEqual(capi.Length(r2), len(s2))
+        self.assertRaises(TypeError, capi.Length, 'abc')
+        dst=ctypes.create_string_buffer(len(s2))
+        self.assertEqual(capi.Copy(r2, 0, len(s2), dst), len(s2))
+        self.assertEqual(dst.raw, s2)
+        self.assertEqual(capi.Copy(r2, -5, 10, dst), 10)
+        self.assertEqual(dst.raw[:10], s2[:10])
+
+        # runs over substring and transform nodes, whole and clipped
+        for r3, s3 in [(r2, s2), (r2.upper()[7:], s2.upper()[7:]),
+                       (ropes.Rope(para3)[5:50], para3[5:50])]:
+            runs=[]
+            def collect(data, length, arg):
+                runs.append(ctypes.string_at(data, length))
+                return 0
+            self.assertEqual(capi.ForEachChunk(r3, 0, len(s3),
+                                               chunkfunc(collect), None), 0)
+            self.assertEqual(''.join(runs), s3)
+            runs=[]
+            self.assertEqual(capi.ForEachChunk(r3, 3, 30, chunkfunc(collect),
+                                               None), 0)
+            self.assertEqual(''.join(runs), s3[3:30])
+            runs=[]
+            def stop(data, length, arg):
+                runs.append(ctypes.string_at(data, length))
+                return 1
+            self.assertEqual(capi.ForEachChunk(r3, 0, len(s3), chunkfunc(stop),
+                                               None), 1)
+            self.assertEqual(len(runs), 1)
+            self.assert_(s3.startswith(runs[0]))
+
+            cursor=Cursor()
+            self.assertEqual(capi.CursorInit(ctypes.byref(cursor), r3, 4), 0)
+            self.assertEqual(cursor.pos, 4)
+            data=ctypes.c_void_p()
+            runs=[]
+            while True:
+                n=capi.CursorNext(ctypes.byref(cursor), ctypes.byref(data))
+                self.assert_(n >= 0)
+                if n == 0:
+                    break
+                runs.append(ctypes.string_at(data, n))
+            self.assertEqual(''.join(runs), s3[4:])
+            self.assertEqual(cursor.pos, len(s3))
+        self.assertRaises(IndexError, capi.CursorInit, ctypes.byref(cursor),
+                          r2, len(s2)+1)
+
     def testComparisons(self):
         r1=ropes.Rope(para1+para2)
         r2=ropes.Rope(para1)
@@ -69,5 +603,51 @@ class TestRopes(unittest.TestCase):
         r2+=ropes.Rope('hello')
         self.assertEqual(r1, r2)
 
+    def testPickling(self):
+        r1=ropes.Rope('hello')*1000
+        r2=r1+ropes.Rope(para2)+r1
+        data=r2.dumps()
+        self.assert_(len(data) < len(para2)+100)
+        self.assertEqual(str(ropes.loads(data)), str(r2))
+        for protocol in range(3):
+            r3=pickle.loads(pickle.dumps(r2, protocol))
+            self.assertEqual(str(r3), str(r2))
+        self.assertRaises(ValueError, ropes.loads, data[:-1])
+        # a chain of concatenations deeper than any rope this module
+        # builds is refused rather than left to overflow the stack
+        def varint(n):
+            out=''
+            while n >= 0x80:
+                out+=chr(n & 0x7f | 0x80)
+                n>>=7
+            return out+chr(n)
+        nodes=[chr(ropes.LITERAL_NODE)+varint(1)]
+        for i in range(1, 200000):
+            nodes.append(chr(ropes.CONCAT_NODE)+varint(i-1)+varint(0))
+        data='RoPe\x01'+varint(len(nodes))+varint(1)+''.join(nodes)+'a'
+        self.assertRaises(ValueError, ropes.loads, data)
+        self.assertEqual(str(ropes.loads(data[:5]+varint(90)+varint(1)+
+                                         ''.join(nodes[:90])+'a')), 'a'*90)
+
+    def testLoadsInplace(self):
+        r1=ropes.Rope('bbb')+ropes.Rope(para1)
+        data=r1.dumps()
+        # writable buffers are copied, so neither writes nor resizes
+        # reach the rope
+        b=bytearray(data)
+        r2=ropes.loads(b, inplace=True)
+        b[-1]='Z'
+        del b[:]
+        b.extend('x'*100000)
+        self.assertEqual(str(r2), 'bbb'+para1)
+        # a read-only buffer is used in place and kept alive by the rope
+        v=memoryview(data)
+        r3=ropes.loads(v, inplace=True)
+        del v
+        self.assertEqual(str(r3), 'bbb'+para1)
+        self.assertEqual(str(ropes.loads(bytearray(data))), 'bbb'+para1)
+        self.assertRaises(ValueError, ropes.loads, bytearray(data[:-1]),
+                          inplace=True)
+
 if __name__=="__main__":
     unittest.main()